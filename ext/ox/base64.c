@@ -5,9 +5,22 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "base64.h"
 
+/* On x86-64 the bulk of the encoding and decoding is done 12 or 24 bytes at a
+ * time with SSSE3 or AVX2, picked when first used based on what the CPU
+ * supports. The table driven loops below finish whatever is left and are the
+ * only code used elsewhere.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define B64_X86	1
+#include <immintrin.h>
+#else
+#define B64_X86	0
+#endif
+
 static char	digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
 /* invalid or terminating characters are set to 'X' or \x58 */
@@ -29,12 +42,173 @@ static uchar	s_digits[256] = "\
 \x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\
 \x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58\x58";
 
+#if B64_X86
+static int	simd_level = -1;
+
+static int
+get_simd_level(void) {
+    if (0 > simd_level) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+	    simd_level = 2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+	    simd_level = 1;
+	} else {
+	    simd_level = 0;
+	}
+    }
+    return simd_level;
+}
+
+/* Maps 6 bit values to base64 digits using the offset of the range each one
+ * falls in.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i
+enc_translate_ssse3(__m128i in) {
+    const __m128i	lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					    '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    __m128i		idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+
+    idx = _mm_or_si128(idx, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), in), _mm_set1_epi8(13)));
+
+    return _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+}
+
+/* Returns the number of src bytes encoded, always a multiple of 3. */
+__attribute__((target("ssse3")))
+static size_t
+enc_ssse3(const uchar *src, size_t len, char *b64) {
+    const uchar		*start = src;
+    const __m128i	shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+
+    for (; 16 <= len; src += 12, len -= 12, b64 += 16) {
+	__m128i	in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), shuf);
+	__m128i	t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+	__m128i	t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+
+	_mm_storeu_si128((__m128i*)b64, enc_translate_ssse3(_mm_or_si128(t0, t1)));
+    }
+    return src - start;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+enc_translate_avx2(__m256i in) {
+    const __m256i	lut = _mm256_broadcastsi128_si256(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+									'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0));
+    __m256i		idx = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+
+    idx = _mm256_or_si256(idx, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), in), _mm256_set1_epi8(13)));
+
+    return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, idx));
+}
+
+__attribute__((target("avx2")))
+static size_t
+enc_avx2(const uchar *src, size_t len, char *b64) {
+    const uchar		*start = src;
+    const __m256i	shuf = _mm256_broadcastsi128_si256(_mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+    for (; 28 <= len; src += 24, len -= 24, b64 += 32) {
+	__m256i	in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)src)),
+					     _mm_loadu_si128((const __m128i*)(src + 12)), 1);
+	__m256i	t0;
+	__m256i	t1;
+
+	in = _mm256_shuffle_epi8(in, shuf);
+	t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+	t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+	_mm256_storeu_si256((__m256i*)b64, enc_translate_avx2(_mm256_or_si256(t0, t1)));
+    }
+    return src - start;
+}
+
+/* Returns the number of base64 characters decoded, a multiple of 4. A block
+ * with anything other than a digit in it, including the '=' padding and the
+ * terminating '\0', is left for the table driven loop. At least 24 characters
+ * are always left so the 16 byte stores never go past the decoded size.
+ */
+__attribute__((target("ssse3")))
+static size_t
+dec_ssse3(const char *b64, size_t len, uchar *str) {
+    const char		*start = b64;
+    const __m128i	lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i	lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i	lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i	mask_2f = _mm_set1_epi8(0x2F);
+    const __m128i	pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    for (; 24 <= len; b64 += 16, len -= 16, str += 12) {
+	__m128i	in = _mm_loadu_si128((const __m128i*)b64);
+	__m128i	hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+	__m128i	lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(in, mask_2f));
+	__m128i	hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+
+	if (0 != _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()))) {
+	    break;
+	}
+	in = _mm_add_epi8(in, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f), hi_nibbles)));
+	in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+	in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+	_mm_storeu_si128((__m128i*)str, _mm_shuffle_epi8(in, pack));
+    }
+    return b64 - start;
+}
+
+__attribute__((target("avx2")))
+static size_t
+dec_avx2(const char *b64, size_t len, uchar *str) {
+    const char		*start = b64;
+    const __m256i	lut_lo = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+									   0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A));
+    const __m256i	lut_hi = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+									   0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+    const __m256i	lut_roll = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+    const __m256i	mask_2f = _mm256_set1_epi8(0x2F);
+    const __m256i	pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    const __m256i	lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+    for (; 48 <= len; b64 += 32, len -= 32, str += 24) {
+	__m256i	in = _mm256_loadu_si256((const __m256i*)b64);
+	__m256i	hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+	__m256i	lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, mask_2f));
+	__m256i	hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+
+	if (!_mm256_testz_si256(lo, hi)) {
+	    break;
+	}
+	in = _mm256_add_epi8(in, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask_2f), hi_nibbles)));
+	in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+	in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+	in = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(in, pack), lanes);
+	_mm256_storeu_si256((__m256i*)str, in);
+    }
+    return b64 - start;
+}
+#endif
+
 void
 to_base64(const uchar *src, int len, char *b64) {
     const uchar	*end3;
-    int		len3 = len % 3;
+    int		len3;
     uchar	b1, b2, b3;
     
+#if B64_X86
+    if (0 < len) {
+	size_t	done = 0;
+
+	switch (get_simd_level()) {
+	case 2:	done = enc_avx2(src, len, b64);		break;
+	case 1:	done = enc_ssse3(src, len, b64);	break;
+	default:					break;
+	}
+	src += done;
+	b64 += done / 3 * 4;
+	len -= (int)done;
+    }
+#endif
+    len3 = len % 3;
     end3 = src + (len - len3);
     while (src < end3) {
 	b1 = *src++;
@@ -86,6 +260,28 @@ void
 from_base64(const char *b64, uchar *str) {
     uchar	b0, b1, b2, b3;
     
+#if B64_X86
+    switch (get_simd_level()) {
+    case 2:
+    {
+	size_t	done = dec_avx2(b64, strlen(b64), str);
+
+	b64 += done;
+	str += done / 4 * 3;
+	break;
+    }
+    case 1:
+    {
+	size_t	done = dec_ssse3(b64, strlen(b64), str);
+
+	b64 += done;
+	str += done / 4 * 3;
+	break;
+    }
+    default:
+	break;
+    }
+#endif
     while (1) {
         if ('X' == (b0 = s_digits[(uchar)*b64++])) { break; }
         if ('X' == (b1 = s_digits[(uchar)*b64++])) { break; }
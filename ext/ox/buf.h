@@ -33,6 +33,9 @@
 
 #include <stdbool.h>
 #include <unistd.h>
+#if HAS_ZLIB
+#include <zlib.h>
+#endif
 
 typedef struct _Buf {
     char	*head;
@@ -40,9 +43,15 @@ typedef struct _Buf {
     char	*tail;
     int		fd;
     bool	err;
+#if HAS_ZLIB
+    gzFile	gz;	/* if set output is compressed before writing to fd */
+#endif
     char	base[16384];
 } *Buf;
 
+/* Appends XML escaped text, see builder.c. */
+extern size_t	buf_append_xml(Buf buf, const char *str, size_t size, size_t *usedp);
+
 inline static void
 buf_init(Buf buf, int fd, long initial_size) {
     if (sizeof(buf->base) < (size_t)initial_size) {
@@ -55,6 +64,49 @@ buf_init(Buf buf, int fd, long initial_size) {
     buf->tail = buf->head;
     buf->fd = fd;
     buf->err = false;
+#if HAS_ZLIB
+    buf->gz = 0;
+#endif
+}
+
+#if HAS_ZLIB
+/* Compresses everything written to the fd from now on with the gzip level
+ * given. Returns false if the stream could not be set up.
+ */
+inline static bool
+buf_gzip(Buf buf, int level) {
+    char	mode[8];
+    int		fd = dup(buf->fd);
+
+    snprintf(mode, sizeof(mode), "wb%d", level);
+    if (0 > fd || 0 == (buf->gz = gzdopen(fd, mode))) {
+	if (0 <= fd) {
+	    close(fd);
+	}
+	return false;
+    }
+    return true;
+}
+#endif
+
+/* Writes the contents of the buffer to the fd and empties it. */
+inline static void
+buf_flush(Buf buf) {
+    size_t	len = buf->tail - buf->head;
+
+    if (0 < len) {
+#if HAS_ZLIB
+	if (0 != buf->gz) {
+	    if ((int)len != gzwrite(buf->gz, buf->head, (unsigned int)len)) {
+		buf->err = true;
+	    }
+	} else
+#endif
+	if (len != (size_t)write(buf->fd, buf->head, len)) {
+	    buf->err = true;
+	}
+    }
+    buf->tail = buf->head;
 }
 
 inline static void
@@ -68,6 +120,12 @@ buf_cleanup(Buf buf) {
     if (buf->base != buf->head) {
         free(buf->head);
     }
+#if HAS_ZLIB
+    if (0 != buf->gz) {
+	gzclose(buf->gz);
+	buf->gz = 0;
+    }
+#endif
 }
 
 inline static size_t
@@ -82,12 +140,7 @@ buf_append_string(Buf buf, const char *s, size_t slen) {
     }
     if (buf->end <= buf->tail + slen) {
 	if (0 != buf->fd) {
-	    size_t	len = buf->tail - buf->head;
-
-	    if (len != (size_t)write(buf->fd, buf->head, len)) {
-		buf->err = true;
-	    }
-	    buf->tail = buf->head;
+	    buf_flush(buf);
 	} else {
 	    size_t	len = buf->end - buf->head;
 	    size_t	toff = buf->tail - buf->head;
@@ -116,12 +169,7 @@ buf_append(Buf buf, char c) {
     }
     if (buf->end <= buf->tail) {
 	if (0 != buf->fd) {
-	    size_t	len = buf->tail - buf->head;
-
-	    if (len != (size_t)write(buf->fd, buf->head, len)) {
-		buf->err = true;
-	    }
-	    buf->tail = buf->head;
+	    buf_flush(buf);
 	} else {
 	    size_t	len = buf->end - buf->head;
 	    size_t	toff = buf->tail - buf->head;
@@ -147,13 +195,16 @@ buf_finish(Buf buf) {
 	return;
     }
     if (0 != buf->fd) {
-	size_t	len = buf->tail - buf->head;
-
-	if (0 < len && len != (size_t)write(buf->fd, buf->head, len)) {
-	    buf->err = true;
+	buf_flush(buf);
+#if HAS_ZLIB
+	if (0 != buf->gz) {
+	    if (Z_OK != gzclose(buf->gz)) {
+		buf->err = true;
+	    }
+	    buf->gz = 0;
 	}
+#endif
 	fsync(buf->fd);
-	buf->tail = buf->head;
     }
 }
 
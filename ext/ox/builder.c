@@ -11,6 +11,7 @@
 #include "ox.h"
 #include "buf.h"
 #include "err.h"
+#include "dbl.h"
 
 #define MAX_DEPTH	128
 
@@ -32,6 +33,8 @@ typedef struct _Builder {
     long		line;
     long		col;
     long		pos;
+    VALUE		chunk_proc;	/* called with each chunk set up by each_chunk() */
+    long		chunk_size;
 } *Builder;
 
 static VALUE		builder_class = Qundef;
@@ -51,9 +54,10 @@ static char	xml_friendly_chars[257] = "\
 
 inline static size_t
 xml_str_len(const unsigned char *str, size_t len) {
-    size_t	size = 0;
+    const unsigned char	*end = str + len;
+    size_t		size = 0;
 
-    for (; 0 < len; str++, len--) {
+    for (; str < end; str++) {
 	size += xml_friendly_chars[*str];
     }
     return size - len * (size_t)'0';
@@ -64,7 +68,7 @@ append_indent(Builder b) {
     if (0 >= b->indent) {
 	return;
     }
-    if (b->buf.head < b->buf.tail) {
+    if (0 < b->pos) {
 	int	cnt = (b->indent * (b->depth + 1)) + 1;
 
 	if (sizeof(indent_spaces) <=  (size_t)cnt) {
@@ -77,78 +81,79 @@ append_indent(Builder b) {
     }
 }
 
-static void
-append_string(Builder b, const char *str, size_t size) {
+/* Appends str with the XML special characters replaced by entities and
+ * returns the number of bytes written. Stops at a NUL. The number of bytes of
+ * str used is returned in usedp. Raises a SyntaxError on a character that is
+ * not allowed in XML. Shared with Ox::Template.
+ */
+size_t
+buf_append_xml(Buf buf, const char *str, size_t size, size_t *usedp) {
     size_t	xsize = xml_str_len((const unsigned char*)str, size);
+    char	tmp[256];
+    char	*end = tmp + sizeof(tmp) - 1;
+    char	*bp = tmp;
+    const char	*start = str;
+    size_t	i = size;
+    int		fcnt;
 
     if (size == xsize) {
-	const char	*s = str;
-	const char	*end = str + size;
-	
-	buf_append_string(&b->buf, str, size);
-	b->col += size;
-        s = strchr(s, '\n');
-        while (NULL != s) {
-            b->line++;
-            b->col = end - s;
-            s = strchr(s + 1, '\n');
-        }
-	b->pos += size;
-    } else {
-	char	buf[256];
-	char	*end = buf + sizeof(buf) - 1;
-	char	*bp = buf;
-	int	i = size;
-	int	fcnt;
-	
-	for (; '\0' != *str && 0 < i; i--, str++) {
-	    if ('1' == (fcnt = xml_friendly_chars[(unsigned char)*str])) {
-		if (end <= bp) {
-		    buf_append_string(&b->buf, buf, bp - buf);
-		    bp = buf;
-		}
-		if ('\n' == *str) {
-		    b->line++;
-		    b->col = 1;
-		} else {
-		    b->col++;
-		}
-		b->pos++;
-		*bp++ = *str;
-	    } else {
-		b->pos += fcnt;
-		b->col += fcnt;
-		if (buf < bp) {
-		    buf_append_string(&b->buf, buf, bp - buf);
-		    bp = buf;
-		}
-		switch (*str) {
-		case '"':
-		    buf_append_string(&b->buf, "&quot;", 6);
-		    break;
-		case '&':
-		    buf_append_string(&b->buf, "&amp;", 5);
-		    break;
-		case '\'':
-		    buf_append_string(&b->buf, "&apos;", 6);
-		    break;
-		case '<':
-		    buf_append_string(&b->buf, "&lt;", 4);
-		    break;
-		case '>':
-		    buf_append_string(&b->buf, "&gt;", 4);
-		    break;
-		default:
-		    // Must be one of the invalid characters.
-		    rb_raise(rb_eSyntaxError, "'\\#x%02x' is not a valid XML character.", *str);
-		    break;
-		}
+	buf_append_string(buf, str, size);
+	*usedp = size;
+	return size;
+    }
+    xsize = 0;
+    for (; '\0' != *str && 0 < i; i--, str++) {
+	if ('1' == (fcnt = xml_friendly_chars[(unsigned char)*str])) {
+	    if (end <= bp) {
+		buf_append_string(buf, tmp, bp - tmp);
+		bp = tmp;
 	    }
+	    *bp++ = *str;
+	    xsize++;
+	} else {
+	    if (tmp < bp) {
+		buf_append_string(buf, tmp, bp - tmp);
+		bp = tmp;
+	    }
+	    switch (*str) {
+	    case '"':	buf_append_string(buf, "&quot;", 6);	break;
+	    case '&':	buf_append_string(buf, "&amp;", 5);	break;
+	    case '\'':	buf_append_string(buf, "&apos;", 6);	break;
+	    case '<':	buf_append_string(buf, "&lt;", 4);	break;
+	    case '>':	buf_append_string(buf, "&gt;", 4);	break;
+	    default:
+		// Must be one of the invalid characters.
+		rb_raise(rb_eSyntaxError, "'\\#x%02x' is not a valid XML character.", *str);
+		break;
+	    }
+	    xsize += fcnt - '0';
 	}
-	if (buf < bp) {
-	    buf_append_string(&b->buf, buf, bp - buf);
-	    bp = buf;
-	}
+    }
+    if (tmp < bp) {
+	buf_append_string(buf, tmp, bp - tmp);
+    }
+    *usedp = str - start;
+
+    return xsize;
+}
+
+static void
+append_string(Builder b, const char *str, size_t size) {
+    size_t	used;
+    size_t	xsize = buf_append_xml(&b->buf, str, size, &used);
+    const char	*end = str + used;
+    const char	*last = NULL;
+    const char	*s;
+
+    b->pos += xsize;
+    for (s = memchr(str, '\n', used); NULL != s; s = memchr(s + 1, '\n', end - s - 1)) {
+	b->line++;
+	last = s;
+    }
+    if (NULL == last) {
+	b->col += xsize;
+    } else {
+	b->col = 1 + xml_str_len((const unsigned char*)last + 1, end - last - 1);
     }
 }
 
@@ -217,6 +222,15 @@ init(Builder b, int fd, int indent, long initial_size) {
     b->line = 1;
     b->col = 1;
     b->pos = 0;
+    b->chunk_proc = Qnil;
+    b->chunk_size = 0;
+}
+
+static void
+builder_mark(void *ptr) {
+    if (0 != ptr) {
+	rb_gc_mark(((Builder)ptr)->chunk_proc);
+    }
 }
 
 static void
@@ -285,34 +299,64 @@ bclose(Builder b) {
 }
 
 static VALUE
-to_s(Builder b) {
-    volatile VALUE	rstr;
+buf_str(Builder b) {
+    volatile VALUE	rstr = rb_str_new(b->buf.head, buf_len(&b->buf));
 
+    if ('\0' != *b->encoding) {
+#if HAS_ENCODING_SUPPORT
+	rb_enc_associate(rstr, rb_enc_find(b->encoding));
+#endif
+    }
+    return rstr;
+}
+
+static VALUE
+to_s(Builder b) {
     if (0 != b->buf.fd) {
 	rb_raise(ox_arg_error_class, "can not create a String with a stream or file builder.");
     }
-    if (0 <= b->indent && '\n' != *(b->buf.tail - 1)) {
+    if (0 <= b->indent && b->buf.head < b->buf.tail && '\n' != *(b->buf.tail - 1)) {
 	buf_append(&b->buf, '\n');
 	b->line++;
 	b->col = 1;
 	b->pos++;
     }
     *b->buf.tail = '\0'; // for debugging
-    rstr = rb_str_new(b->buf.head, buf_len(&b->buf));
+    return buf_str(b);
+}
 
-    if ('\0' != *b->encoding) {
-#if HAS_ENCODING_SUPPORT
-	rb_enc_associate(rstr, rb_enc_find(b->encoding));
-#endif
+/* Returns what has been built since the last chunk and empties the buffer
+ * while keeping the memory it has already allocated.
+ */
+static VALUE
+chunk(Builder b) {
+    volatile VALUE	rstr;
+
+    if (0 != b->buf.fd) {
+	rb_raise(ox_arg_error_class, "can not create a String with a stream or file builder.");
     }
+    rstr = buf_str(b);
+    b->buf.tail = b->buf.head;
+
     return rstr;
 }
 
+/* Hands the buffer to the each_chunk() block once it is large enough. */
+static void
+drain(Builder b, bool all) {
+    long	len = (long)buf_len(&b->buf);
+
+    if (Qnil != b->chunk_proc && 0 < len && (all || b->chunk_size <= len)) {
+	rb_funcall(b->chunk_proc, ox_call_id, 1, chunk(b));
+    }
+}
+
 /* call-seq: new(options)
  *
  * Creates a new Builder that will write to a string that can be retrieved with
  * the to_s() method. If a block is given it is executed with a single parameter
- * which is the builder instance. The return value is then the generated string.
+ * which is the builder instance. The return value is then the generated string
+ * or what is left of it if each_chunk() was used.
  *
  * - +options+ - (Hash) formating options
  *   - +:indent+ (Fixnum) indentaion level, negative values excludes terminating newline
@@ -353,14 +397,15 @@ builder_new(int argc, VALUE *argv, VALUE self) {
     init(b, 0, indent, buf_size);
 
     if (rb_block_given_p()) {
-	volatile VALUE	rb = Data_Wrap_Struct(builder_class, NULL, builder_free, b);
+	volatile VALUE	rb = Data_Wrap_Struct(builder_class, builder_mark, builder_free, b);
 	
 	rb_yield(rb);
 	bclose(b);
+	drain(b, true);
 
 	return to_s(b);
     } else {
-	return Data_Wrap_Struct(builder_class, NULL, builder_free, b);
+	return Data_Wrap_Struct(builder_class, builder_mark, builder_free, b);
     }
 }
 
@@ -372,22 +417,22 @@ builder_new(int argc, VALUE *argv, VALUE self) {
  * - +options+ - (Hash) formating options
  *   - +:indent+ (Fixnum) indentaion level, negative values excludes terminating newline
  *   - +:size+ (Fixnum) the initial size of the string buffer
+ *   - +:gzip+ (true|false|Fixnum) compress the file with gzip as the buffer is flushed, a Fixnum is the compression level from 0 to 9
  */
 static VALUE
 builder_file(int argc, VALUE *argv, VALUE self) {
-    Builder	b = ALLOC(struct _Builder);
+    Builder	b;
     int		indent = ox_default_options.indent;
     long	buf_size = 0;
+    int		gz_level = -1;
     FILE	*f;
     
     if (1 > argc) {
 	rb_raise(ox_arg_error_class, "missing filename");
     }
     Check_Type(*argv, T_STRING);
-    if (NULL == (f = fopen(StringValuePtr(*argv), "w"))) {
-	xfree(b);
-	rb_raise(rb_eIOError, "%s\n", strerror(errno));
-    }
+    // Options are checked before the file is opened so a bad option does not
+    // truncate an existing file.
     if (2 == argc) {
 	volatile VALUE	v;
 
@@ -412,17 +457,32 @@ builder_file(int argc, VALUE *argv, VALUE self) {
 	    }
 	    buf_size = NUM2LONG(v);
 	}
+	gz_level = ox_gzip_level(rb_hash_lookup(argv[1], ox_gzip_sym));
+    }
+    if (NULL == (f = fopen(StringValuePtr(*argv), "w"))) {
+	rb_raise(rb_eIOError, "%s\n", strerror(errno));
     }
+    b = ALLOC(struct _Builder);
     b->file = f;
     init(b, fileno(f), indent, buf_size);
+    if (0 <= gz_level) {
+#if HAS_ZLIB
+	if (!buf_gzip(&b->buf, gz_level)) {
+	    buf_cleanup(&b->buf);
+	    fclose(f);
+	    xfree(b);
+	    rb_raise(rb_eIOError, "failed to start gzip output.\n");
+	}
+#endif
+    }
 
     if (rb_block_given_p()) {
-	volatile VALUE	rb = Data_Wrap_Struct(builder_class, NULL, builder_free, b);
+	volatile VALUE	rb = Data_Wrap_Struct(builder_class, builder_mark, builder_free, b);
 	rb_yield(rb);
 	bclose(b);
 	return Qnil;
     } else {
-	return Data_Wrap_Struct(builder_class, NULL, builder_free, b);
+	return Data_Wrap_Struct(builder_class, builder_mark, builder_free, b);
     }
 }
 
@@ -480,12 +540,12 @@ builder_io(int argc, VALUE *argv, VALUE self) {
     init(b, fd, indent, buf_size);
 
     if (rb_block_given_p()) {
-	volatile VALUE	rb = Data_Wrap_Struct(builder_class, NULL, builder_free, b);
+	volatile VALUE	rb = Data_Wrap_Struct(builder_class, builder_mark, builder_free, b);
 	rb_yield(rb);
 	bclose(b);
 	return Qnil;
     } else {
-	return Data_Wrap_Struct(builder_class, NULL, builder_free, b);
+	return Data_Wrap_Struct(builder_class, builder_mark, builder_free, b);
     }
 }
 
@@ -556,6 +616,8 @@ builder_instruct(int argc, VALUE *argv, VALUE self) {
 	b->col += 2;
 	b->pos += 2;
     }
+    drain(b, false);
+
     return Qnil;
 }
 
@@ -620,6 +682,8 @@ builder_element(int argc, VALUE *argv, VALUE self) {
 	rb_yield(self);
 	pop(b);
     }
+    drain(b, false);
+
     return Qnil;
 }
 
@@ -643,6 +707,8 @@ builder_comment(VALUE self, VALUE text) {
     b->col += 5;
     b->pos += 5;
 	
+    drain(b, false);
+
     return Qnil;
 }
 
@@ -666,6 +732,8 @@ builder_doctype(VALUE self, VALUE text) {
     b->col++;
     b->pos++;
 
+    drain(b, false);
+
     return Qnil;
 }
 
@@ -679,12 +747,24 @@ builder_text(VALUE self, VALUE text) {
     Builder		b = (Builder)DATA_PTR(self);
     volatile VALUE	v = text;
 
+    if (T_FLOAT == rb_type(v)) {
+	char	num[DBL_BUF_SIZE];
+	int	len = ox_dbl_fmt(RFLOAT_VALUE(v), num, 1);
+
+	i_am_a_child(b, true);
+	append_string(b, num, len);
+	drain(b, false);
+
+	return Qnil;
+    }
     if (T_STRING != rb_type(v)) {
 	v = rb_funcall(v, ox_to_s_id, 0);
     }
     i_am_a_child(b, true);
     append_string(b, StringValuePtr(v), RSTRING_LEN(v));
 
+    drain(b, false);
+
     return Qnil;
 }
 
@@ -727,6 +807,8 @@ builder_cdata(VALUE self, VALUE data) {
     b->col += 3;
     b->pos += 3;
 
+    drain(b, false);
+
     return Qnil;
 }
 
@@ -763,6 +845,8 @@ builder_raw(VALUE self, VALUE text) {
     }
     b->pos += len;
 
+    drain(b, false);
+
     return Qnil;
 }
 
@@ -809,7 +893,10 @@ builder_pos(VALUE self) {
  */
 static VALUE
 builder_pop(VALUE self) {
-    pop((Builder)DATA_PTR(self));
+    Builder	b = (Builder)DATA_PTR(self);
+
+    pop(b);
+    drain(b, false);
 
     return Qnil;
 }
@@ -820,7 +907,55 @@ builder_pop(VALUE self) {
  */
 static VALUE
 builder_close(VALUE self) {
-    bclose((Builder)DATA_PTR(self));
+    Builder	b = (Builder)DATA_PTR(self);
+
+    bclose(b);
+    drain(b, true);
+
+    return Qnil;
+}
+
+/* call-seq: flush_chunk()
+ *
+ * Returns the XML built since the last call to flush_chunk() or the start
+ * and empties the builder. The buffer is reused so a large document can be
+ * sent in pieces without holding all of it in memory.
+ */
+static VALUE
+builder_flush_chunk(VALUE self) {
+    return chunk((Builder)DATA_PTR(self));
+}
+
+/* call-seq: each_chunk(size) { |chunk| }
+ *
+ * Calls the block with the XML built so far each time the builder holds at
+ * least +size+ bytes and once more with the remainder when the builder is
+ * closed. The buffer is emptied after each call. Useful for streaming a
+ * response body while it is being generated.
+ *
+ *   body = Enumerator.new { |y|
+ *     Ox::Builder.new { |b|
+ *       b.each_chunk(8192) { |chunk| y << chunk }
+ *       ...
+ *     }
+ *   }
+ *
+ * - +size+ - (Fixnum) bytes to collect before calling the block, defaults to half the buffer size
+ */
+static VALUE
+builder_each_chunk(int argc, VALUE *argv, VALUE self) {
+    Builder	b = (Builder)DATA_PTR(self);
+
+    if (0 != b->buf.fd) {
+	rb_raise(ox_arg_error_class, "can not create a String with a stream or file builder.");
+    }
+    if (1 <= argc && Qnil != *argv) {
+	b->chunk_size = NUM2LONG(*argv);
+    } else {
+	b->chunk_size = (long)(b->buf.end - b->buf.head) / 2;
+    }
+    b->chunk_proc = rb_block_proc();
+    drain(b, false);
 
     return Qnil;
 }
@@ -848,6 +983,8 @@ void ox_init_builder(VALUE ox) {
     rb_define_method(builder_class, "pop", builder_pop, 0);
     rb_define_method(builder_class, "close", builder_close, 0);
     rb_define_method(builder_class, "to_s", builder_to_s, 0);
+    rb_define_method(builder_class, "flush_chunk", builder_flush_chunk, 0);
+    rb_define_method(builder_class, "each_chunk", builder_each_chunk, -1);
     rb_define_method(builder_class, "line", builder_line, 0);
     rb_define_method(builder_class, "column", builder_column, 0);
     rb_define_method(builder_class, "pos", builder_pos, 0);
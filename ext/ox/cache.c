@@ -4,6 +4,7 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,149 +12,427 @@
 #include <stdarg.h>
 
 #include "cache.h"
+#include "probes.h"
+
+/* The cache is a hash table of immutable entries that is read far more often
+ * than it is written. Lookups take no lock. A new entry is filled in
+ * completely and then published with a compare-and-swap on the head of its
+ * bucket so a reader either sees the whole entry or none of it. Entries are
+ * not freed until ox_cache_reclaim() is called so a key returned through keyp
+ * stays valid until then.
+ *
+ * When the table gets crowded a larger copy is built and swapped in. Entries
+ * added to the old table by another thread during the copy may be lost,
+ * which only means a later miss since this is a cache. Old tables are kept
+ * until reclaimed as a reader may still be walking them.
+ *
+ * A cache with a limit evicts using the CLOCK algorithm. Each hit sets the
+ * entry's used flag. When the limit is passed a hand sweeps the buckets,
+ * clearing used flags and unlinking entries that were not used since the last
+ * pass. Unlinked entries go on the retired list until reclaimed. A reader
+ * standing on one may follow it into the retired list which again only means
+ * a miss.
+ */
+
+#define INIT_BUCKETS	256
+#define MAX_LOAD	2	/* average entries per bucket before growing */
+
+typedef struct _Entry {
+    struct _Entry	*next;
+    VALUE		value;
+    uint32_t		hash;
+    uint32_t		len;
+    uint8_t		used;
+    char		key[1];		/* NUL terminated, allocated to fit */
+} *Entry;
+
+typedef struct _Table {
+    struct _Table	*prev;		/* replaced table, freed when reclaimed */
+    size_t		mask;
+    size_t		cnt;
+    Entry		buckets[1];	/* allocated to mask + 1 */
+} *Table;
 
 struct _Cache {
-    /* The key is a length byte followed by the key as a string. If the key is longer than 254 characters then the
-       length is 255. The key can be for a premature value and in that case the length byte is greater than the length
-       of the key. */
-    char                *key;
-    VALUE               value;
-    struct _Cache       *slots[16];
+    Table		table;
+    Entry		retired;
+    size_t		limit;
+    size_t		hand;
+    int			busy;		/* set while growing or evicting */
+    int			mark;
+    /* statistics are not atomic, they are close enough */
+    size_t		hits;
+    size_t		misses;
+    size_t		evictions;
 };
 
-static void     slot_print(Cache cache, unsigned int depth);
+#define LOAD(p)		__atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define CAS(p, old, v)	__atomic_compare_exchange_n(&(p), &(old), (v), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
 
-static char* form_key(const char *s) {
-    size_t	len = strlen(s);
-    char	*d = ALLOC_N(char, len + 2);
+static uint32_t
+hash_key(const char *key, uint32_t *lenp) {
+    const uint8_t	*k = (const uint8_t*)key;
+    uint32_t		h = 2166136261U;
 
-    *d = (255 <= len) ? 255 : len;
-    memcpy(d + 1, s, len + 1);
+    for (; '\0' != *k; k++) {
+	h = (h ^ *k) * 16777619U;
+    }
+    *lenp = (uint32_t)(k - (const uint8_t*)key);
 
-    return d;
+    return h;
 }
 
-void
-ox_cache_new(Cache *cache) {
-    *cache = ALLOC(struct _Cache);
-    (*cache)->key = 0;
-    (*cache)->value = Qundef;
-    memset((*cache)->slots, 0, sizeof((*cache)->slots));
+static Table
+table_new(size_t size) {
+    Table	t = (Table)ALLOC_N(char, sizeof(struct _Table) + sizeof(Entry) * (size - 1));
+
+    memset(t->buckets, 0, sizeof(Entry) * size);
+    t->prev = 0;
+    t->mask = size - 1;
+    t->cnt = 0;
+
+    return t;
 }
 
-VALUE
-ox_cache_get(Cache cache, const char *key, VALUE **slot, const char **keyp) {
-    unsigned char       *k = (unsigned char*)key;
-    Cache               *cp;
+/* Frees the entries of a list other than the held ones which are added to
+ * the kept list.
+ */
+static Entry
+entries_free(Entry e, int (*held)(const char *key, void *ctx), void *ctx, Entry kept) {
+    Entry	next;
 
-    for (; '\0' != *k; k++) {
-        cp = cache->slots + (unsigned int)(*k >> 4); /* upper 4 bits */
-        if (0 == *cp) {
-            ox_cache_new(cp);
-        }
-        cache = *cp;
-        cp = cache->slots + (unsigned int)(*k & 0x0F); /* lower 4 bits */
-        if (0 == *cp) { /* nothing on this tree so set key and value as a premature key/value pair */
-            ox_cache_new(cp);
-            cache = *cp;
-            cache->key = form_key(key);
-            break;
+    for (; 0 != e; e = next) {
+	next = e->next;
+	if (0 != held && held(e->key, ctx)) {
+	    e->next = kept;
+	    kept = e;
 	} else {
-	    int	depth = (int)(k - (unsigned char*)key + 1);
-
-	    cache = *cp;
-	    
-	    if ('\0' == *(k + 1)) { /* exact match */
-		if (0 == cache->key) { /* nothing in this spot so take it */
-		    cache->key = form_key(key);
-		    break;
-		} else if ((depth == *cache->key || 255 < depth) && 0 == strcmp(key, cache->key + 1)) { /* match */
-		    break;
-		} else { /* have to move the current premature key/value deeper */
-		    unsigned char	*ck = (unsigned char*)(cache->key + depth + 1);
-                    Cache		orig = *cp;
-		    
-                    cp = (*cp)->slots + (*ck >> 4);
-                    ox_cache_new(cp);
-                    cp = (*cp)->slots + (*ck & 0x0F);
-                    ox_cache_new(cp);
-		    (*cp)->key = cache->key;
-		    (*cp)->value = cache->value;
-		    orig->key = form_key(key);
-		    orig->value = Qundef;
-		}
-	    } else { /* not exact match but on the path */
-		if (0 != cache->key) { /* there is a key/value here already */
-		    if (depth == *cache->key || (255 <= depth && 0 == strncmp(cache->key, key, depth) && '\0' == cache->key[depth])) { /* key belongs here */
-			continue;
-		    } else {
-			unsigned char	*ck = (unsigned char*)(cache->key + depth + 1);
-			Cache		orig = *cp;
-		    
-			cp = (*cp)->slots + (*ck >> 4);
-			ox_cache_new(cp);
-			cp = (*cp)->slots + (*ck & 0x0F);
-			ox_cache_new(cp);
-			(*cp)->key = cache->key;
-			(*cp)->value = cache->value;
-			orig->key = 0;
-			orig->value = Qundef;
-		    }
-		}
+	    xfree(e);
+	}
+    }
+    return kept;
+}
+
+static Entry
+table_free(Table t, int (*held)(const char *key, void *ctx), void *ctx, Entry kept) {
+    size_t	i;
+
+    for (i = 0; i <= t->mask; i++) {
+	kept = entries_free(t->buckets[i], held, ctx, kept);
+    }
+    xfree(t);
+
+    return kept;
+}
+
+static Entry
+entry_new(const char *key, uint32_t len, uint32_t hash, VALUE value) {
+    Entry	e = (Entry)ALLOC_N(char, sizeof(struct _Entry) + len);
+
+    e->next = 0;
+    e->value = value;
+    e->hash = hash;
+    e->len = len;
+    e->used = 0;
+    memcpy(e->key, key, len + 1);
+
+    return e;
+}
+
+static Entry
+find(Table t, const char *key, uint32_t len, uint32_t hash) {
+    Entry	e;
+
+    for (e = LOAD(t->buckets[hash & t->mask]); 0 != e; e = e->next) {
+	if (hash == e->hash && len == e->len && 0 == memcmp(key, e->key, len)) {
+	    break;
+	}
+    }
+    return e;
+}
+
+static void
+grow(Cache cache, Table t) {
+    int		no = 0;
+    Table	nt;
+    Entry	e;
+    size_t	i;
+
+    if (!CAS(cache->busy, no, 1)) {
+	return; // another thread is already at it
+    }
+    if (t == LOAD(cache->table)) {
+	nt = table_new((t->mask + 1) * 2);
+	for (i = 0; i <= t->mask; i++) {
+	    for (e = LOAD(t->buckets[i]); 0 != e; e = e->next) {
+		Entry	ne = entry_new(e->key, e->len, e->hash, LOAD(e->value));
+		Entry	*bp = nt->buckets + (e->hash & nt->mask);
+
+		ne->used = e->used;
+		ne->next = *bp;
+		*bp = ne;
+		nt->cnt++;
 	    }
-        }
+	}
+	nt->prev = t;
+	STORE(cache->table, nt);
     }
-    *slot = &cache->value;
-    if (0 != keyp) {
-	if (0 == cache->key) {
-	    printf("*** Error: failed to set the key for '%s'\n", key);
-	    *keyp = 0;
-	} else {
-	    *keyp = cache->key + 1;
+    STORE(cache->busy, 0);
+}
+
+static void
+evict(Cache cache, Table t) {
+    int		no = 0;
+    size_t	target = cache->limit - cache->limit / 8;
+    size_t	sweeps = 0;
+
+    if (!CAS(cache->busy, no, 1)) {
+	return;
+    }
+    // Two full turns of the hand is enough to get through every entry once
+    // the used flags are cleared.
+    while (target < LOAD(t->cnt) && sweeps <= 2 * (t->mask + 1)) {
+	Entry	*bp = t->buckets + (cache->hand & t->mask);
+	Entry	e;
+
+	cache->hand++;
+	sweeps++;
+	while (0 != (e = LOAD(*bp))) {
+	    if (e->used) {
+		e->used = 0;
+		bp = &e->next;
+	    } else if (CAS(*bp, e, e->next)) {
+		e->next = cache->retired;
+		cache->retired = e;
+		cache->evictions++;
+		__atomic_sub_fetch(&t->cnt, 1, __ATOMIC_RELAXED);
+	    }
 	}
     }
-    return cache->value;
+    STORE(cache->busy, 0);
 }
 
 void
-ox_cache_print(Cache cache) {
-    /*printf("-------------------------------------------\n");*/
-    slot_print(cache, 0);
+ox_cache_new(Cache *cache, int mark) {
+    Cache	c = ALLOC(struct _Cache);
+
+    c->table = table_new(INIT_BUCKETS);
+    c->retired = 0;
+    c->limit = 0;
+    c->hand = 0;
+    c->busy = 0;
+    c->mark = mark;
+    c->hits = 0;
+    c->misses = 0;
+    c->evictions = 0;
+    *cache = c;
+}
+
+void
+ox_cache_free(Cache cache) {
+    ox_cache_reclaim(cache);
+    table_free(cache->table, 0, 0, 0);
+    xfree(cache);
+}
+
+void
+ox_cache_set_limit(Cache cache, size_t limit) {
+    cache->limit = limit;
+}
+
+void
+ox_cache_clear(Cache cache) {
+    Table	t = LOAD(cache->table);
+    Table	nt = table_new(INIT_BUCKETS);
+
+    nt->prev = t;
+    STORE(cache->table, nt);
+    cache->hand = 0;
+}
+
+void
+ox_cache_reclaim(Cache cache) {
+    ox_cache_reclaim_unheld(cache, 0, 0);
+}
+
+void
+ox_cache_reclaim_unheld(Cache cache, int (*held)(const char *key, void *ctx), void *ctx) {
+    Table	t = LOAD(cache->table);
+    Table	prev;
+    Entry	kept;
+
+    if (0 == cache->retired && 0 == t->prev) {
+	return;
+    }
+    kept = entries_free(cache->retired, held, ctx, 0);
+    prev = t->prev;
+    t->prev = 0;
+    for (t = prev; 0 != t; t = prev) {
+	prev = t->prev;
+	kept = table_free(t, held, ctx, kept);
+    }
+    cache->retired = kept;
+}
+
+/* Values are marked as movable when the GC can compact so cached Strings and
+ * Symbols do not pin heap pages. ox_cache_compact() then picks up the new
+ * locations.
+ */
+static void
+mark_entries(Entry e) {
+    for (; 0 != e; e = e->next) {
+	if (Qundef != e->value) {
+#if HAS_GC_COMPACT
+	    rb_gc_mark_movable(e->value);
+#else
+	    rb_gc_mark(e->value);
+#endif
+	}
+    }
 }
 
 static void
-slot_print(Cache c, unsigned int depth) {
-    char                indent[256];
-    Cache               *cp;
-    unsigned int        i;
-
-    if (sizeof(indent) - 1 < depth) {
-        depth = ((int)sizeof(indent) - 1);
-    }
-    memset(indent, ' ', depth);
-    indent[depth] = '\0';
-    for (i = 0, cp = c->slots; i < 16; i++, cp++) {
-        if (0 == *cp) {
-            /*printf("%s%02u:\n", indent, i);*/
-        } else {
-            if (0 == (*cp)->key && Qundef == (*cp)->value) {
-                printf("%s%02u:\n", indent, i);
-            } else {
-                const char      *vs;
-                const char      *clas;
-
-                if (Qundef == (*cp)->value) {
-                    vs = "undefined";
-                    clas = "";
-                } else {
-                    VALUE       rs = rb_funcall2((*cp)->value, rb_intern("to_s"), 0, 0);
-
-                    vs = StringValuePtr(rs);
-                    clas = rb_class2name(rb_obj_class((*cp)->value));
-                }
-                printf("%s%02u: %s = %s (%s)\n", indent, i, (*cp)->key, vs, clas);
-            }
-            slot_print(*cp, depth + 2);
-        }
+each_entry_list(Cache cache, void (*cb)(Entry e)) {
+    Table	t;
+    size_t	i;
+
+    for (t = cache->table; 0 != t; t = t->prev) {
+	for (i = 0; i <= t->mask; i++) {
+	    cb(t->buckets[i]);
+	}
+    }
+    cb(cache->retired);
+}
+
+void
+ox_cache_mark(Cache cache) {
+    if (cache->mark) {
+	each_entry_list(cache, mark_entries);
+    }
+}
+
+#if HAS_GC_COMPACT
+static void
+move_entries(Entry e) {
+    for (; 0 != e; e = e->next) {
+	if (Qundef != e->value) {
+	    e->value = rb_gc_location(e->value);
+	}
+    }
+}
+
+void
+ox_cache_compact(Cache cache) {
+    if (cache->mark) {
+	each_entry_list(cache, move_entries);
+    }
+}
+#endif
+
+void
+ox_cache_stats(Cache cache, CacheStats stats) {
+    stats->size = LOAD(cache->table)->cnt;
+    stats->limit = cache->limit;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+}
+
+VALUE
+ox_cache_get(Cache cache, const char *key, const char **keyp) {
+    uint32_t	len;
+    uint32_t	hash = hash_key(key, &len);
+    Entry	e = find(LOAD(cache->table), key, len, hash);
+
+    if (0 == e) {
+	OX_PROBE1(cache__miss, key);
+	cache->misses++;
+	return Qundef;
+    }
+    cache->hits++;
+    if (!e->used) {
+	e->used = 1;
+    }
+    if (0 != keyp) {
+	*keyp = e->key;
+    }
+    return LOAD(e->value);
+}
+
+VALUE
+ox_cache_set(Cache cache, const char *key, VALUE value, const char **keyp) {
+    uint32_t	len;
+    uint32_t	hash = hash_key(key, &len);
+    Table	t = LOAD(cache->table);
+    Entry	*bp = t->buckets + (hash & t->mask);
+    Entry	ne = 0;
+    Entry	head;
+    Entry	e;
+
+    while (1) {
+	head = LOAD(*bp);
+	for (e = head; 0 != e; e = e->next) {
+	    if (hash == e->hash && len == e->len && 0 == memcmp(key, e->key, len)) {
+		break;
+	    }
+	}
+	if (0 != e) { // already there, first value set wins
+	    VALUE	undef = Qundef;
+
+	    if (0 != ne) {
+		xfree(ne);
+	    }
+	    if (Qundef == value) {
+		value = LOAD(e->value);
+	    } else if (!CAS(e->value, undef, value)) {
+		value = undef; // lost the race so use the value that won
+	    }
+	    break;
+	}
+	if (0 == ne) {
+	    ne = entry_new(key, len, hash, value);
+	}
+	ne->next = head;
+	if (CAS(*bp, head, ne)) {
+	    size_t	cnt = __atomic_add_fetch(&t->cnt, 1, __ATOMIC_RELAXED);
+
+	    e = ne;
+	    if (0 < cache->limit && cache->limit < cnt) {
+		evict(cache, t);
+	    } else if ((t->mask + 1) * MAX_LOAD < cnt) {
+		grow(cache, t);
+	    }
+	    break;
+	}
+    }
+    if (0 != keyp) {
+	*keyp = e->key;
+    }
+    return value;
+}
+
+void
+ox_cache_print(Cache cache) {
+    Table	t = LOAD(cache->table);
+    Entry	e;
+    size_t	i;
+
+    for (i = 0; i <= t->mask; i++) {
+	for (e = LOAD(t->buckets[i]); 0 != e; e = e->next) {
+	    const char	*vs;
+	    const char	*clas;
+
+	    if (Qundef == e->value) {
+		vs = "undefined";
+		clas = "";
+	    } else {
+		VALUE	rs = rb_funcall2(e->value, rb_intern("to_s"), 0, 0);
+
+		vs = StringValuePtr(rs);
+		clas = rb_class2name(rb_obj_class(e->value));
+	    }
+	    printf("%4lu: %s = %s (%s)\n", (unsigned long)i, e->key, vs, clas);
+	}
     }
 }
@@ -10,10 +10,56 @@
 
 typedef struct _Cache   *Cache;
 
-extern void     ox_cache_new(Cache *cache);
+typedef struct _CacheStats {
+    size_t	size;
+    size_t	limit;
+    size_t	hits;
+    size_t	misses;
+    size_t	evictions;
+} *CacheStats;
 
-extern VALUE    ox_cache_get(Cache cache, const char *key, VALUE **slot, const char **keyp);
+/* If mark is non-zero the values are Ruby objects that ox_cache_mark() keeps
+ * from being collected.
+ */
+extern void     ox_cache_new(Cache *cache, int mark);
+extern void     ox_cache_free(Cache cache);
+
+/* Returns the cached value or Qundef. Safe to call from any thread without
+ * locking. If keyp is not NULL and the key is present it is set to the
+ * cache's own copy of the key.
+ */
+extern VALUE    ox_cache_get(Cache cache, const char *key, const char **keyp);
+
+/* Adds the key with a value that may be Qundef to reserve the key only. If
+ * the key already has a value that value is kept and returned.
+ */
+extern VALUE    ox_cache_set(Cache cache, const char *key, VALUE value, const char **keyp);
+
+/* Caps the number of entries, 0 for no limit. Once over the limit the least
+ * recently used entries are evicted.
+ */
+extern void     ox_cache_set_limit(Cache cache, size_t limit);
+
+/* Drops all entries. */
+extern void     ox_cache_clear(Cache cache);
+
+/* Evicted and cleared entries are not freed right away as keys returned
+ * through keyp may still be in use. This frees them and must only be called
+ * when no keys from the cache are held.
+ */
+extern void     ox_cache_reclaim(Cache cache);
+
+/* Like ox_cache_reclaim() for a caller that still holds a few keys. Retired
+ * entries for which held() returns non-zero are kept for a later reclaim.
+ */
+extern void     ox_cache_reclaim_unheld(Cache cache, int (*held)(const char *key, void *ctx), void *ctx);
 
+extern void     ox_cache_mark(Cache cache);
+#if HAS_GC_COMPACT
+/* Updates values moved by GC.compact. */
+extern void     ox_cache_compact(Cache cache);
+#endif
+extern void     ox_cache_stats(Cache cache, CacheStats stats);
 extern void     ox_cache_print(Cache cache);
 
 #endif /* __OX_CACHE_H__ */
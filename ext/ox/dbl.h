@@ -0,0 +1,24 @@
+/* dbl.h
+ * Copyright (c) 2011, Peter Ohler
+ * All rights reserved.
+ */
+
+#ifndef __OX_DBL_H__
+#define __OX_DBL_H__
+
+/* Large enough for any double written by ox_dbl_fmt() plus the terminator. */
+#define DBL_BUF_SIZE	32
+
+/* Writes the shortest decimal that reads back as the same double. If ruby is
+ * non-zero the format matches Float#to_s, otherwise it matches printf("%.16g")
+ * except that all the digits needed to round trip are kept. Returns the
+ * length written.
+ */
+extern int	ox_dbl_fmt(double d, char *buf, int ruby);
+
+/* Same as strtod() for the decimal forms but much faster for the common
+ * cases.
+ */
+extern double	ox_dbl_parse(const char *str, char **endp);
+
+#endif /* __OX_DBL_H__ */
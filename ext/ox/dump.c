@@ -4,14 +4,21 @@
  */
 
 #include <stdlib.h>
+#include <ctype.h>
 #include <errno.h>
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
+#if HAS_ZLIB
+#include <zlib.h>
+#endif
 
 #include "base64.h"
+#include "dbl.h"
 #include "cache8.h"
 #include "ox.h"
+#include "probes.h"
+#include "utf8.h"
 
 #define USE_B64	0
 #define MAX_DEPTH 1000
@@ -45,6 +52,11 @@ typedef struct _Out {
     int			depth; /* used by dumpHash */
     Options		opts;
     VALUE		obj;
+    VALUE		io;	/* when not Qnil the buffer is flushed to it instead of growing */
+    long		flushed;
+    const char		*attr_prefix;
+    size_t		attr_plen;
+    const char		*text_key;
 } *Out;
 
 static void	dump_obj_to_xml(VALUE obj, Options copts, Out out);
@@ -66,7 +78,8 @@ static void	dump_end(Out out, Element e);
 static void	grow(Out out, size_t len);
 
 static void	dump_value(Out out, const char *value, size_t size);
-static void	dump_str_value(Out out, const char *value, size_t size);
+static void	dump_str_value(Out out, const char *value, size_t size, VALUE obj);
+static void	dump_b64(Out out, const uchar *src, int len);
 static int	dump_var(ID key, VALUE value, Out out);
 static void	dump_num(Out out, VALUE obj);
 static void	dump_date(Out out, VALUE obj);
@@ -228,11 +241,29 @@ check_circular(Out out, VALUE obj, Element e) {
     return result;
 }
 
+static void
+flush_io(Out out) {
+    long	len = out->cur - out->buf;
+
+    if (0 < len) {
+	rb_io_write(out->io, rb_str_new(out->buf, len));
+	out->flushed += len;
+	out->cur = out->buf;
+    }
+}
+
 static void
 grow(Out out, size_t len) {
     size_t  size = out->end - out->buf;
-    long    pos = out->cur - out->buf;
+    long    pos;
 	
+    if (Qnil != out->io) {
+	flush_io(out);
+	if ((long)len < out->end - out->cur) {
+	    return;
+	}
+    }
+    pos = out->cur - out->buf;
     size *= 2;
     if (size <= len * 2 + pos) {
 	size += len;
@@ -315,9 +346,31 @@ dump_value(Out out, const char *value, size_t size) {
 }
 
 inline static void
-dump_str_value(Out out, const char *value, size_t size) {
-    size_t	xsize = xml_str_len((const uchar*)value, size);
-    
+dump_str_value(Out out, const char *value, size_t size, VALUE obj) {
+    volatile VALUE	scrubbed = Qnil;
+    size_t		xsize;
+
+    // Only text that is meant to be UTF-8 is checked, not text in some other
+    // encoding.
+    if (NoUtf8 != out->opts->invalid_utf8 && ox_utf8_expected(rb_enc_get(obj))) {
+	size_t	valid = ox_utf8_valid_len(value, size);
+
+	if (valid < size) {
+	    size_t	used;
+	    size_t	cnt;
+
+	    if (RaiseUtf8 == out->opts->invalid_utf8) {
+		rb_raise(rb_eEncodingError, "invalid UTF-8 byte sequence at byte %lu of a String.", (ulong)valid);
+	    }
+	    scrubbed = rb_str_buf_new(valid + (size - valid) * UTF8_REPL_LEN);
+	    memcpy(RSTRING_PTR(scrubbed), value, valid);
+	    cnt = ox_utf8_scrub(value + valid, size - valid, RSTRING_PTR(scrubbed) + valid, 1, &used);
+	    rb_str_set_len(scrubbed, valid + cnt);
+	    value = RSTRING_PTR(scrubbed);
+	    size = valid + cnt;
+	}
+    }
+    xsize = xml_str_len((const uchar*)value, size);
     if (out->end - out->cur <= (long)xsize) {
 	grow(out, xsize);
     }
@@ -385,6 +438,37 @@ dump_str_value(Out out, const char *value, size_t size) {
 	}
     }
     *out->cur = '\0';
+#if HAS_GC_GUARD
+    RB_GC_GUARD(scrubbed);
+#endif
+}
+
+/* Encodes straight into the output buffer. */
+static void
+dump_b64(Out out, const uchar *src, int len) {
+    ulong	size = b64_size(len);
+
+    if (out->end - out->cur <= (long)size) {
+	grow(out, size);
+    }
+    to_base64(src, len, out->cur);
+    out->cur += size;
+}
+
+/* Strings that can not be written as XML text, those with a NUL or binary
+ * data, are base64 encoded.
+ */
+inline static int
+is_binary(VALUE obj, const char *str, int len) {
+    if (0 != memchr(str, '\0', len)) {
+	return 1;
+    }
+#if HAS_ENCODING_SUPPORT
+    if (rb_ascii8bit_encoding() == rb_enc_get(obj) && !rb_enc_str_asciionly_p(obj)) {
+	return 1;
+    }
+#endif
+    return 0;
 }
 
 inline static void
@@ -648,7 +732,7 @@ dump_obj(ID aid, VALUE obj, int depth, Out out) {
 	break;
     case T_FLOAT:
 	e.type = FloatCode;
-	cnt = snprintf(value_buf, sizeof(value_buf), "%0.16g", rb_num2dbl(obj));
+	cnt = ox_dbl_fmt(rb_num2dbl(obj), value_buf, 0);
 	out->w_start(out, &e);
 	dump_value(out, value_buf, cnt);
 	e.indent = -1;
@@ -665,29 +749,21 @@ dump_obj(ID aid, VALUE obj, int depth, Out out) {
 	cnt = (int)RSTRING_LEN(obj);
 #if USE_B64
 	if (is_xml_friendly((uchar*)str, cnt)) {
+#else
+	if (!is_binary(obj, str, cnt)) {
+#endif
 	    e.type = StringCode;
 	    out->w_start(out, &e);
-	    dump_str_value(out, str, cnt);
+	    dump_str_value(out, str, cnt, obj);
 	    e.indent = -1;
 	    out->w_end(out, &e);
 	} else {
-	    ulong	size = b64_size(cnt);
-	    char	*b64 = ALLOCA_N(char, size + 1);
-
 	    e.type = String64Code;
-	    to_base64((uchar*)str, cnt, b64);
 	    out->w_start(out, &e);
-	    dump_value(out, b64, size);
+	    dump_b64(out, (uchar*)str, cnt);
 	    e.indent = -1;
 	    out->w_end(out, &e);
 	}
-#else
-	e.type = StringCode;
-	out->w_start(out, &e);
-	dump_str_value(out, str, cnt);
-	e.indent = -1;
-	out->w_end(out, &e);
-#endif
 	break;
     }
     case T_SYMBOL:
@@ -699,24 +775,20 @@ dump_obj(ID aid, VALUE obj, int depth, Out out) {
 	if (is_xml_friendly((uchar*)sym, cnt)) {
 	    e.type = SymbolCode;
 	    out->w_start(out, &e);
-	    dump_str_value(out, sym, cnt);
+	    dump_str_value(out, sym, cnt, obj);
 	    e.indent = -1;
 	    out->w_end(out, &e);
 	} else {
-	    ulong	size = b64_size(cnt);
-	    char	*b64 = ALLOCA_N(char, size + 1);
-
 	    e.type = Symbol64Code;
-	    to_base64((uchar*)sym, cnt, b64);
 	    out->w_start(out, &e);
-	    dump_value(out, b64, size);
+	    dump_b64(out, (uchar*)sym, cnt);
 	    e.indent = -1;
 	    out->w_end(out, &e);
 	}
 #else
 	e.type = SymbolCode;
 	out->w_start(out, &e);
-	dump_str_value(out, sym, cnt);
+	dump_str_value(out, sym, cnt, obj);
 	e.indent = -1;
 	out->w_end(out, &e);
 #endif
@@ -877,16 +949,12 @@ dump_obj(ID aid, VALUE obj, int depth, Out out) {
 #if USE_B64
 	if (is_xml_friendly((uchar*)s, cnt)) {
 	    /*dump_value(out, "/", 1); */
-	    dump_str_value(out, s, cnt);
+	    dump_str_value(out, s, cnt, rs);
 	} else {
-	    ulong	size = b64_size(cnt);
-	    char	*b64 = ALLOCA_N(char, size + 1);
-
-	    to_base64((uchar*)s, cnt, b64);
-	    dump_value(out, b64, size);
+	    dump_b64(out, (uchar*)s, cnt);
 	}
 #else
-	dump_str_value(out, s, cnt);
+	dump_str_value(out, s, cnt, rs);
 #endif
 	e.indent = -1;
 	out->w_end(out, &e);
@@ -1115,7 +1183,7 @@ dump_gen_nodes(VALUE obj, int depth, Out out) {
 		dump_gen_instruct(*np, d2, out);
 		indent_needed = (1 == cnt) ? 0 : 1;
 	    } else if (rb_cString == clas) {
-		dump_str_value(out, StringValuePtr(*(VALUE*)np), RSTRING_LEN(*np));
+		dump_str_value(out, StringValuePtr(*(VALUE*)np), RSTRING_LEN(*np), *np);
 		indent_needed = (1 == cnt) ? 0 : 1;
 	    } else if (ox_comment_clas == clas) {
 		dump_gen_val_node(*np, d2, "<!-- ", 5, " -->", 4, out);
@@ -1167,7 +1235,7 @@ dump_gen_attr(VALUE key, VALUE value, Out out) {
     fill_value(out, ks, klen);
     *out->cur++ = '=';
     *out->cur++ = '"';
-    dump_str_value(out, StringValuePtr(value), RSTRING_LEN(value));
+    dump_str_value(out, StringValuePtr(value), RSTRING_LEN(value), value);
     *out->cur++ = '"';
 
     return ST_CONTINUE;
@@ -1206,6 +1274,210 @@ dump_gen_val_node(VALUE obj, int depth,
     *out->cur = '\0';
 }
 
+/* Hash dumping. A Hash key names an element and the value is its content. A
+ * Hash value holds attributes (keys starting with the attribute prefix), text
+ * (the text key), and child elements. An Array value repeats the element once
+ * per member, nil gives an empty element and anything else is the text.
+ */
+typedef struct _HashDump {
+    Out		out;
+    int		depth;
+    long	cnt;
+    int		indent_needed;
+} *HashDump;
+
+static void	hash_element(const char *name, size_t nlen, VALUE value, int depth, Out out);
+
+static const char*
+hash_key_name(VALUE *key) {
+    if (T_SYMBOL == rb_type(*key)) {
+	return rb_id2name(SYM2ID(*key));
+    }
+    *key = rb_String(*key);
+
+    return StringValuePtr(*key);
+}
+
+/* Keys become element and attribute names as they are so they must follow
+ * the XML name rules. Bytes above 0x7F are allowed as part of multibyte
+ * characters.
+ */
+static void
+hash_check_name(const char *name, size_t len) {
+    const uint8_t	*s = (const uint8_t*)name;
+    const uint8_t	*end = s + len;
+
+    if (0 == len || !(isalpha(*s) || '_' == *s || ':' == *s || 0x80 <= *s)) {
+	rb_raise(ox_arg_error_class, "'%s' is not a valid XML name.", name);
+    }
+    for (s++; s < end; s++) {
+	if (!(isalnum(*s) || '_' == *s || ':' == *s || '-' == *s || '.' == *s || 0x80 <= *s)) {
+	    rb_raise(ox_arg_error_class, "'%s' is not a valid XML name.", name);
+	}
+    }
+}
+
+inline static int
+hash_is_attr(Out out, const char *name) {
+    return (0 < out->attr_plen && 0 == strncmp(name, out->attr_prefix, out->attr_plen));
+}
+
+static int
+hash_attr(VALUE key, VALUE value, VALUE arg) {
+    HashDump	hd = (HashDump)arg;
+    Out		out = hd->out;
+    const char	*name = hash_key_name(&key);
+    size_t	klen;
+    size_t	size;
+
+    if (!hash_is_attr(out, name)) {
+	hd->cnt++;
+	return ST_CONTINUE;
+    }
+    name += out->attr_plen;
+    klen = strlen(name);
+    hash_check_name(name, klen);
+    value = rb_String(value);
+    size = 4 + klen;
+    if (out->end - out->cur <= (long)size) {
+	grow(out, size);
+    }
+    *out->cur++ = ' ';
+    fill_value(out, name, klen);
+    *out->cur++ = '=';
+    *out->cur++ = '"';
+    dump_str_value(out, StringValuePtr(value), RSTRING_LEN(value), value);
+    dump_value(out, "\"", 1);
+
+    return ST_CONTINUE;
+}
+
+static int
+hash_node(VALUE key, VALUE value, VALUE arg) {
+    HashDump	hd = (HashDump)arg;
+    Out		out = hd->out;
+    const char	*name = hash_key_name(&key);
+
+    if (hash_is_attr(out, name)) {
+	if (0 > hd->depth) {
+	    rb_raise(ox_arg_error_class, "attribute '%s' has no element, a :root is needed.", name);
+	}
+	return ST_CONTINUE;
+    }
+    if (0 == strcmp(name, out->text_key)) {
+	value = rb_String(value);
+	dump_str_value(out, StringValuePtr(value), RSTRING_LEN(value), value);
+	hd->indent_needed = 0;
+    } else {
+	hash_element(name, strlen(name), value, hd->depth + 1, out);
+	hd->indent_needed = 1;
+    }
+    return ST_CONTINUE;
+}
+
+static void
+hash_element(const char *name, size_t nlen, VALUE value, int depth, Out out) {
+    struct _HashDump	hd;
+    size_t		size;
+    int			indent;
+
+    if (MAX_DEPTH < depth) {
+	rb_raise(rb_eSysStackError, "maximum depth exceeded");
+    }
+    if (T_ARRAY == rb_type(value)) {
+	long	cnt = RARRAY_LEN(value);
+	long	i;
+
+	for (i = 0; i < cnt; i++) {
+	    hash_element(name, nlen, rb_ary_entry(value, i), depth, out);
+	}
+	return;
+    }
+    hash_check_name(name, nlen);
+    if (0 > out->indent) {
+	indent = -1;
+    } else {
+	indent = depth * out->indent;
+    }
+    size = indent + 4 + nlen;
+    if (out->end - out->cur <= (long)size) {
+	grow(out, size);
+    }
+    if (out->buf < out->cur || 0 < out->flushed) {
+	fill_indent(out, indent);
+    }
+    *out->cur++ = '<';
+    fill_value(out, name, nlen);
+    *out->cur = '\0';
+    switch (rb_type(value)) {
+    case T_NIL:
+	dump_value(out, "/>", 2);
+	return;
+    case T_HASH:
+	hd.out = out;
+	hd.depth = depth;
+	hd.cnt = 0;
+	hd.indent_needed = 0;
+	rb_hash_foreach(value, hash_attr, (VALUE)&hd);
+	if (0 == hd.cnt) {
+	    dump_value(out, "/>", 2);
+	    return;
+	}
+	dump_value(out, ">", 1);
+	rb_hash_foreach(value, hash_node, (VALUE)&hd);
+	break;
+    default:
+	value = rb_String(value);
+	dump_value(out, ">", 1);
+	dump_str_value(out, StringValuePtr(value), RSTRING_LEN(value), value);
+	hd.indent_needed = 0;
+	break;
+    }
+    if (out->end - out->cur <= (long)size) {
+	grow(out, size);
+    }
+    if (hd.indent_needed) {
+	fill_indent(out, indent);
+    }
+    *out->cur++ = '<';
+    *out->cur++ = '/';
+    fill_value(out, name, nlen);
+    *out->cur++ = '>';
+    *out->cur = '\0';
+}
+
+static void
+dump_hash_to_xml(VALUE obj, VALUE io, Options copts, const char *root, const char *attr_prefix, const char *text_key, Out out) {
+    out->buf = ALLOC_N(char, 65336);
+    out->end = out->buf + 65325; /* 10 less than end plus extra for possible errors */
+    out->cur = out->buf;
+    *out->cur = '\0';
+    out->circ_cache = 0;
+    out->circ_cnt = 0;
+    out->opts = copts;
+    out->obj = obj;
+    out->io = io;
+    out->flushed = 0;
+    out->indent = copts->indent;
+    out->attr_prefix = attr_prefix;
+    out->attr_plen = strlen(attr_prefix);
+    out->text_key = text_key;
+
+    if (0 != root) {
+	hash_element(root, strlen(root), obj, 0, out);
+    } else {
+	struct _HashDump	hd;
+
+	Check_Type(obj, T_HASH);
+	hd.out = out;
+	hd.depth = -1;
+	hd.cnt = 0;
+	hd.indent_needed = 0;
+	rb_hash_foreach(obj, hash_node, (VALUE)&hd);
+    }
+    dump_value(out, "\n", 1);
+}
+
 static void
 dump_obj_to_xml(VALUE obj, Options copts, Out out) {
     VALUE	clas = rb_obj_class(obj);
@@ -1218,21 +1490,26 @@ dump_obj_to_xml(VALUE obj, Options copts, Out out) {
     out->circ_cnt = 0;
     out->opts = copts;
     out->obj = obj;
+    out->io = Qnil;
     if (Yes == copts->circular) {
 	ox_cache8_new(&out->circ_cache);
     }
     out->indent = copts->indent;
 
     if (ox_document_clas == clas) {
+	OX_PROBE1(dump__start, GenMode);
 	dump_gen_doc(obj, -1, out);
     } else if (ox_element_clas == clas) {
+	OX_PROBE1(dump__start, GenMode);
 	dump_gen_element(obj, 0, out);
     } else {
+	OX_PROBE1(dump__start, ObjMode);
 	out->w_start = dump_start;
 	out->w_end = dump_end;
 	dump_first_obj(obj, out);
     }
     dump_value(out, "\n", 1);
+    OX_PROBE1(dump__end, (long)(out->cur - out->buf));
     if (Yes == copts->circular) {
 	ox_cache8_delete(out->circ_cache);
     }
@@ -1247,13 +1524,35 @@ ox_write_obj_to_str(VALUE obj, Options copts) {
 }
 
 void
-ox_write_obj_to_file(VALUE obj, const char *path, Options copts) {
+ox_write_obj_to_file(VALUE obj, const char *path, Options copts, int gz_level) {
     struct _Out out;
     size_t	size;
     FILE	*f;    
 
     dump_obj_to_xml(obj, copts, &out);
     size = out.cur - out.buf;
+#if HAS_ZLIB
+    if (0 <= gz_level) {
+	char	mode[8];
+	gzFile	gz;
+
+	snprintf(mode, sizeof(mode), "wb%d", gz_level);
+	if (0 == (gz = gzopen(path, mode))) {
+	    xfree(out.buf);
+	    rb_raise(rb_eIOError, "%s\n", strerror(errno));
+	}
+	if ((int)size != gzwrite(gz, out.buf, (unsigned int)size)) {
+	    xfree(out.buf);
+	    gzclose(gz);
+	    rb_raise(rb_eIOError, "Write failed.\n");
+	}
+	xfree(out.buf);
+	if (Z_OK != gzclose(gz)) {
+	    rb_raise(rb_eIOError, "Write failed.\n");
+	}
+	return;
+    }
+#endif
     if (0 == (f = fopen(path, "w"))) {
 	rb_raise(rb_eIOError, "%s\n", strerror(errno));
     }
@@ -1264,3 +1563,78 @@ ox_write_obj_to_file(VALUE obj, const char *path, Options copts) {
     xfree(out.buf);
     fclose(f);
 }
+
+typedef struct _HashArgs {
+    VALUE	obj;
+    VALUE	io;
+    Options	copts;
+    const char	*root;
+    const char	*attr_prefix;
+    const char	*text_key;
+    struct _Out	out;
+} *HashArgs;
+
+static VALUE
+write_hash_to_str(VALUE a) {
+    HashArgs	args = (HashArgs)a;
+
+    dump_hash_to_xml(args->obj, Qnil, args->copts, args->root, args->attr_prefix, args->text_key, &args->out);
+
+    return Qnil;
+}
+
+static VALUE
+write_hash_cleanup(VALUE a) {
+    HashArgs	args = (HashArgs)a;
+
+    if (0 != args->out.buf) {
+	xfree(args->out.buf);
+    }
+    return Qnil;
+}
+
+char*
+ox_write_hash_to_str(VALUE obj, Options copts, const char *root, const char *attr_prefix, const char *text_key) {
+    struct _HashArgs	args;
+    int			err = 0;
+
+    args.obj = obj;
+    args.io = Qnil;
+    args.copts = copts;
+    args.root = root;
+    args.attr_prefix = attr_prefix;
+    args.text_key = text_key;
+    args.out.buf = 0;
+    // A value's to_s may raise as may a Hash nested too deep. The buffer is
+    // only handed back when the dump completes.
+    rb_protect(write_hash_to_str, (VALUE)&args, &err);
+    if (0 != err) {
+	write_hash_cleanup((VALUE)&args);
+	rb_jump_tag(err);
+    }
+    return args.out.buf;
+}
+
+static VALUE
+write_hash_to_io(VALUE a) {
+    HashArgs	args = (HashArgs)a;
+
+    dump_hash_to_xml(args->obj, args->io, args->copts, args->root, args->attr_prefix, args->text_key, &args->out);
+    flush_io(&args->out);
+
+    return Qnil;
+}
+
+void
+ox_write_hash_to_io(VALUE obj, VALUE io, Options copts, const char *root, const char *attr_prefix, const char *text_key) {
+    struct _HashArgs	args;
+
+    args.obj = obj;
+    args.io = io;
+    args.copts = copts;
+    args.root = root;
+    args.attr_prefix = attr_prefix;
+    args.text_key = text_key;
+    args.out.buf = 0;
+    rb_ensure(write_hash_to_io, (VALUE)&args, write_hash_cleanup, (VALUE)&args);
+}
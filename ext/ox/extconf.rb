@@ -36,6 +36,14 @@ dflags = {
   'HAS_TOP_LEVEL_ST_H' => ('ree' == type || ('ruby' == type &&  '1' == version[0] && '8' == version[1])) ? 1 : 0,
   'NEEDS_UIO' => (RUBY_PLATFORM =~ /(win|w)32$/) ? 0 : 1,
   'HAS_DATA_OBJECT_WRAP' => ('ruby' == type && '2' == version[0] && '3' <= version[1]) ? 1 : 0,
+  'HAS_ZLIB' => (have_header('zlib.h') && have_library('z', 'gzdopen')) ? 1 : 0,
+  'HAS_RACTOR' => have_func('rb_ext_ractor_safe', 'ruby.h') ? 1 : 0,
+  'HAS_FIBER_SCHEDULER' => have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h') ? 1 : 0,
+  'HAS_MMAP' => have_header('sys/mman.h') ? 1 : 0,
+  'HAS_INTERNED_STR' => have_func('rb_str_to_interned_str', 'ruby.h') ? 1 : 0,
+  'HAS_GC_COMPACT' => have_func('rb_gc_location', 'ruby.h') ? 1 : 0,
+  # USDT probes, see probes.h. Turn off with --disable-probes.
+  'HAS_SDT' => (enable_config('probes', true) && have_header('sys/sdt.h')) ? 1 : 0,
 }
 
 if RUBY_PLATFORM =~ /(win|w)32$/ || RUBY_PLATFORM =~ /solaris2\.10/
@@ -115,7 +115,7 @@ create_prolog_doc(PInfo pi, const char *target, Attr attrs) {
 #else
 	    sym = ID2SYM(rb_intern(attrs->name));
 #endif
-	    rb_hash_aset(ah, sym, rb_str_new2(attrs->value));
+	    rb_hash_aset(ah, sym, ox_freeze_str(pi->options, rb_str_new2(attrs->value)));
 	} else {
 	    VALUE	rstr = rb_str_new2(attrs->name);
 
@@ -128,7 +128,7 @@ create_prolog_doc(PInfo pi, const char *target, Attr attrs) {
 		rb_funcall(rstr, ox_force_encoding_id, 1, pi->options->rb_enc);
 	    }
 #endif
-	    rb_hash_aset(ah, rstr, rb_str_new2(attrs->value));
+	    rb_hash_aset(ah, rstr, ox_freeze_str(pi->options, rb_str_new2(attrs->value)));
 	}
 #if HAS_ENCODING_SUPPORT
 	if (0 == strcmp("encoding", attrs->name)) {
@@ -215,7 +215,10 @@ add_doctype(PInfo pi, const char *docType) {
 	rb_funcall(s, ox_force_encoding_id, 1, pi->options->rb_enc);
     }
 #endif
-    rb_ivar_set(n, ox_at_value_id, s);
+    rb_ivar_set(n, ox_at_value_id, ox_freeze_str(pi->options, s));
+    if (Yes == pi->options->freeze) {
+	rb_obj_freeze(n);
+    }
     if (helper_stack_empty(&pi->helpers)) { /* top level object */
 	create_doc(pi);
     }
@@ -236,7 +239,10 @@ add_comment(PInfo pi, const char *comment) {
 	rb_funcall(s, ox_force_encoding_id, 1, pi->options->rb_enc);
     }
 #endif
-    rb_ivar_set(n, ox_at_value_id, s);
+    rb_ivar_set(n, ox_at_value_id, ox_freeze_str(pi->options, s));
+    if (Yes == pi->options->freeze) {
+	rb_obj_freeze(n);
+    }
     if (helper_stack_empty(&pi->helpers)) { /* top level object */
 	create_doc(pi);
     }
@@ -257,7 +263,10 @@ add_cdata(PInfo pi, const char *cdata, size_t len) {
 	rb_funcall(s, ox_force_encoding_id, 1, pi->options->rb_enc);
     }
 #endif
-    rb_ivar_set(n, ox_at_value_id, s);
+    rb_ivar_set(n, ox_at_value_id, ox_freeze_str(pi->options, s));
+    if (Yes == pi->options->freeze) {
+	rb_obj_freeze(n);
+    }
     if (helper_stack_empty(&pi->helpers)) { /* top level object */
 	create_doc(pi);
     }
@@ -280,7 +289,7 @@ add_text(PInfo pi, char *text, int closed) {
     if (helper_stack_empty(&pi->helpers)) { /* top level object */
 	create_doc(pi);
     }
-    rb_ary_push(helper_stack_peek(&pi->helpers)->obj, s);
+    rb_ary_push(helper_stack_peek(&pi->helpers)->obj, ox_freeze_str(pi->options, s));
 }
 
 static void
@@ -298,7 +307,7 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
     }
 #endif
     e = rb_obj_alloc(ox_element_clas);
-    rb_ivar_set(e, ox_at_value_id, s);
+    rb_ivar_set(e, ox_at_value_id, ox_freeze_str(pi->options, s));
     if (0 != attrs->name) {
         volatile VALUE	ah = rb_hash_new();
         
@@ -306,9 +315,7 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
             volatile VALUE	sym;
 
 	    if (Yes == pi->options->sym_keys) {
-		VALUE	*slot;
-
-		if (Qundef == (sym = ox_cache_get(ox_symbol_cache, attrs->name, &slot, 0))) {
+		if (Qundef == (sym = ox_cache_get(pi->caches->symbols, attrs->name, 0))) {
 #if HAS_ENCODING_SUPPORT
 		    if (0 != pi->options->rb_enc) {
 			VALUE	rstr = rb_str_new2(attrs->name);
@@ -330,10 +337,7 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
 #else
 		    sym = ID2SYM(rb_intern(attrs->name));
 #endif
-		    // Needed for Ruby 2.2 to get around the GC of symbols
-		    // created with to_sym which is needed for encoded symbols.
-		    rb_ary_push(ox_sym_bank, sym);
-		    *slot = sym;
+		    ox_cache_set(pi->caches->symbols, attrs->name, sym, 0);
 		}
 	    } else {
 		sym = rb_str_new2(attrs->name);
@@ -357,8 +361,11 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
 		rb_funcall(s, ox_force_encoding_id, 1, pi->options->rb_enc);
             }
 #endif
-            rb_hash_aset(ah, sym, s);
+            rb_hash_aset(ah, sym, ox_freeze_str(pi->options, s));
         }
+	if (Yes == pi->options->freeze) {
+	    rb_obj_freeze(ah);
+	}
         rb_ivar_set(e, ox_attributes_id, ah);
     }
     if (helper_stack_empty(&pi->helpers)) { /* top level object */
@@ -379,7 +386,20 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
 static void
 end_element(PInfo pi, const char *ename) {
     if (!helper_stack_empty(&pi->helpers)) {
-	helper_stack_pop(&pi->helpers);
+	Helper	h = helper_stack_pop(&pi->helpers);
+
+	if (Yes == pi->options->freeze) {
+	    // The element is complete so freeze it and its nodes. It is the
+	    // last node of its parent or the top level object.
+	    if (Qnil != h->obj) {
+		rb_obj_freeze(h->obj);
+	    }
+	    if (helper_stack_empty(&pi->helpers)) {
+		rb_obj_freeze(pi->obj);
+	    } else {
+		rb_obj_freeze(rb_ary_entry(helper_stack_peek(&pi->helpers)->obj, -1));
+	    }
+	}
     }
 }
 
@@ -408,18 +428,17 @@ add_instruct(PInfo pi, const char *name, Attr attrs, const char *content) {
     }
 #endif
     inst = rb_obj_alloc(ox_instruct_clas);
-    rb_ivar_set(inst, ox_at_value_id, s);
+    rb_ivar_set(inst, ox_at_value_id, ox_freeze_str(pi->options, s));
     if (0 != content) {
-	rb_ivar_set(inst, ox_at_content_id, c);
+	rb_ivar_set(inst, ox_at_content_id, ox_freeze_str(pi->options, c));
     } else if (0 != attrs->name) {
         VALUE   ah = rb_hash_new();
         
         for (; 0 != attrs->name; attrs++) {
             VALUE   sym;
-            VALUE   *slot;
 
 	    if (Yes == pi->options->sym_keys) {
-		if (Qundef == (sym = ox_cache_get(ox_symbol_cache, attrs->name, &slot, 0))) {
+		if (Qundef == (sym = ox_cache_get(pi->caches->symbols, attrs->name, 0))) {
 #if HAS_ENCODING_SUPPORT
 		    if (0 != pi->options->rb_enc) {
 			VALUE	rstr = rb_str_new2(attrs->name);
@@ -441,10 +460,7 @@ add_instruct(PInfo pi, const char *name, Attr attrs, const char *content) {
 #else
 		    sym = ID2SYM(rb_intern(attrs->name));
 #endif
-		    // Needed for Ruby 2.2 to get around the GC of symbols
-		    // created with to_sym which is needed for encoded symbols.
-		    rb_ary_push(ox_sym_bank, sym);
-		    *slot = sym;
+		    ox_cache_set(pi->caches->symbols, attrs->name, sym, 0);
 		}
 	    } else {
 		sym = rb_str_new2(attrs->name);
@@ -468,10 +484,16 @@ add_instruct(PInfo pi, const char *name, Attr attrs, const char *content) {
 		rb_funcall(s, ox_force_encoding_id, 1, pi->options->rb_enc);
 	    }
 #endif
-            rb_hash_aset(ah, sym, s);
+            rb_hash_aset(ah, sym, ox_freeze_str(pi->options, s));
         }
+	if (Yes == pi->options->freeze) {
+	    rb_obj_freeze(ah);
+	}
         rb_ivar_set(inst, ox_attributes_id, ah);
     }
+    if (Yes == pi->options->freeze) {
+	rb_obj_freeze(inst);
+    }
     if (helper_stack_empty(&pi->helpers)) { /* top level object */
 	create_doc(pi);
     }
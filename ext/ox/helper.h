@@ -9,11 +9,27 @@
 #include "type.h"
 
 #define HELPER_STACK_INC	16
+#define MAX_PLAN_VARS		64
+
+/* What was learned about a class the first time an object of it was loaded,
+ * the class itself and the order of its instance variables. Later objects of
+ * the same class are expected to follow the same order.
+ */
+typedef struct _LoadPlan {
+    VALUE	clas;
+    int		cnt;
+    struct _PlanVar {
+	const char	*name;	/* from rb_id2name() so it outlives cache evictions */
+	ID		var;
+    } vars[MAX_PLAN_VARS];
+} *LoadPlan;
 
 typedef struct _Helper {
     ID		var;	/* Object var ID */
     VALUE	obj;	/* object created or Qundef if not appropriate */
     Type	type;	/* type of object in obj */
+    LoadPlan	plan;	/* plan for the class of obj if an Object or Exception */
+    int		pos;	/* position of the next instance variable in the plan */
 } *Helper;
 
 typedef struct _HelperStack {
@@ -66,6 +82,8 @@ helper_stack_push(HelperStack stack, ID var, VALUE obj, Type type) {
     stack->tail->var = var;
     stack->tail->obj = obj;
     stack->tail->type = type;
+    stack->tail->plan = 0;
+    stack->tail->pos = 0;
     stack->tail++;
 
     return stack->tail - 1;
@@ -12,6 +12,7 @@
 
 #include "ruby.h"
 #include "base64.h"
+#include "dbl.h"
 #include "ox.h"
 
 static void	instruct(PInfo pi, const char *target, Attr attrs, const char *content);
@@ -24,8 +25,8 @@ static VALUE	parse_xsd_time(const char *text, VALUE clas);
 static VALUE	parse_double_time(const char *text, VALUE clas);
 static VALUE	parse_regexp(const char *text);
 
-static VALUE		get_var_sym_from_attrs(Attr a, void *encoding);
-static VALUE		get_obj_from_attrs(Attr a, PInfo pi, VALUE base_class);
+static VALUE		get_var_sym_from_attrs(Attr a, void *encoding, Caches caches);
+static VALUE		get_obj_from_attrs(Attr a, PInfo pi, VALUE base_class, LoadPlan *planp);
 static VALUE		get_class_from_attrs(Attr a, PInfo pi, VALUE base_class);
 static VALUE		classname2class(const char *name, PInfo pi, VALUE base_class);
 static unsigned long	get_id_from_attrs(PInfo pi, Attr a);
@@ -73,13 +74,12 @@ str2sym(const char *str, void *encoding) {
 }
 
 inline static ID
-name2var(const char *name, void *encoding) {
-    VALUE	*slot;
+name2var(const char *name, void *encoding, Caches caches) {
     ID		var_id;
 
     if ('0' <= *name && *name <= '9') {
 	var_id = INT2NUM(atoi(name));
-    } else if (Qundef == (var_id = ox_cache_get(ox_attr_cache, name, &slot, 0))) {
+    } else if (Qundef == (var_id = ox_cache_get(caches->attrs, name, 0))) {
 #ifdef HAVE_RUBY_ENCODING_H
 	if (0 != encoding) {
 	    volatile VALUE	rstr = rb_str_new2(name);
@@ -87,9 +87,6 @@ name2var(const char *name, void *encoding) {
 	    
 	    rb_enc_associate(rstr, (rb_encoding*)encoding);
 	    sym = rb_funcall(rstr, ox_to_sym_id, 0);
-	    // Needed for Ruby 2.2 to get around the GC of symbols
-	    // created with to_sym which is needed for encoded symbols.
-	    rb_ary_push(ox_sym_bank, sym);
 	    var_id = SYM2ID(sym);
 	} else {
 	    var_id = rb_intern(name);
@@ -97,7 +94,7 @@ name2var(const char *name, void *encoding) {
 #else
 	var_id = rb_intern(name);
 #endif
-	*slot = var_id;
+	ox_cache_set(caches->attrs, name, var_id, 0);
     }
     return var_id;
 }
@@ -131,15 +128,60 @@ resolve_classname(VALUE mod, const char *class_name, Effort effort, VALUE base_c
     return clas;
 }
 
+static void
+plan_mark(void *ptr) {
+#if HAS_GC_COMPACT
+    rb_gc_mark_movable(((LoadPlan)ptr)->clas);
+#else
+    rb_gc_mark(((LoadPlan)ptr)->clas);
+#endif
+}
+
+#if HAS_GC_COMPACT
+static void
+plan_compact(void *ptr) {
+    LoadPlan	plan = (LoadPlan)ptr;
+
+    plan->clas = rb_gc_location(plan->clas);
+}
+#endif
+
+static const rb_data_type_t	plan_type = {
+    "Ox/load_plan",
+    {
+	plan_mark,
+	RUBY_TYPED_DEFAULT_FREE,
+	0,
+#if HAS_GC_COMPACT
+	plan_compact,
+#endif
+    },
+    0,
+    0,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
 inline static VALUE
-classname2obj(const char *name, PInfo pi, VALUE base_class) {
-    VALUE   clas = classname2class(name, pi, base_class);
-    
-    if (Qundef == clas) {
-	return Qnil;
-    } else {
-	return rb_obj_alloc(clas);
+classname2obj(const char *name, PInfo pi, VALUE base_class, LoadPlan *planp) {
+    VALUE	v = ox_cache_get(pi->caches->plans, name, 0);
+    LoadPlan	plan;
+
+    if (Qundef == v) {
+	VALUE	clas = classname2class(name, pi, base_class);
+
+	if (Qundef == clas) {
+	    return Qnil;
+	}
+	plan = ALLOC(struct _LoadPlan);
+	plan->clas = clas;
+	plan->cnt = 0;
+	v = TypedData_Wrap_Struct(0, &plan_type, plan);
+	v = ox_cache_set(pi->caches->plans, name, v, 0);
     }
+    plan = (LoadPlan)DATA_PTR(v);
+    *planp = plan;
+
+    return rb_obj_alloc(plan->clas);
 }
 
 #if HAS_RSTRUCT
@@ -202,10 +244,9 @@ parse_time(const char *text, VALUE clas) {
 
 static VALUE
 classname2class(const char *name, PInfo pi, VALUE base_class) {
-    VALUE	*slot;
     VALUE	clas;
 	    
-    if (Qundef == (clas = ox_cache_get(ox_class_cache, name, &slot, 0))) {
+    if (Qundef == (clas = ox_cache_get(pi->caches->classes, name, 0))) {
 	char		class_name[1024];
 	char		*s;
 	const char	*n = name;
@@ -229,27 +270,63 @@ classname2class(const char *name, PInfo pi, VALUE base_class) {
 	}
 	*s = '\0';
 	if (Qundef != (clas = resolve_classname(clas, class_name, pi->options->effort, base_class))) {
-	    *slot = clas;
+	    ox_cache_set(pi->caches->classes, name, clas, 0);
 	}
     }
     return clas;
 }
 
 static VALUE
-get_var_sym_from_attrs(Attr a, void *encoding) {
+get_var_sym_from_attrs(Attr a, void *encoding, Caches caches) {
     for (; 0 != a->name; a++) {
 	if ('a' == *a->name && '\0' == *(a->name + 1)) {
-	    return name2var(a->value, encoding);
+	    return name2var(a->value, encoding, caches);
 	}
     }
     return Qundef;
 }
 
+/* Looks up the instance variable for an element in an Object using the plan
+ * of the Object's class. The plan is extended as long as the Object follows
+ * it so it holds the order seen in the first Object of the class.
+ */
 static VALUE
-get_obj_from_attrs(Attr a, PInfo pi, VALUE base_class) {
+get_var_sym_from_plan(Attr a, Helper ph, PInfo pi) {
+    LoadPlan	plan = ph->plan;
+    int		pos;
+    ID		var;
+
+    for (; 0 != a->name; a++) {
+	if ('a' == *a->name && '\0' == *(a->name + 1)) {
+	    break;
+	}
+    }
+    if (0 == a->name) {
+	return Qundef;
+    }
+    pos = ph->pos++;
+    if (pos < plan->cnt) {
+	if (0 == strcmp(a->value, plan->vars[pos].name)) {
+	    return plan->vars[pos].var;
+	}
+	return name2var(a->value, (void*)pi->options->rb_enc, pi->caches);
+    }
+    var = name2var(a->value, (void*)pi->options->rb_enc, pi->caches);
+    // Numeric names are array indices, not variables. The name of an ID
+    // lives as long as the ID so it is safe to hold in the plan.
+    if (pos == plan->cnt && pos < MAX_PLAN_VARS && !('0' <= *a->value && *a->value <= '9')) {
+	plan->vars[pos].name = rb_id2name(var);
+	plan->vars[pos].var = var;
+	plan->cnt++;
+    }
+    return var;
+}
+
+static VALUE
+get_obj_from_attrs(Attr a, PInfo pi, VALUE base_class, LoadPlan *planp) {
     for (; 0 != a->name; a++) {
 	if ('c' == *a->name && '\0' == *(a->name + 1)) {
-	    return classname2obj(a->value, pi, base_class);
+	    return classname2obj(a->value, pi, base_class, planp);
 	}
     }
     return Qundef;
@@ -426,6 +503,7 @@ add_text(PInfo pi, char *text, int closed) {
 	    rb_funcall(h->obj, ox_force_encoding_id, 1, pi->options->rb_enc);
 	}
 #endif
+	h->obj = ox_freeze_str(pi->options, h->obj);
 	if (0 != pi->circ_array) {
 	    circ_array_set(pi->circ_array, h->obj, (unsigned long)pi->id);
 	}
@@ -456,19 +534,15 @@ add_text(PInfo pi, char *text, int closed) {
 	break;
     }
     case FloatCode:
-	h->obj = rb_float_new(strtod(text, 0));
+	h->obj = rb_float_new(ox_dbl_parse(text, 0));
 	break;
     case SymbolCode:
     {
 	VALUE	sym;
-	VALUE	*slot;
 
-	if (Qundef == (sym = ox_cache_get(ox_symbol_cache, text, &slot, 0))) {
+	if (Qundef == (sym = ox_cache_get(pi->caches->symbols, text, 0))) {
 	    sym = str2sym(text, (void*)pi->options->rb_enc);
-	    // Needed for Ruby 2.2 to get around the GC of symbols created with
-	    // to_sym which is needed for encoded symbols.
-	    rb_ary_push(ox_sym_bank, sym);
-	    *slot = sym;
+	    ox_cache_set(pi->caches->symbols, text, sym, 0);
 	}
 	h->obj = sym;
 	break;
@@ -489,11 +563,9 @@ add_text(PInfo pi, char *text, int closed) {
     case String64Code:
     {
 	unsigned long	str_size = b64_orig_size(text);
-	VALUE		v;
-	char		*str = ALLOCA_N(char, str_size + 1);
-	
-	from_base64(text, (uchar*)str);
-	v = rb_str_new(str, str_size);
+	VALUE		v = rb_str_new(0, str_size);
+
+	from_base64(text, (uchar*)RSTRING_PTR(v));
 #if HAS_ENCODING_SUPPORT
 	if (0 != pi->options->rb_enc) {
 	    rb_enc_associate(v, pi->options->rb_enc);
@@ -503,6 +575,7 @@ add_text(PInfo pi, char *text, int closed) {
 	    rb_funcall(v, ox_force_encoding_id, 1, pi->options->rb_enc);
 	}
 #endif
+	v = ox_freeze_str(pi->options, v);
 	if (0 != pi->circ_array) {
 	    circ_array_set(pi->circ_array, v, (unsigned long)h->obj);
 	}
@@ -512,17 +585,13 @@ add_text(PInfo pi, char *text, int closed) {
     case Symbol64Code:
     {
 	VALUE		sym;
-	VALUE		*slot;
 	unsigned long	str_size = b64_orig_size(text);
 	char		*str = ALLOCA_N(char, str_size + 1);
 	
 	from_base64(text, (uchar*)str);
-	if (Qundef == (sym = ox_cache_get(ox_symbol_cache, str, &slot, 0))) {
+	if (Qundef == (sym = ox_cache_get(pi->caches->symbols, str, 0))) {
 	    sym = str2sym(str, (void*)pi->options->rb_enc);
-	    // Needed for Ruby 2.2 to get around the GC of symbols created with
-	    // to_sym which is needed for encoded symbols.
-	    rb_ary_push(ox_sym_bank, sym);
-	    *slot = sym;
+	    ox_cache_set(pi->caches->symbols, str, sym, 0);
 	}
 	h->obj = sym;
 	break;
@@ -558,6 +627,8 @@ static void
 add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
     Attr		a;
     Helper		h;
+    Helper		ph;
+    ID			var;
     unsigned long	id;
 
     if (TRACE <= pi->options->trace) {
@@ -589,7 +660,13 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
 	set_error(&pi->err, "Invalid element name", pi->str, pi->s);
 	return;
     }
-    h = helper_stack_push(&pi->helpers, get_var_sym_from_attrs(attrs, (void*)pi->options->rb_enc), Qundef, *ename);
+    ph = helper_stack_peek(&pi->helpers);
+    if (0 != ph && 0 != ph->plan) {
+	var = get_var_sym_from_plan(attrs, ph, pi);
+    } else {
+	var = get_var_sym_from_attrs(attrs, (void*)pi->options->rb_enc, pi->caches);
+    }
+    h = helper_stack_push(&pi->helpers, var, Qundef, *ename);
     switch (h->type) {
     case NilClassCode:
 	h->obj = Qnil;
@@ -654,7 +731,7 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
 	}
 	break;
     case ExceptionCode:
-	if (Qundef == (h->obj = get_obj_from_attrs(attrs, pi, rb_eException))) {
+	if (Qundef == (h->obj = get_obj_from_attrs(attrs, pi, rb_eException, &h->plan))) {
 	    return;
 	}
 	if (0 != pi->circ_array && Qnil != h->obj) {
@@ -662,7 +739,7 @@ add_element(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
 	}
 	break;
     case ObjectCode:
-	if (Qundef == (h->obj = get_obj_from_attrs(attrs, pi, ox_bag_clas))) {
+	if (Qundef == (h->obj = get_obj_from_attrs(attrs, pi, ox_bag_clas, &h->plan))) {
 	    return;
 	}
 	if (0 != pi->circ_array && Qnil != h->obj) {
@@ -727,7 +804,12 @@ end_element(PInfo pi, const char *ename) {
 
 	if (ox_empty_string == h->obj) {
 	    /* special catch for empty strings */
-	    h->obj = rb_str_new2("");
+	    h->obj = ox_freeze_str(pi->options, rb_str_new2(""));
+	}
+	if (Yes == pi->options->freeze && RefCode != h->type && ClassCode != h->type) {
+	    /* complete now, references are to objects still being built and
+	     * classes are not part of the loaded data */
+	    rb_obj_freeze(h->obj);
 	}
 	pi->obj = h->obj;
 	if (0 != ph) {
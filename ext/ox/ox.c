@@ -10,7 +10,14 @@
 #include <stdio.h>
 #include <string.h>
 
+#if HAS_ZLIB
+#include <zlib.h>
+#endif
+
 #include "ruby.h"
+#if HAS_RACTOR
+#include "ruby/ractor.h"
+#endif
 #include "ox.h"
 #include "sax.h"
 
@@ -39,11 +46,16 @@ ID	ox_attr_value_id;
 ID	ox_attributes_id;
 ID	ox_attrs_done_id;
 ID	ox_beg_id;
+ID	ox_call_id;
 ID	ox_cdata_id;
+ID	ox_cdata_value_id;
+ID	ox_column_id;
 ID	ox_comment_id;
+ID	ox_comment_value_id;
 ID	ox_den_id;
 ID	ox_doctype_id;
 ID	ox_end_element_id;
+ID	ox_end_element_ns_id;
 ID	ox_end_id;
 ID	ox_end_instruct_id;
 ID	ox_error_id;
@@ -55,6 +67,7 @@ ID	ox_inspect_id;
 ID	ox_instruct_id;
 ID	ox_jd_id;
 ID	ox_keys_id;
+ID	ox_line_id;
 ID	ox_local_id;
 ID	ox_mesg_id;
 ID	ox_message_id;
@@ -65,7 +78,9 @@ ID	ox_parse_id;
 ID	ox_pos_id;
 ID	ox_read_id;
 ID	ox_readpartial_id;
+ID	ox_sax_drive_id;
 ID	ox_start_element_id;
+ID	ox_start_element_ns_id;
 ID	ox_string_id;
 ID	ox_text_id;
 ID	ox_to_c_id;
@@ -81,10 +96,10 @@ VALUE	ox_version_sym;
 VALUE	ox_standalone_sym;
 VALUE	ox_indent_sym;
 VALUE	ox_size_sym;
+VALUE	ox_gzip_sym;
 
 VALUE	ox_empty_string;
 VALUE	ox_zero_fixnum;
-VALUE	ox_sym_bank; // Array
 
 VALUE	ox_arg_error_class;
 VALUE	ox_bag_clas;
@@ -102,21 +117,26 @@ VALUE	ox_stringio_class;
 VALUE	ox_struct_class;
 VALUE	ox_time_class;
 
-Cache	ox_symbol_cache = 0;
-Cache	ox_class_cache = 0;
-Cache	ox_attr_cache = 0;
+static Caches	main_caches = 0;
+#if HAS_RACTOR
+static rb_ractor_local_key_t	caches_key;
+#endif
 
 static VALUE	abort_sym;
 static VALUE	active_sym;
 static VALUE	auto_define_sym;
+static VALUE	attr_prefix_sym;
 static VALUE	auto_sym;
 static VALUE	block_sym;
+static VALUE	cache_limit_sym;
 static VALUE	circular_sym;
 static VALUE	convert_special_sym;
 static VALUE	effort_sym;
+static VALUE	freeze_sym;
 static VALUE	generic_sym;
 static VALUE	inactive_sym;
 static VALUE	invalid_replace_sym;
+static VALUE	invalid_utf8_sym;
 static VALUE	limited_sym;
 static VALUE	mode_sym;
 static VALUE	object_sym;
@@ -124,6 +144,10 @@ static VALUE	off_sym;
 static VALUE	opt_format_sym;
 static VALUE	optimized_sym;
 static VALUE	overlay_sym;
+static VALUE	raise_sym;
+static VALUE	replace_sym;
+static VALUE	reuse_strings_sym;
+static VALUE	root_sym;
 static VALUE	skip_none_sym;
 static VALUE	skip_return_sym;
 static VALUE	skip_sym;
@@ -133,6 +157,7 @@ static VALUE	strict_sym;
 static VALUE	strip_namespace_sym;
 static VALUE	symbolize_keys_sym;
 static VALUE	symbolize_sym;
+static VALUE	text_key_sym;
 static VALUE	tolerant_sym;
 static VALUE	trace_sym;
 static VALUE	with_dtd_sym;
@@ -171,10 +196,13 @@ struct _Options	 ox_default_options = {
     { '\0' },		/* strip_ns */
     NULL,		/* html_hints */
 #if HAS_PRIVATE_ENCODING
-    Qnil		/* rb_enc */
+    Qnil,		/* rb_enc */
 #else
-    0			/* rb_enc */
+    0,			/* rb_enc */
 #endif
+    0,			/* cache_limit */
+    No,			/* freeze */
+    NoUtf8		/* invalid_utf8 */
 };
 
 extern ParseCallbacks	ox_obj_callbacks;
@@ -184,6 +212,200 @@ extern ParseCallbacks	ox_nomode_callbacks;
 
 static void	parse_dump_options(VALUE ropts, Options copts);
 
+static void
+caches_mark(void *ptr) {
+    Caches	c = (Caches)ptr;
+
+    ox_cache_mark(c->symbols);
+    ox_cache_mark(c->classes);
+    ox_cache_mark(c->strs);
+    ox_cache_mark(c->plans);
+}
+
+static void
+caches_free(void *ptr) {
+    Caches	c = (Caches)ptr;
+
+    ox_cache_free(c->symbols);
+    ox_cache_free(c->classes);
+    ox_cache_free(c->attrs);
+    ox_cache_free(c->strs);
+    ox_cache_free(c->plans);
+    xfree(c);
+}
+
+#if HAS_GC_COMPACT
+static void
+caches_compact(void *ptr) {
+    Caches	c = (Caches)ptr;
+
+    ox_cache_compact(c->symbols);
+    ox_cache_compact(c->classes);
+    ox_cache_compact(c->strs);
+    ox_cache_compact(c->plans);
+}
+#endif
+
+/* The caches are held by a wrapper object so the GC can mark, free, and
+ * compact them. The wrapper itself lives in Ractor local storage or in a
+ * registered global.
+ */
+static const rb_data_type_t	caches_type = {
+    "Ox/caches",
+    {
+	caches_mark,
+	caches_free,
+	0,
+#if HAS_GC_COMPACT
+	caches_compact,
+#endif
+    },
+    0,
+    0,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+#if !HAS_RACTOR
+static VALUE	main_caches_holder = Qnil;
+#endif
+
+static void
+caches_set_limit(Caches c, size_t limit) {
+    ox_cache_set_limit(c->symbols, limit);
+    ox_cache_set_limit(c->classes, limit);
+    ox_cache_set_limit(c->attrs, limit);
+    ox_cache_set_limit(c->strs, limit);
+    ox_cache_set_limit(c->plans, limit);
+}
+
+static Caches
+caches_new(void) {
+    Caches	c = ALLOC(struct _Caches);
+
+    /* attrs holds IDs, the rest hold Ruby objects */
+    ox_cache_new(&c->symbols, 1);
+    ox_cache_new(&c->classes, 1);
+    ox_cache_new(&c->attrs, 0);
+    ox_cache_new(&c->strs, 1);
+    ox_cache_new(&c->plans, 1);
+    c->active = 0;
+    caches_set_limit(c, ox_default_options.cache_limit);
+
+    return c;
+}
+
+/* Returns the caches of the current Ractor, creating them on first use. */
+Caches
+ox_caches(void) {
+#if HAS_RACTOR
+    VALUE	holder;
+
+    if (!rb_ractor_local_storage_value_lookup(caches_key, &holder)) {
+	holder = TypedData_Wrap_Struct(0, &caches_type, caches_new());
+	rb_ractor_local_storage_value_set(caches_key, holder);
+    }
+    return (Caches)DATA_PTR(holder);
+#else
+    if (0 == main_caches) {
+	main_caches = caches_new();
+	main_caches_holder = TypedData_Wrap_Struct(0, &caches_type, main_caches);
+	rb_gc_register_address(&main_caches_holder);
+    }
+    return main_caches;
+#endif
+}
+
+/* Parses call ox_caches_enter() before using the caches and
+ * ox_caches_leave() when done. Keys handed out by the caches stay valid until
+ * the outermost parse leaves at which point evicted entries are freed.
+ */
+void
+ox_caches_enter(Caches caches) {
+    caches->active++;
+}
+
+void
+ox_caches_leave(Caches caches) {
+    if (0 == --caches->active) {
+	ox_cache_reclaim(caches->symbols);
+	ox_cache_reclaim(caches->classes);
+	ox_cache_reclaim(caches->attrs);
+	ox_cache_reclaim(caches->strs);
+	ox_cache_reclaim(caches->plans);
+    }
+}
+
+/* A long running parse, such as a SAX stream, calls this between events so
+ * evicted entries do not pile up until it finishes. Only the keys held()
+ * reports are kept and nothing is freed if a nested or concurrent parse is
+ * using the caches.
+ */
+void
+ox_caches_reclaim_unheld(Caches caches, int (*held)(const char *key, void *ctx), void *ctx) {
+    if (1 == caches->active) {
+	ox_cache_reclaim_unheld(caches->symbols, held, ctx);
+	ox_cache_reclaim_unheld(caches->classes, held, ctx);
+	ox_cache_reclaim_unheld(caches->attrs, held, ctx);
+	ox_cache_reclaim_unheld(caches->strs, held, ctx);
+	ox_cache_reclaim_unheld(caches->plans, held, ctx);
+    }
+}
+
+static VALUE
+cache_stats_hash(Cache cache) {
+    struct _CacheStats	stats;
+    VALUE		h = rb_hash_new();
+
+    ox_cache_stats(cache, &stats);
+    rb_hash_aset(h, ox_size_sym, ULONG2NUM(stats.size));
+    rb_hash_aset(h, ID2SYM(rb_intern("limit")), (0 == stats.limit) ? Qnil : ULONG2NUM(stats.limit));
+    rb_hash_aset(h, ID2SYM(rb_intern("hits")), ULONG2NUM(stats.hits));
+    rb_hash_aset(h, ID2SYM(rb_intern("misses")), ULONG2NUM(stats.misses));
+    rb_hash_aset(h, ID2SYM(rb_intern("evictions")), ULONG2NUM(stats.evictions));
+
+    return h;
+}
+
+/* call-seq: cache_stats() => Hash
+ *
+ * Returns statistics for the name caches of the current Ractor. Each cache,
+ * :symbols, :classes, :attrs, :strings, and :plans, has a Hash of its
+ * :size, :limit, :hits, :misses, and :evictions.
+ */
+static VALUE
+cache_stats(VALUE self) {
+    Caches	c = ox_caches();
+    VALUE	h = rb_hash_new();
+
+    rb_hash_aset(h, ID2SYM(rb_intern("symbols")), cache_stats_hash(c->symbols));
+    rb_hash_aset(h, ID2SYM(rb_intern("classes")), cache_stats_hash(c->classes));
+    rb_hash_aset(h, ID2SYM(rb_intern("attrs")), cache_stats_hash(c->attrs));
+    rb_hash_aset(h, ID2SYM(rb_intern("strings")), cache_stats_hash(c->strs));
+    rb_hash_aset(h, ID2SYM(rb_intern("plans")), cache_stats_hash(c->plans));
+
+    return h;
+}
+
+/* call-seq: clear_caches() => nil
+ *
+ * Empties the name caches of the current Ractor. Cached Symbols and Strings
+ * are no longer held once any parse in progress completes.
+ */
+static VALUE
+clear_caches(VALUE self) {
+    Caches	c = ox_caches();
+
+    ox_caches_enter(c);
+    ox_cache_clear(c->symbols);
+    ox_cache_clear(c->classes);
+    ox_cache_clear(c->attrs);
+    ox_cache_clear(c->strs);
+    ox_cache_clear(c->plans);
+    ox_caches_leave(c);
+
+    return Qnil;
+}
+
 static char*
 defuse_bom(char *xml, Options options) {
     switch ((uint8_t)*xml) {
@@ -233,6 +455,20 @@ defuse_bom(char *xml, Options options) {
     return xml;
 }
 
+static char
+utf8_mode(VALUE v) {
+    if (Qnil == v) {
+	return NoUtf8;
+    } else if (replace_sym == v) {
+	return ReplaceUtf8;
+    } else if (raise_sym == v) {
+	return RaiseUtf8;
+    }
+    rb_raise(ox_parse_error_class, ":invalid_utf8 must be :replace, :raise, or nil.\n");
+
+    return NoUtf8;
+}
+
 static VALUE
 hints_to_overlay(Hints hints) {
     volatile VALUE	overlay = rb_hash_new();
@@ -259,6 +495,7 @@ hints_to_overlay(Hints hints) {
  * Returns the default load and dump options as a Hash. The options are
  * - _:indent_ [Fixnum] number of spaces to indent each element in an XML document
  * - _:trace_ [Fixnum] trace level where 0 is silent
+ * - _:cache_limit_ [Fixnum|nil] maximum entries in each name cache, nil for no limit
  * - _:encoding_ [String] character encoding for the XML file
  * - _:with_dtd_ [true|false|nil] include DTD in the dump
  * - _:with_instruct_ [true|false|nil] include instructions in the dump
@@ -268,6 +505,8 @@ hints_to_overlay(Hints hints) {
  * - _:mode_ [:object|:generic|:limited|nil] load method to use for XML
  * - _:effort_ [:strict|:tolerant|:auto_define] set the tolerance level for loading
  * - _:symbolize_keys_ [true|false|nil] symbolize element attribute keys or leave as Strings
+ * - _:freeze_ [true|false|nil] freeze loaded objects and deduplicate Strings as they are built
+ * - _:invalid_utf8_ [:replace|:raise|nil] replace invalid UTF-8 with U+FFFD or raise when loading, dumping, or SAX parsing, nil for no check
  * - _:skip_ [:skip_none|:skip_return|:skip_white] determines how to handle white space in text
  * - _:smart_ [true|false|nil] flag indicating the SAX parser uses hints if available (use with html)
  * - _:convert_special_ [true|false|nil] flag indicating special characters like &lt; are converted with the SAX parser
@@ -293,6 +532,7 @@ get_def_opts(VALUE self) {
     rb_hash_aset(opts, ox_encoding_sym, (0 == elen) ? Qnil : rb_str_new(ox_default_options.encoding, elen));
     rb_hash_aset(opts, ox_indent_sym, INT2FIX(ox_default_options.indent));
     rb_hash_aset(opts, trace_sym, INT2FIX(ox_default_options.trace));
+    rb_hash_aset(opts, cache_limit_sym, (0 == ox_default_options.cache_limit) ? Qnil : ULONG2NUM(ox_default_options.cache_limit));
     rb_hash_aset(opts, with_dtd_sym, (Yes == ox_default_options.with_dtd) ? Qtrue : ((No == ox_default_options.with_dtd) ? Qfalse : Qnil));
     rb_hash_aset(opts, with_xml_sym, (Yes == ox_default_options.with_xml) ? Qtrue : ((No == ox_default_options.with_xml) ? Qfalse : Qnil));
     rb_hash_aset(opts, with_instruct_sym, (Yes == ox_default_options.with_instruct) ? Qtrue : ((No == ox_default_options.with_instruct) ? Qfalse : Qnil));
@@ -301,6 +541,12 @@ get_def_opts(VALUE self) {
     rb_hash_aset(opts, symbolize_keys_sym, (Yes == ox_default_options.sym_keys) ? Qtrue : ((No == ox_default_options.sym_keys) ? Qfalse : Qnil));
     rb_hash_aset(opts, smart_sym, (Yes == ox_default_options.smart) ? Qtrue : ((No == ox_default_options.smart) ? Qfalse : Qnil));
     rb_hash_aset(opts, convert_special_sym, (ox_default_options.convert_special) ? Qtrue : Qfalse);
+    rb_hash_aset(opts, freeze_sym, (Yes == ox_default_options.freeze) ? Qtrue : ((No == ox_default_options.freeze) ? Qfalse : Qnil));
+    switch (ox_default_options.invalid_utf8) {
+    case ReplaceUtf8:		rb_hash_aset(opts, invalid_utf8_sym, replace_sym);	break;
+    case RaiseUtf8:		rb_hash_aset(opts, invalid_utf8_sym, raise_sym);	break;
+    default:			rb_hash_aset(opts, invalid_utf8_sym, Qnil);		break;
+    }
     switch (ox_default_options.mode) {
     case ObjMode:	rb_hash_aset(opts, mode_sym, object_sym);	break;
     case GenMode:	rb_hash_aset(opts, mode_sym, generic_sym);	break;
@@ -386,6 +632,7 @@ sax_html_overlay(VALUE self) {
  * - +opts+ [Hash] opts options to change
  *   - _:indent_ [Fixnum] number of spaces to indent each element in an XML document
  *   - _:trace_ [Fixnum] trace level where 0 is silent
+ *   - _:cache_limit_ [Fixnum|nil] maximum entries in each name cache, nil for no limit. Ractors created later use the new limit.
  *   - _:encoding_ [String] character encoding for the XML file
  *   - _:with_dtd_ [true|false|nil] include DTD in the dump
  *   - _:with_instruct_ [true|false|nil] include instructions in the dump
@@ -395,6 +642,8 @@ sax_html_overlay(VALUE self) {
  *   - _:mode_ [:object|:generic|:limited|nil] load method to use for XML
  *   - _:effort_ [:strict|:tolerant|:auto_define] set the tolerance level for loading
  *   - _:symbolize_keys_ [true|false|nil] symbolize element attribute keys or leave as Strings
+ *   - _:freeze_ [true|false|nil] freeze loaded objects and deduplicate Strings as they are built
+ *   - _:invalid_utf8_ [:replace|:raise|nil] replace invalid UTF-8 with U+FFFD or raise when loading, dumping, or SAX parsing, nil for no check
  *   - _:skip_ [:skip_none|:skip_return|:skip_white] determines how to handle white space in text
  *   - _:smart_ [true|false|nil] flag indicating the SAX parser uses hints if available (use with html)
  *   - _:invalid_replace_ [nil|String] replacement string for invalid XML characters on dump. nil indicates include anyway as hex. A string, limited to 10 characters will replace the invalid character with the replace.
@@ -406,6 +655,9 @@ sax_html_overlay(VALUE self) {
  *   - _:off_ - block this element and it's children unless the child element is active
  *   - _:abort_ - abort the html processing and return
  *
+ * The defaults are shared by all Ractors so they can only be set from the
+ * main Ractor.
+ *
  * *return* [nil]
  */
 static VALUE
@@ -418,12 +670,18 @@ set_def_opts(VALUE self, VALUE opts) {
 	{ circular_sym, &ox_default_options.circular },
 	{ symbolize_keys_sym, &ox_default_options.sym_keys },
 	{ smart_sym, &ox_default_options.smart },
+	{ freeze_sym, &ox_default_options.freeze },
 	{ Qnil, 0 }
     };
     YesNoOpt	o;
     VALUE	v;
     
     Check_Type(opts, T_HASH);
+#if HAS_RACTOR
+    if (ox_caches() != main_caches) {
+	rb_raise(rb_path2class("Ractor::IsolationError"), "Ox.default_options can only be set from the main Ractor.");
+    }
+#endif
 
     v = rb_hash_aref(opts, ox_encoding_sym);
     if (Qnil == v) {
@@ -451,6 +709,12 @@ set_def_opts(VALUE self, VALUE opts) {
 	ox_default_options.trace = FIX2INT(v);
     }
 
+    v = rb_hash_lookup2(opts, cache_limit_sym, Qundef);
+    if (Qundef != v) {
+	ox_default_options.cache_limit = (Qnil == v) ? 0 : NUM2ULONG(v);
+	caches_set_limit(ox_caches(), ox_default_options.cache_limit);
+    }
+
     v = rb_hash_aref(opts, mode_sym);
     if (Qnil == v) {
 	ox_default_options.mode = NoMode;
@@ -490,6 +754,8 @@ set_def_opts(VALUE self, VALUE opts) {
 	rb_raise(ox_parse_error_class, ":skip must be :skip_none, :skip_return, :skip_white, or nil.\n");
     }
 
+    ox_default_options.invalid_utf8 = utf8_mode(rb_hash_aref(opts, invalid_utf8_sym));
+
     v = rb_hash_lookup(opts, convert_special_sym);
     if (Qnil == v) {
 	// no change
@@ -600,16 +866,12 @@ to_obj(VALUE self, VALUE ruby_xml) {
 	xml = ALLOCA_N(char, len);
     }
     memcpy(xml, x, len);
-#if HAS_GC_GUARD
-    rb_gc_disable();
-#endif
     obj = ox_parse(xml, ox_obj_callbacks, 0, &options, &err);
     if (SMALL_XML < len) {
 	xfree(xml);
     }
 #if HAS_GC_GUARD
     RB_GC_GUARD(obj);
-    rb_gc_enable();
 #endif
     if (err_has(&err)) {
 	ox_err_raise(&err);
@@ -709,6 +971,12 @@ load(char *xml, int argc, VALUE *argv, VALUE self, VALUE encoding, Err err) {
 	if (Qnil != (v = rb_hash_lookup(h, convert_special_sym))) {
 	    options.convert_special = (Qfalse != v);
 	}
+	if (Qnil != (v = rb_hash_lookup(h, freeze_sym))) {
+	    options.freeze = (Qfalse == v) ? No : Yes;
+	}
+	if (Qundef != (v = rb_hash_lookup2(h, invalid_utf8_sym, Qundef))) {
+	    options.invalid_utf8 = utf8_mode(v);
+	}
 
 	v = rb_hash_lookup(h, invalid_replace_sym);
 	if (Qnil == v) {
@@ -773,13 +1041,9 @@ load(char *xml, int argc, VALUE *argv, VALUE self, VALUE encoding, Err err) {
     xml = defuse_bom(xml, &options);
     switch (options.mode) {
     case ObjMode:
-#if HAS_GC_GUARD
-	rb_gc_disable();
-#endif
 	obj = ox_parse(xml, ox_obj_callbacks, 0, &options, err);
 #if HAS_GC_GUARD
 	RB_GC_GUARD(obj);
-	rb_gc_enable();
 #endif
 	break;
     case GenMode:
@@ -818,6 +1082,8 @@ load(char *xml, int argc, VALUE *argv, VALUE self, VALUE encoding, Err err) {
  *     - _:auto_define_ - auto define missing classes and modules
  *   - *:trace* [Fixnum] trace level as a Fixnum, default: 0 (silent)
  *   - *:symbolize_keys* [true|false|nil] symbolize element attribute keys or leave as Strings
+ *   - *:freeze* [true|false] freeze objects and deduplicate Strings as they are built so the result can be shared with other Ractors, default: false
+ *   - *:invalid_utf8* [:replace|:raise|nil] replace invalid UTF-8 with U+FFFD or raise a ParseError, default: nil
  *   - *:invalid_replace* [nil|String] replacement string for invalid XML characters on dump. nil indicates include anyway as hex. A string, limited to 10 characters will replace the invalid character with the replace.
  *   - *:strip_namespace* [String|true|false] "" or false result in no namespace stripping. A string of "*" or true will strip all namespaces. Any other non-empty string indicates that matching namespaces will be stripped.
  */
@@ -860,6 +1126,41 @@ load_str(int argc, VALUE *argv, VALUE self) {
     return obj;
 }
 
+#if HAS_ZLIB
+/* Reads all of a gzip compressed file into a buffer that must be freed with
+ * xfree(). Returns 0 on failure.
+ */
+static char*
+read_gz_file(const char *path, size_t *lenp) {
+    gzFile	gz;
+    char	*xml;
+    size_t	size = 0x10000;
+    size_t	len = 0;
+    int		cnt;
+
+    if (0 == (gz = gzopen(path, "rb"))) {
+	return 0;
+    }
+    xml = ALLOC_N(char, size + 1);
+    while (0 < (cnt = gzread(gz, xml + len, (unsigned int)(size - len)))) {
+	len += cnt;
+	if (size == len) {
+	    size *= 2;
+	    REALLOC_N(xml, char, size + 1);
+	}
+    }
+    gzclose(gz);
+    if (0 > cnt) {
+	xfree(xml);
+	return 0;
+    }
+    xml[len] = '\0';
+    *lenp = len;
+
+    return xml;
+}
+#endif
+
 /* call-seq: load_file(file_path, options) => Ox::Document or Ox::Element or Object
  *
  * Parses and XML document from a file into an Ox::Document, or Ox::Element,
@@ -877,8 +1178,12 @@ load_str(int argc, VALUE *argv, VALUE self) {
  *     - _:auto_define_ - auto define missing classes and modules
  *   - *:trace* [Fixnum] trace level as a Fixnum, default: 0 (silent)
  *   - *:symbolize_keys* [true|false|nil] symbolize element attribute keys or leave as Strings
+ *   - *:freeze* [true|false] freeze objects and deduplicate Strings as they are built so the result can be shared with other Ractors, default: false
+ *   - *:invalid_utf8* [:replace|:raise|nil] replace invalid UTF-8 with U+FFFD or raise a ParseError, default: nil
  *   - *:invalid_replace* [nil|String] replacement string for invalid XML characters on dump. nil indicates include anyway as hex. A string, limited to 10 characters will replace the invalid character with the replace.
  *   - *:strip_namespace* [String|true|false] "" or false result in no namespace stripping. A string of "*" or true will strip all namespaces. Any other non-empty string indicates that matching namespaces will be stripped.
+ *
+ * Files compressed with gzip are decompressed as they are read.
  */
 static VALUE
 load_file(int argc, VALUE *argv, VALUE self) {
@@ -895,6 +1200,20 @@ load_file(int argc, VALUE *argv, VALUE self) {
     if (0 == (f = fopen(path, "r"))) {
 	rb_raise(rb_eIOError, "%s\n", strerror(errno));
     }
+#if HAS_ZLIB
+    if (0x1F == getc(f) && 0x8B == getc(f)) {
+	fclose(f);
+	if (0 == (xml = read_gz_file(path, &len))) {
+	    rb_raise(rb_eIOError, "Failed to decompress %s.\n", path);
+	}
+	obj = load(xml, argc - 1, argv + 1, self, Qnil, &err);
+	xfree(xml);
+	if (err_has(&err)) {
+	    ox_err_raise(&err);
+	}
+	return obj;
+    }
+#endif
     fseek(f, 0, SEEK_END);
     len = ftell(f);
     if (SMALL_XML < len) {
@@ -923,7 +1242,8 @@ load_file(int argc, VALUE *argv, VALUE self) {
 /* call-seq: sax_parse(handler, io, options)
  *
  * Parses an IO stream or file containing an XML document. Raises an exception
- * if the XML is malformed or the classes specified are not valid.
+ * if the XML is malformed or the classes specified are not valid. A File
+ * compressed with gzip is decompressed as it is read.
  * - +handler+ [Ox::Sax] SAX (responds to OX::Sax methods) like handler
  * - +io+ [IO|String] IO Object to read from
  * - +options+ [Hash] options parse options
@@ -931,7 +1251,9 @@ load_file(int argc, VALUE *argv, VALUE self) {
  *   - *:symbolize* [true|false] flag indicating the parser symbolize element and attribute names
  *   - *:smart* [true|false] flag indicating the parser uses hints if available (use with html)
  *   - *:skip* [:skip_return|:skip_white] flag indicating the parser skips \r or collpase white space into a single space. Default (skip nothing)
- *   - *:strip_namespace* [nil|String|true|false] "" or false result in no namespace stripping. A string of "*" or true will strip all namespaces. Any other non-empty string indicates that matching namespaces will be stripped.
+ *   - *:strip_namespace* [nil|String|true|false] "" or false result in no namespace stripping. A string of "*" or true will strip all namespaces. Any other non-empty string indicates that matching namespaces will be stripped. Ignored if the handler responds to start_element_ns() or end_element_ns().
+ *   - *:reuse_strings* [true|false] flag indicating the same String is refilled and passed to each text, cdata, and comment callback. The String is only valid for the duration of the callback.
+ *   - *:invalid_utf8* [:replace|:raise|nil] replace invalid UTF-8 with U+FFFD as it is read or raise, reporting through error() if the handler has it, default: nil
  */
 static VALUE
 sax_parse(int argc, VALUE *argv, VALUE self) {
@@ -941,6 +1263,8 @@ sax_parse(int argc, VALUE *argv, VALUE self) {
     options.convert_special = ox_default_options.convert_special;
     options.smart = (Yes == ox_default_options.smart);
     options.skip = ox_default_options.skip;
+    options.reuse_strings = 0;
+    options.invalid_utf8 = ox_default_options.invalid_utf8;
     options.hints = NULL;
     strcpy(options.strip_ns, ox_default_options.strip_ns);
     
@@ -960,6 +1284,9 @@ sax_parse(int argc, VALUE *argv, VALUE self) {
 	if (Qnil != (v = rb_hash_lookup(h, symbolize_sym))) {
 	    options.symbolize = (Qtrue == v);
 	}
+	if (Qnil != (v = rb_hash_lookup(h, reuse_strings_sym))) {
+	    options.reuse_strings = (Qtrue == v);
+	}
 	if (Qnil != (v = rb_hash_lookup(h, skip_sym))) {
 	    if (skip_return_sym == v) {
 		options.skip = CrSkip;
@@ -969,6 +1296,9 @@ sax_parse(int argc, VALUE *argv, VALUE self) {
 		options.skip = NoSkip;
 	    }
 	}
+	if (Qundef != (v = rb_hash_lookup2(h, invalid_utf8_sym, Qundef))) {
+	    options.invalid_utf8 = utf8_mode(v);
+	}
 	if (Qnil != (v = rb_hash_lookup(h, strip_namespace_sym))) {
 	    if (Qfalse == v) {
 		*options.strip_ns = '\0';
@@ -997,7 +1327,8 @@ sax_parse(int argc, VALUE *argv, VALUE self) {
 /* call-seq: sax_html(handler, io, options)
  *
  * Parses an IO stream or file containing an XML document. Raises an exception
- * if the XML is malformed or the classes specified are not valid.
+ * if the XML is malformed or the classes specified are not valid. A File
+ * compressed with gzip is decompressed as it is read.
  * - +handler+ [Ox::Sax] SAX (responds to OX::Sax methods) like handler
  * - +io+ [IO|String] IO Object to read from
  * - +options+ [Hash] options parse options
@@ -1010,6 +1341,8 @@ sax_parse(int argc, VALUE *argv, VALUE self) {
  *     - _:block_ - block this and all children callbacks
  *     - _:off_ - block this element and it's children unless the child element is active
  *     - _:abort_ - abort the html processing and return
+ *   - *:reuse_strings* [true|false] flag indicating the same String is refilled and passed to each text, cdata, and comment callback. The String is only valid for the duration of the callback.
+ *   - *:invalid_utf8* [:replace|:raise|nil] replace invalid UTF-8 with U+FFFD as it is read or raise, reporting through error() if the handler has it, default: nil
  */
 static VALUE
 sax_html(int argc, VALUE *argv, VALUE self) {
@@ -1020,6 +1353,8 @@ sax_html(int argc, VALUE *argv, VALUE self) {
     options.convert_special = ox_default_options.convert_special;
     options.smart = true;
     options.skip = ox_default_options.skip;
+    options.reuse_strings = 0;
+    options.invalid_utf8 = ox_default_options.invalid_utf8;
     options.hints = ox_default_options.html_hints;
     if (NULL == options.hints) {
 	options.hints = ox_hints_html();
@@ -1039,6 +1374,9 @@ sax_html(int argc, VALUE *argv, VALUE self) {
 	if (Qnil != (v = rb_hash_lookup(h, symbolize_sym))) {
 	    options.symbolize = (Qtrue == v);
 	}
+	if (Qnil != (v = rb_hash_lookup(h, reuse_strings_sym))) {
+	    options.reuse_strings = (Qtrue == v);
+	}
 	if (Qnil != (v = rb_hash_lookup(h, skip_sym))) {
 	    if (skip_return_sym == v) {
 		options.skip = CrSkip;
@@ -1048,6 +1386,9 @@ sax_html(int argc, VALUE *argv, VALUE self) {
 		options.skip = NoSkip;
 	    }
 	}
+	if (Qundef != (v = rb_hash_lookup2(h, invalid_utf8_sym, Qundef))) {
+	    options.invalid_utf8 = utf8_mode(v);
+	}
 	if (Qnil != (v = rb_hash_lookup(h, overlay_sym))) {
 	    int	cnt;
 	    
@@ -1140,6 +1481,9 @@ parse_dump_options(VALUE ropts, Options copts) {
 	    *copts->inv_repl = (char)slen;
 	    copts->allow_invalid = No;
 	}
+	if (Qundef != (v = rb_hash_lookup2(ropts, invalid_utf8_sym, Qundef))) {
+	    copts->invalid_utf8 = utf8_mode(v);
+	}
 	
 	for (o = ynos; 0 != o->attr; o++) {
 	    if (Qnil != (v = rb_hash_lookup(ropts, o->sym))) {
@@ -1157,6 +1501,24 @@ parse_dump_options(VALUE ropts, Options copts) {
     }
 }
 
+static VALUE
+xml_str(char *xml, Options copts) {
+    VALUE	rstr = rb_str_new2(xml);
+
+#if HAS_ENCODING_SUPPORT
+    if ('\0' != *copts->encoding) {
+	rb_enc_associate(rstr, rb_enc_find(copts->encoding));
+    }
+#elif HAS_PRIVATE_ENCODING
+    if ('\0' != *copts->encoding) {
+	rb_funcall(rstr, ox_force_encoding_id, 1, rb_str_new2(copts->encoding));
+    }
+#endif
+    xfree(xml);
+
+    return rstr;
+}
+
 /* call-seq: dump(obj, options) => xml-string
  *
  * Dumps an Object (obj) to a string.
@@ -1165,6 +1527,7 @@ parse_dump_options(VALUE ropts, Options copts) {
  *   - *:indent* [Fixnum] format expected
  *   - *:xsd_date* [true|false] use XSD date format if true, default: false
  *   - *:circular* [true|false] allow circular references, default: false
+ *   - *:invalid_utf8* [:replace|:raise|nil] replace invalid UTF-8 in Strings with U+FFFD or raise an EncodingError, default: nil
  *   - *:strict|:tolerant]* [ :effort effort to use when an undumpable object (e.g., IO) is encountered, default: :strict
  *     - _:strict_ - raise an NotImplementedError if an undumpable object is encountered
  *     - _:tolerant_ - replaces undumplable objects with nil
@@ -1176,7 +1539,6 @@ static VALUE
 dump(int argc, VALUE *argv, VALUE self) {
     char		*xml;
     struct _Options	copts = ox_default_options;
-    VALUE		rstr;
     
     if (2 == argc) {
 	parse_dump_options(argv[1], &copts);
@@ -1184,19 +1546,118 @@ dump(int argc, VALUE *argv, VALUE self) {
     if (0 == (xml = ox_write_obj_to_str(*argv, &copts))) {
 	rb_raise(rb_eNoMemError, "Not enough memory.\n");
     }
-    rstr = rb_str_new2(xml);
-#if HAS_ENCODING_SUPPORT
-    if ('\0' != *copts.encoding) {
-	rb_enc_associate(rstr, rb_enc_find(copts.encoding));
+    return xml_str(xml, &copts);
+}
+
+static const char*
+hash_opt_str(VALUE ropts, VALUE sym, const char *dflt) {
+    volatile VALUE	v = rb_hash_lookup(ropts, sym);
+
+    switch (rb_type(v)) {
+    case T_NIL:
+	return dflt;
+    case T_SYMBOL:
+	return rb_id2name(SYM2ID(v));
+    case T_STRING:
+	return StringValuePtr(v);
+    default:
+	rb_raise(ox_parse_error_class, ":%s must be a String or Symbol.\n", rb_id2name(SYM2ID(sym)));
     }
-#elif HAS_PRIVATE_ENCODING
-    if ('\0' != *copts.encoding) {
-	rb_funcall(rstr, ox_force_encoding_id, 1, rb_str_new2(copts.encoding));
+    return dflt;
+}
+
+static void
+parse_hash_dump_options(VALUE ropts, Options copts, const char **root, const char **attr_prefix, const char **text_key) {
+    *root = 0;
+    *attr_prefix = "@";
+    *text_key = "#text";
+    if (Qnil != ropts) {
+	parse_dump_options(ropts, copts);
+	rb_check_type(ropts, T_HASH);
+	*root = hash_opt_str(ropts, root_sym, 0);
+	*attr_prefix = hash_opt_str(ropts, attr_prefix_sym, *attr_prefix);
+	*text_key = hash_opt_str(ropts, text_key_sym, *text_key);
     }
-#endif
-    xfree(xml);
+}
 
-    return rstr;
+/* call-seq: dump_hash(obj, options) => xml-string
+ *
+ * Dumps a Hash directly to XML without building Ox::Element nodes first. Each
+ * key names an element and its value is the content. In a Hash value keys that
+ * start with the attribute prefix become attributes and the text key becomes
+ * the element text. An Array value repeats the element for each member and nil
+ * gives an empty element. Any other value is converted with to_s. Keys must be
+ * valid XML names or an Ox::ArgError is raised. Without a +:root+ each key of
+ * obj is a top level element so the output can have several of them and
+ * attribute keys are not allowed.
+ * - +obj+ [Hash|Array] the content to dump, an Array is only allowed with a +:root+
+ * - +options+ [Hash] formating options
+ *   - *:root* [String|Symbol] name of an element to wrap obj in, default: none
+ *   - *:attr_prefix* [String] prefix of keys that are attributes, default: "@"
+ *   - *:text_key* [String] key of element text, default: "#text"
+ *   - *:indent* [Fixnum] format expected
+ *   - *:encoding* [String] encoding of the returned String
+ */
+static VALUE
+dump_hash(int argc, VALUE *argv, VALUE self) {
+    struct _Options	copts = ox_default_options;
+    const char		*root;
+    const char		*attr_prefix;
+    const char		*text_key;
+    char		*xml;
+
+    rb_check_arity(argc, 1, 2);
+    parse_hash_dump_options((2 == argc) ? argv[1] : Qnil, &copts, &root, &attr_prefix, &text_key);
+    if (0 == (xml = ox_write_hash_to_str(*argv, &copts, root, attr_prefix, text_key))) {
+	rb_raise(rb_eNoMemError, "Not enough memory.\n");
+    }
+    return xml_str(xml, &copts);
+}
+
+/* call-seq: dump_hash_io(io, obj, options)
+ *
+ * Same as dump_hash() but the XML is written to +io+ as it is generated so the
+ * whole document is never held in memory.
+ * - +io+ [IO] destination, anything that responds to write
+ * - +obj+ [Hash|Array] the content to dump
+ * - +options+ [Hash] same as for dump_hash()
+ */
+static VALUE
+dump_hash_io(int argc, VALUE *argv, VALUE self) {
+    struct _Options	copts = ox_default_options;
+    const char		*root;
+    const char		*attr_prefix;
+    const char		*text_key;
+
+    rb_check_arity(argc, 2, 3);
+    parse_hash_dump_options((3 == argc) ? argv[2] : Qnil, &copts, &root, &attr_prefix, &text_key);
+    ox_write_hash_to_io(argv[1], *argv, &copts, root, attr_prefix, text_key);
+
+    return Qnil;
+}
+
+/* Returns the gzip compression level for a :gzip option value or -1 if the
+ * output is not to be compressed. true selects the zlib default of 6.
+ */
+int
+ox_gzip_level(VALUE v) {
+    int	level = -1;
+
+    if (Qnil == v || Qfalse == v) {
+	return level;
+    }
+#if HAS_ZLIB
+    if (Qtrue == v) {
+	return 6;
+    }
+    level = NUM2INT(v);
+    if (level < 0 || 9 < level) {
+	rb_raise(ox_arg_error_class, ":gzip must be true, false, or a level from 0 to 9.\n");
+    }
+#else
+    rb_raise(rb_eNotImpError, "gzip output is not supported, zlib was not found when Ox was built.\n");
+#endif
+    return level;
 }
 
 /* call-seq: to_file(file_path, obj, options)
@@ -1205,9 +1666,11 @@ dump(int argc, VALUE *argv, VALUE self) {
  * - +file_path+ [String] file path to write the XML document to
  * - +obj+ [Object] Object to serialize as an XML document String
  * - +options+ [Hash] formating options
+ *   - *:gzip* [true|false|Fixnum] compress the file with gzip, a Fixnum is the compression level from 0 to 9, default: false
  *   - *:indent* [Fixnum] format expected
  *   - *:xsd_date* [true|false] use XSD date format if true, default: false
  *   - *:circular* [true|false] allow circular references, default: false
+ *   - *:invalid_utf8* [:replace|:raise|nil] replace invalid UTF-8 in Strings with U+FFFD or raise an EncodingError, default: nil
  *   - *:strict|:tolerant]* [ :effort effort to use when an undumpable object (e.g., IO) is encountered, default: :strict
  *     - _:strict_ - raise an NotImplementedError if an undumpable object is encountered
  *     - _:tolerant_ - replaces undumplable objects with nil
@@ -1218,16 +1681,52 @@ dump(int argc, VALUE *argv, VALUE self) {
 static VALUE
 to_file(int argc, VALUE *argv, VALUE self) {
     struct _Options	copts = ox_default_options;
+    int			gz_level = -1;
     
     if (3 == argc) {
 	parse_dump_options(argv[2], &copts);
+	rb_check_type(argv[2], T_HASH);
+	gz_level = ox_gzip_level(rb_hash_lookup(argv[2], ox_gzip_sym));
     }
     Check_Type(*argv, T_STRING);
-    ox_write_obj_to_file(argv[1], StringValuePtr(*argv), &copts);
+    ox_write_obj_to_file(argv[1], StringValuePtr(*argv), &copts, gz_level);
+
+    return Qnil;
+}
+
+/* call-seq: save_snapshot(doc, file_path)
+ *
+ * Saves a generic tree, an Ox::Document or Ox::Element as returned by
+ * Ox.load in :generic mode, to a binary snapshot file that Ox.load_snapshot()
+ * reads back much faster than the XML can be parsed. Element names and
+ * attribute keys are stored once and the rest of the tree is kept as it is so
+ * no escaping or unescaping takes place. Snapshots are versioned and only
+ * meant to be read by Ox.
+ * - +doc+ [Ox::Document|Ox::Element] tree to save
+ * - +file_path+ [String] file path to write the snapshot to
+ */
+static VALUE
+save_snapshot(VALUE self, VALUE doc, VALUE path) {
+    Check_Type(path, T_STRING);
+    ox_snapshot_save(doc, StringValuePtr(path));
 
     return Qnil;
 }
 
+/* call-seq: load_snapshot(file_path) => Ox::Document or Ox::Element
+ *
+ * Loads a tree saved with Ox.save_snapshot(). The file is mapped into memory
+ * and the tree rebuilt from it. Raises an Ox::ParseError if the file is not a
+ * snapshot, is damaged, or was written by an unsupported version.
+ * - +file_path+ [String] file path to read the snapshot from
+ */
+static VALUE
+load_snapshot(VALUE self, VALUE path) {
+    Check_Type(path, T_STRING);
+
+    return ox_snapshot_load(StringValuePtr(path));
+}
+
 #if WITH_CACHE_TESTS
 extern void	ox_cache_test(void);
 
@@ -1247,10 +1746,15 @@ cache8_test(VALUE self) {
 #endif
 
 void Init_ox() {
+#if HAS_RACTOR
+    rb_ext_ractor_safe(true);
+#endif
     Ox = rb_define_module("Ox");
 
     rb_define_module_function(Ox, "default_options", get_def_opts, 0);
     rb_define_module_function(Ox, "default_options=", set_def_opts, 1);
+    rb_define_module_function(Ox, "cache_stats", cache_stats, 0);
+    rb_define_module_function(Ox, "clear_caches", clear_caches, 0);
 
     rb_define_module_function(Ox, "parse_obj", to_obj, 1);
     rb_define_module_function(Ox, "parse", to_gen, 1);
@@ -1260,13 +1764,18 @@ void Init_ox() {
 
     rb_define_module_function(Ox, "to_xml", dump, -1);
     rb_define_module_function(Ox, "dump", dump, -1);
+    rb_define_module_function(Ox, "dump_hash", dump_hash, -1);
+    rb_define_module_function(Ox, "dump_hash_io", dump_hash_io, -1);
 
     rb_define_module_function(Ox, "load_file", load_file, -1);
     rb_define_module_function(Ox, "to_file", to_file, -1);
+    rb_define_module_function(Ox, "save_snapshot", save_snapshot, 2);
+    rb_define_module_function(Ox, "load_snapshot", load_snapshot, 1);
 
     rb_define_module_function(Ox, "sax_html_overlay", sax_html_overlay, 0);
     
     ox_init_builder(Ox);
+    ox_init_template(Ox);
     
     rb_require("time");
     rb_require("date");
@@ -1285,11 +1794,16 @@ void Init_ox() {
     ox_attributes_id = rb_intern("@attributes");
     ox_attrs_done_id = rb_intern("attrs_done");
     ox_beg_id = rb_intern("@beg");
+    ox_call_id = rb_intern("call");
     ox_cdata_id = rb_intern("cdata");
+    ox_cdata_value_id = rb_intern("cdata_value");
+    ox_column_id = rb_intern("column");
     ox_comment_id = rb_intern("comment");
+    ox_comment_value_id = rb_intern("comment_value");
     ox_den_id = rb_intern("@den");
     ox_doctype_id = rb_intern("doctype");
     ox_end_element_id = rb_intern("end_element");
+    ox_end_element_ns_id = rb_intern("end_element_ns");
     ox_end_id = rb_intern("@end");
     ox_end_instruct_id = rb_intern("end_instruct");
     ox_error_id = rb_intern("error");
@@ -1301,6 +1815,7 @@ void Init_ox() {
     ox_instruct_id = rb_intern("instruct");
     ox_jd_id = rb_intern("jd");
     ox_keys_id = rb_intern("keys");
+    ox_line_id = rb_intern("line");
     ox_local_id = rb_intern("local");
     ox_mesg_id = rb_intern("mesg");
     ox_message_id = rb_intern("message");
@@ -1311,7 +1826,9 @@ void Init_ox() {
     ox_pos_id = rb_intern("pos");
     ox_read_id = rb_intern("read");
     ox_readpartial_id = rb_intern("readpartial");
+    ox_sax_drive_id = rb_intern("ox_sax_drive"); // no @ so hidden from Ruby
     ox_start_element_id = rb_intern("start_element");
+    ox_start_element_ns_id = rb_intern("start_element_ns");
     ox_string_id = rb_intern("string");
     ox_text_id = rb_intern("text");
     ox_to_c_id = rb_intern("to_c");
@@ -1338,25 +1855,31 @@ void Init_ox() {
     rb_require("ox/bag");
     rb_require("ox/sax");
 
-    ox_time_class = rb_const_get(rb_cObject, rb_intern("Time"));
-    ox_date_class = rb_const_get(rb_cObject, rb_intern("Date"));
-    ox_parse_error_class = rb_const_get_at(Ox, rb_intern("ParseError"));
-    ox_arg_error_class = rb_const_get_at(Ox, rb_intern("ArgError"));
-    ox_struct_class = rb_const_get(rb_cObject, rb_intern("Struct"));
-    ox_stringio_class = rb_const_get(rb_cObject, rb_intern("StringIO"));
-    ox_bigdecimal_class = rb_const_get(rb_cObject, rb_intern("BigDecimal"));
+    // Classes defined in Ruby can be moved by GC.compact so all held classes
+    // are pinned.
+    ox_time_class = rb_const_get(rb_cObject, rb_intern("Time"));	rb_gc_register_address(&ox_time_class);
+    ox_date_class = rb_const_get(rb_cObject, rb_intern("Date"));	rb_gc_register_address(&ox_date_class);
+    ox_parse_error_class = rb_const_get_at(Ox, rb_intern("ParseError"));	rb_gc_register_address(&ox_parse_error_class);
+    ox_arg_error_class = rb_const_get_at(Ox, rb_intern("ArgError"));	rb_gc_register_address(&ox_arg_error_class);
+    ox_struct_class = rb_const_get(rb_cObject, rb_intern("Struct"));	rb_gc_register_address(&ox_struct_class);
+    ox_stringio_class = rb_const_get(rb_cObject, rb_intern("StringIO"));	rb_gc_register_address(&ox_stringio_class);
+    ox_bigdecimal_class = rb_const_get(rb_cObject, rb_intern("BigDecimal"));	rb_gc_register_address(&ox_bigdecimal_class);
 
     abort_sym = ID2SYM(rb_intern("abort"));			rb_gc_register_address(&abort_sym);
     active_sym = ID2SYM(rb_intern("active"));			rb_gc_register_address(&active_sym);
     auto_define_sym = ID2SYM(rb_intern("auto_define"));		rb_gc_register_address(&auto_define_sym);
+    attr_prefix_sym = ID2SYM(rb_intern("attr_prefix"));		rb_gc_register_address(&attr_prefix_sym);
     auto_sym = ID2SYM(rb_intern("auto"));			rb_gc_register_address(&auto_sym);
+    cache_limit_sym = ID2SYM(rb_intern("cache_limit"));		rb_gc_register_address(&cache_limit_sym);
     block_sym = ID2SYM(rb_intern("block"));			rb_gc_register_address(&block_sym);
     circular_sym = ID2SYM(rb_intern("circular"));		rb_gc_register_address(&circular_sym);
     convert_special_sym = ID2SYM(rb_intern("convert_special")); rb_gc_register_address(&convert_special_sym);
     effort_sym = ID2SYM(rb_intern("effort"));			rb_gc_register_address(&effort_sym);
+    freeze_sym = ID2SYM(rb_intern("freeze"));			rb_gc_register_address(&freeze_sym);
     generic_sym = ID2SYM(rb_intern("generic"));			rb_gc_register_address(&generic_sym);
     inactive_sym = ID2SYM(rb_intern("inactive"));		rb_gc_register_address(&inactive_sym);
     invalid_replace_sym = ID2SYM(rb_intern("invalid_replace"));	rb_gc_register_address(&invalid_replace_sym);
+    invalid_utf8_sym = ID2SYM(rb_intern("invalid_utf8"));	rb_gc_register_address(&invalid_utf8_sym);
     limited_sym = ID2SYM(rb_intern("limited"));			rb_gc_register_address(&limited_sym);
     mode_sym = ID2SYM(rb_intern("mode"));			rb_gc_register_address(&mode_sym);
     object_sym = ID2SYM(rb_intern("object"));			rb_gc_register_address(&object_sym);
@@ -1364,7 +1887,12 @@ void Init_ox() {
     opt_format_sym = ID2SYM(rb_intern("opt_format"));		rb_gc_register_address(&opt_format_sym);
     optimized_sym = ID2SYM(rb_intern("optimized"));		rb_gc_register_address(&optimized_sym);
     overlay_sym = ID2SYM(rb_intern("overlay"));			rb_gc_register_address(&overlay_sym);
+    raise_sym = ID2SYM(rb_intern("raise"));			rb_gc_register_address(&raise_sym);
+    replace_sym = ID2SYM(rb_intern("replace"));			rb_gc_register_address(&replace_sym);
+    reuse_strings_sym = ID2SYM(rb_intern("reuse_strings"));	rb_gc_register_address(&reuse_strings_sym);
+    root_sym = ID2SYM(rb_intern("root"));			rb_gc_register_address(&root_sym);
     ox_encoding_sym = ID2SYM(rb_intern("encoding"));		rb_gc_register_address(&ox_encoding_sym);
+    ox_gzip_sym = ID2SYM(rb_intern("gzip"));			rb_gc_register_address(&ox_gzip_sym);
     ox_indent_sym = ID2SYM(rb_intern("indent"));		rb_gc_register_address(&ox_indent_sym);
     ox_size_sym = ID2SYM(rb_intern("size"));			rb_gc_register_address(&ox_size_sym);
     ox_standalone_sym = ID2SYM(rb_intern("standalone"));	rb_gc_register_address(&ox_standalone_sym);
@@ -1378,6 +1906,7 @@ void Init_ox() {
     strip_namespace_sym = ID2SYM(rb_intern("strip_namespace"));	rb_gc_register_address(&strip_namespace_sym);
     symbolize_keys_sym = ID2SYM(rb_intern("symbolize_keys"));	rb_gc_register_address(&symbolize_keys_sym);
     symbolize_sym = ID2SYM(rb_intern("symbolize"));		rb_gc_register_address(&symbolize_sym);
+    text_key_sym = ID2SYM(rb_intern("text_key"));		rb_gc_register_address(&text_key_sym);
     tolerant_sym = ID2SYM(rb_intern("tolerant"));		rb_gc_register_address(&tolerant_sym);
     trace_sym = ID2SYM(rb_intern("trace"));			rb_gc_register_address(&trace_sym);
     with_dtd_sym = ID2SYM(rb_intern("with_dtd"));		rb_gc_register_address(&with_dtd_sym);
@@ -1387,20 +1916,20 @@ void Init_ox() {
 
     ox_empty_string = rb_str_new2("");				rb_gc_register_address(&ox_empty_string);
     ox_zero_fixnum = INT2NUM(0);				rb_gc_register_address(&ox_zero_fixnum);
-    ox_sym_bank = rb_ary_new();					rb_gc_register_address(&ox_sym_bank);
-
-    ox_document_clas = rb_const_get_at(Ox, rb_intern("Document"));
-    ox_element_clas = rb_const_get_at(Ox, rb_intern("Element"));
-    ox_instruct_clas = rb_const_get_at(Ox, rb_intern("Instruct"));
-    ox_comment_clas = rb_const_get_at(Ox, rb_intern("Comment"));
-    ox_raw_clas = rb_const_get_at(Ox, rb_intern("Raw"));
-    ox_doctype_clas = rb_const_get_at(Ox, rb_intern("DocType"));
-    ox_cdata_clas = rb_const_get_at(Ox, rb_intern("CData"));
-    ox_bag_clas = rb_const_get_at(Ox, rb_intern("Bag"));
 
-    ox_cache_new(&ox_symbol_cache);
-    ox_cache_new(&ox_class_cache);
-    ox_cache_new(&ox_attr_cache);
+    ox_document_clas = rb_const_get_at(Ox, rb_intern("Document"));	rb_gc_register_address(&ox_document_clas);
+    ox_element_clas = rb_const_get_at(Ox, rb_intern("Element"));	rb_gc_register_address(&ox_element_clas);
+    ox_instruct_clas = rb_const_get_at(Ox, rb_intern("Instruct"));	rb_gc_register_address(&ox_instruct_clas);
+    ox_comment_clas = rb_const_get_at(Ox, rb_intern("Comment"));	rb_gc_register_address(&ox_comment_clas);
+    ox_raw_clas = rb_const_get_at(Ox, rb_intern("Raw"));	rb_gc_register_address(&ox_raw_clas);
+    ox_doctype_clas = rb_const_get_at(Ox, rb_intern("DocType"));	rb_gc_register_address(&ox_doctype_clas);
+    ox_cdata_clas = rb_const_get_at(Ox, rb_intern("CData"));	rb_gc_register_address(&ox_cdata_clas);
+    ox_bag_clas = rb_const_get_at(Ox, rb_intern("Bag"));	rb_gc_register_address(&ox_bag_clas);
+
+#if HAS_RACTOR
+    caches_key = rb_ractor_local_storage_value_newkey();
+#endif
+    main_caches = ox_caches();
 
     ox_sax_define();
 
@@ -1431,8 +1960,5 @@ _ox_raise_error(const char *msg, const char *xml, const char *current, const cha
 	    xline++;
 	}
     }
-#if HAS_GC_GUARD
-    rb_gc_enable();
-#endif
     rb_raise(ox_parse_error_class, "%s at line %d, column %d [%s:%d]\n", msg, xline, col, file, line);
 }
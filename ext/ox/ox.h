@@ -99,8 +99,26 @@ typedef enum {
     SpcSkip  = 's',
 } SkipMode;
 
+typedef enum {
+    ReplaceUtf8	= 'r',
+    RaiseUtf8	= 'e',
+    NoUtf8	= 0,
+} Utf8Mode;
+
 typedef struct _PInfo	*PInfo;
 
+/* Lookup caches for names seen while parsing. Each Ractor has its own set so
+ * they are never shared between threads running in parallel.
+ */
+typedef struct _Caches {
+    Cache	symbols;
+    Cache	classes;
+    Cache	attrs;
+    Cache	strs;		/* frozen UTF-8 name Strings for SAX */
+    Cache	plans;		/* object mode LoadPlans by class name */
+    int		active;		/* parses in progress that may hold cache keys */
+} *Caches;
+
 typedef struct _ParseCallbacks {
     void	(*instruct)(PInfo pi, const char *target, Attr attrs, const char *content);
     void	(*add_doctype)(PInfo pi, const char *docType);
@@ -144,6 +162,9 @@ typedef struct _Options {
 #else
     void		*rb_enc;
 #endif
+    size_t		cache_limit;	/* entries in each name cache, 0 for no limit */
+    char		freeze;		/* YesNo freeze loaded objects as they are built */
+    char		invalid_utf8;	/* Utf8Mode */
 } *Options;
 
 /* parse information structure */
@@ -157,6 +178,7 @@ struct _PInfo {
     CircArray		circ_array;
     unsigned long	id;		/* set for text types when cirs_array is set */
     Options		options;
+    Caches		caches;
     char		last;		/* last character read, rarely set */
 };
 
@@ -166,7 +188,13 @@ extern void	_ox_raise_error(const char *msg, const char *xml, const char *curren
 extern void	ox_sax_define(void);
 
 extern char*	ox_write_obj_to_str(VALUE obj, Options copts);
-extern void	ox_write_obj_to_file(VALUE obj, const char *path, Options copts);
+extern void	ox_write_obj_to_file(VALUE obj, const char *path, Options copts, int gz_level);
+extern char*	ox_write_hash_to_str(VALUE obj, Options copts, const char *root, const char *attr_prefix, const char *text_key);
+extern void	ox_write_hash_to_io(VALUE obj, VALUE io, Options copts, const char *root, const char *attr_prefix, const char *text_key);
+extern int	ox_gzip_level(VALUE v);
+
+extern void	ox_snapshot_save(VALUE obj, const char *path);
+extern VALUE	ox_snapshot_load(const char *path);
 
 extern struct _Options	ox_default_options;
 
@@ -184,11 +212,16 @@ extern ID	ox_attr_value_id;
 extern ID	ox_attrs_done_id;
 extern ID	ox_attributes_id;
 extern ID	ox_beg_id;
+extern ID	ox_call_id;
 extern ID	ox_cdata_id;
+extern ID	ox_cdata_value_id;
+extern ID	ox_column_id;
 extern ID	ox_comment_id;
+extern ID	ox_comment_value_id;
 extern ID	ox_den_id;
 extern ID	ox_doctype_id;
 extern ID	ox_end_element_id;
+extern ID	ox_end_element_ns_id;
 extern ID	ox_end_id;
 extern ID	ox_end_instruct_id;
 extern ID	ox_error_id;
@@ -200,6 +233,7 @@ extern ID	ox_inspect_id;
 extern ID	ox_instruct_id;
 extern ID	ox_jd_id;
 extern ID	ox_keys_id;
+extern ID	ox_line_id;
 extern ID	ox_local_id;
 extern ID	ox_mesg_id;
 extern ID	ox_message_id;
@@ -210,7 +244,9 @@ extern ID	ox_parse_id;
 extern ID	ox_pos_id;
 extern ID	ox_read_id;
 extern ID	ox_readpartial_id;
+extern ID	ox_sax_drive_id;
 extern ID	ox_start_element_id;
+extern ID	ox_start_element_ns_id;
 extern ID	ox_string_id;
 extern ID	ox_text_id;
 extern ID	ox_to_c_id;
@@ -229,12 +265,31 @@ extern VALUE		ox_utf8_encoding;
 extern void		*ox_utf8_encoding;
 #endif
 
+/* Text with no encoding or a binary one is taken to be UTF-8 for the
+ * :invalid_utf8 option.
+ */
+#if HAS_ENCODING_SUPPORT
+inline static int
+ox_utf8_expected(rb_encoding *enc) {
+    return (0 == enc || ox_utf8_encoding == enc || rb_ascii8bit_encoding() == enc || rb_usascii_encoding() == enc);
+}
+
+/* The same for an encoding named in a document. */
+inline static int
+ox_utf8_named(const char *name) {
+    return ox_utf8_expected(rb_enc_find(name));
+}
+#else
+#define ox_utf8_expected(enc)	1
+#define ox_utf8_named(name)	1
+#endif
+
 extern VALUE	ox_empty_string;
 extern VALUE	ox_encoding_sym;
+extern VALUE	ox_gzip_sym;
 extern VALUE	ox_indent_sym;
 extern VALUE	ox_size_sym;
 extern VALUE	ox_standalone_sym;
-extern VALUE	ox_sym_bank; // Array
 extern VALUE	ox_version_sym;
 extern VALUE	ox_zero_fixnum;
 
@@ -253,11 +308,26 @@ extern VALUE	ox_raw_clas;
 extern VALUE	ox_doctype_clas;
 extern VALUE	ox_cdata_clas;
 
-extern Cache	ox_symbol_cache;
-extern Cache	ox_class_cache;
-extern Cache	ox_attr_cache;
+extern Caches	ox_caches(void);
+extern void	ox_caches_enter(Caches caches);
+extern void	ox_caches_leave(Caches caches);
+extern void	ox_caches_reclaim_unheld(Caches caches, int (*held)(const char *key, void *ctx), void *ctx);
+
+/* Returns s frozen and deduplicated when the :freeze load option is set. */
+inline static VALUE
+ox_freeze_str(Options options, VALUE s) {
+    if (Yes == options->freeze) {
+#if HAS_INTERNED_STR
+	return rb_str_to_interned_str(s);
+#else
+	return rb_obj_freeze(s);
+#endif
+    }
+    return s;
+}
 
 extern void	ox_init_builder(VALUE ox);
+extern void	ox_init_template(VALUE ox);
 
 #if defined(__cplusplus)
 #if 0
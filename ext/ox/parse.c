@@ -14,6 +14,8 @@
 #include "attr.h"
 #include "helper.h"
 #include "special.h"
+#include "probes.h"
+#include "utf8.h"
 
 static void	read_instruction(PInfo pi);
 static void	read_doctype(PInfo pi);
@@ -93,93 +95,212 @@ next_white(PInfo pi) {
     }
 }
 
-VALUE
-ox_parse(char *xml, ParseCallbacks pcb, char **endp, Options options, Err err) {
-    struct _PInfo	pi;
-    int			body_read = 0;
-    int			block_given = rb_block_given_p();
+inline static void
+element_start(PInfo pi, const char *ename, Attr attrs, int hasChildren) {
+    OX_PROBE1(element__start, ename);
+    pi->pcb->add_element(pi, ename, attrs, hasChildren);
+}
 
-    if (0 == xml) {
-	set_error(err, "Invalid arg, xml string can not be null", xml, 0);
-	return Qnil;
+inline static void
+element_end(PInfo pi, const char *ename) {
+    OX_PROBE1(element__end, ename);
+    pi->pcb->end_element(pi, ename);
+}
+
+typedef struct _ParseArgs {
+    PInfo	pi;
+    char	**endp;
+    Err		err;
+} *ParseArgs;
+
+/* Objects in the helper stack and circular array may only be referenced from
+ * the heap while the document is being built so they are marked through a
+ * wrapper that lives for the duration of the parse.
+ */
+static void
+mark_pi_cb(void *ptr) {
+    PInfo	pi = (PInfo)ptr;
+    Helper	h;
+
+    if (0 == pi) {
+	return;
     }
-    if (DEBUG <= options->trace) {
-	printf("Parsing xml:\n%s\n", xml);
+    rb_gc_mark(pi->obj);
+    for (h = pi->helpers.head; h < pi->helpers.tail; h++) {
+	rb_gc_mark(h->obj);
     }
-    /* initialize parse info */
-    helper_stack_init(&pi.helpers);
-    err_init(&pi.err);
-    pi.str = xml;
-    pi.s = xml;
-    pi.pcb = pcb;
-    pi.obj = Qnil;
-    pi.circ_array = 0;
-    pi.options = options;
+    if (0 != pi->circ_array) {
+	unsigned long	i;
+
+	for (i = 0; i < pi->circ_array->cnt; i++) {
+	    rb_gc_mark(pi->circ_array->objs[i]);
+	}
+    }
+}
+
+/* pi lives on the stack of ox_parse() so there is no free function. */
+static const rb_data_type_t	pi_type = {
+    "Ox/parse_info",
+    {
+	mark_pi_cb,
+	0,
+	0,
+    },
+    0,
+    0,
+    0,
+};
+
+static VALUE
+parse_body(VALUE a) {
+    ParseArgs	args = (ParseArgs)a;
+    PInfo	pi = args->pi;
+    Err		err = args->err;
+    int		body_read = 0;
+    int		block_given = rb_block_given_p();
+
     while (1) {
-	next_non_white(&pi);	/* skip white space */
-	if ('\0' == *pi.s) {
+	next_non_white(pi);	/* skip white space */
+	if ('\0' == *pi->s) {
 	    break;
 	}
-	if (body_read && 0 != endp) {
-	    *endp = pi.s;
+	if (body_read && 0 != args->endp) {
+	    *args->endp = pi->s;
 	    break;
 	}
-	if ('<' != *pi.s) {		/* all top level entities start with < */
-	    set_error(err, "invalid format, expected <", pi.str, pi.s);
-	    helper_stack_cleanup(&pi.helpers);
+	if ('<' != *pi->s) {		/* all top level entities start with < */
+	    set_error(err, "invalid format, expected <", pi->str, pi->s);
 	    return Qnil;
 	}
-	pi.s++;		/* past < */
-	switch (*pi.s) {
+	pi->s++;		/* past < */
+	switch (*pi->s) {
 	case '?':	/* processing instruction */
-	    pi.s++;
-	    read_instruction(&pi);
+	    pi->s++;
+	    read_instruction(pi);
 	    break;
 	case '!':	/* comment or doctype */
-	    pi.s++;
-	    if ('\0' == *pi.s) {
-		set_error(err, "invalid format, DOCTYPE or comment not terminated", pi.str, pi.s);
-		helper_stack_cleanup(&pi.helpers);
+	    pi->s++;
+	    if ('\0' == *pi->s) {
+		set_error(err, "invalid format, DOCTYPE or comment not terminated", pi->str, pi->s);
 		return Qnil;
-	    } else if ('-' == *pi.s) {
-		pi.s++;	/* skip - */
-		if ('-' != *pi.s) {
-		    set_error(err, "invalid format, bad comment format", pi.str, pi.s);
-		    helper_stack_cleanup(&pi.helpers);
+	    } else if ('-' == *pi->s) {
+		pi->s++;	/* skip - */
+		if ('-' != *pi->s) {
+		    set_error(err, "invalid format, bad comment format", pi->str, pi->s);
 		    return Qnil;
 		} else {
-		    pi.s++;	/* skip second - */
-		    read_comment(&pi);
+		    pi->s++;	/* skip second - */
+		    read_comment(pi);
 		}
-	    } else if ((TolerantEffort == options->effort) ? 0 == strncasecmp("DOCTYPE", pi.s, 7) : 0 == strncmp("DOCTYPE", pi.s, 7)) {
-		pi.s += 7;
-		read_doctype(&pi);
+	    } else if ((TolerantEffort == pi->options->effort) ? 0 == strncasecmp("DOCTYPE", pi->s, 7) : 0 == strncmp("DOCTYPE", pi->s, 7)) {
+		pi->s += 7;
+		read_doctype(pi);
 	    } else {
-		set_error(err, "invalid format, DOCTYPE or comment expected", pi.str, pi.s);
-		helper_stack_cleanup(&pi.helpers);
+		set_error(err, "invalid format, DOCTYPE or comment expected", pi->str, pi->s);
 		return Qnil;
 	    }
 	    break;
 	case '\0':
-	    set_error(err, "invalid format, document not terminated", pi.str, pi.s);
-	    helper_stack_cleanup(&pi.helpers);
+	    set_error(err, "invalid format, document not terminated", pi->str, pi->s);
 	    return Qnil;
 	default:
-	    read_element(&pi);
+	    read_element(pi);
 	    body_read = 1;
 	    break;
 	}
-	if (err_has(&pi.err)) {
-	    *err = pi.err;
-	    helper_stack_cleanup(&pi.helpers);
+	if (err_has(&pi->err)) {
+	    *err = pi->err;
 	    return Qnil;
 	}
-	if (block_given && Qnil != pi.obj && Qundef != pi.obj) {
-	    rb_yield(pi.obj);
+	if (block_given && Qnil != pi->obj && Qundef != pi->obj) {
+	    rb_yield(pi->obj);
 	}
     }
-    helper_stack_cleanup(&pi.helpers);
-    return pi.obj;
+    if (Yes == pi->options->freeze && ox_document_clas == rb_obj_class(pi->obj)) {
+	// Elements were frozen as they closed but nodes may follow the root
+	// element so the document is left until the end.
+	rb_obj_freeze(rb_attr_get(pi->obj, ox_attributes_id));
+	rb_obj_freeze(rb_attr_get(pi->obj, ox_nodes_id));
+	rb_obj_freeze(pi->obj);
+    }
+    return pi->obj;
+}
+
+static VALUE
+parse_cleanup(VALUE wrap) {
+    PInfo	pi = (PInfo)DATA_PTR(wrap);
+
+    DATA_PTR(wrap) = 0;
+    helper_stack_cleanup(&pi->helpers);
+    ox_caches_leave(pi->caches);
+    OX_PROBE2(parse__end, pi->options->mode, (long)(pi->s - pi->str));
+
+    return Qnil;
+}
+
+VALUE
+ox_parse(char *xml, ParseCallbacks pcb, char **endp, Options options, Err err) {
+    struct _PInfo	pi;
+    struct _ParseArgs	args;
+    volatile VALUE	wrap;
+    volatile VALUE	scrubbed = Qnil;
+    VALUE		obj;
+
+    if (0 == xml) {
+	set_error(err, "Invalid arg, xml string can not be null", xml, 0);
+	return Qnil;
+    }
+    // The whole document is checked up front so the tokenizers never see
+    // invalid UTF-8. A nested parse has already been checked. An encoding
+    // in the XML declaration takes the place of the option as it does when
+    // the declaration is parsed.
+    if (NoUtf8 != options->invalid_utf8 && 0 == endp) {
+	size_t	len = strlen(xml);
+	size_t	valid = len;
+	char	name[64];
+
+	if (0 != ox_declared_encoding(xml, len, name, sizeof(name)) ? ox_utf8_named(name) : ox_utf8_expected(options->rb_enc)) {
+	    valid = ox_utf8_valid_len(xml, len);
+	}
+	if (valid < len) {
+	    size_t	used;
+	    size_t	cnt;
+
+	    if (RaiseUtf8 == options->invalid_utf8) {
+		set_error(err, "invalid UTF-8 byte sequence", xml, xml + valid);
+		return Qnil;
+	    }
+	    scrubbed = rb_str_buf_new(valid + (len - valid) * UTF8_REPL_LEN);
+	    memcpy(RSTRING_PTR(scrubbed), xml, valid);
+	    cnt = ox_utf8_scrub(xml + valid, len - valid, RSTRING_PTR(scrubbed) + valid, 1, &used);
+	    rb_str_set_len(scrubbed, valid + cnt);
+	    xml = RSTRING_PTR(scrubbed);
+	}
+    }
+    if (DEBUG <= options->trace) {
+	printf("Parsing xml:\n%s\n", xml);
+    }
+    /* initialize parse info */
+    helper_stack_init(&pi.helpers);
+    err_init(&pi.err);
+    pi.str = xml;
+    pi.s = xml;
+    pi.pcb = pcb;
+    pi.obj = Qnil;
+    pi.circ_array = 0;
+    pi.options = options;
+    pi.caches = ox_caches();
+    ox_caches_enter(pi.caches);
+    OX_PROBE1(parse__start, options->mode);
+    args.pi = &pi;
+    args.endp = endp;
+    args.err = err;
+    wrap = TypedData_Wrap_Struct(0, &pi_type, &pi);
+    obj = rb_ensure(parse_body, (VALUE)&args, parse_cleanup, wrap);
+#if HAS_GC_GUARD
+    RB_GC_GUARD(scrubbed);
+#endif
+    return obj;
 }
 
 static char*
@@ -422,8 +543,8 @@ read_element(PInfo pi) {
 	    return 0;
 	}
 	pi->s++;	/* past > */
-	pi->pcb->add_element(pi, ename, attrs.head, hasChildren);
-	pi->pcb->end_element(pi, ename);
+	element_start(pi, ename, attrs.head, hasChildren);
+	element_end(pi, ename);
 
 	attr_stack_cleanup(&attrs);
 	return 0;
@@ -449,8 +570,8 @@ read_element(PInfo pi) {
 		return 0;
 	    }
 	    pi->s++;
-	    pi->pcb->add_element(pi, ename, attrs.head, hasChildren);
-	    pi->pcb->end_element(pi, ename);
+	    element_start(pi, ename, attrs.head, hasChildren);
+	    element_end(pi, ename);
 
 	    attr_stack_cleanup(&attrs);
 	    return 0;
@@ -459,7 +580,7 @@ read_element(PInfo pi) {
 	    pi->s++;
 	    hasChildren = 1;
 	    done = 1;
-	    pi->pcb->add_element(pi, ename, attrs.head, hasChildren);
+	    element_start(pi, ename, attrs.head, hasChildren);
 	    break;
 	default:
 	    /* Attribute name so it's an element and the attribute will be */
@@ -559,7 +680,7 @@ read_element(PInfo pi) {
 		    if (0 != strcmp(name, ename)) {
 			attr_stack_cleanup(&attrs);
 			if (TolerantEffort == pi->options->effort) {
-			    pi->pcb->end_element(pi, ename);
+			    element_end(pi, ename);
 			    return name;
 			} else {
 			    set_error(&pi->err, "invalid format, elements overlap", pi->str, pi->s);
@@ -600,7 +721,7 @@ read_element(PInfo pi) {
 			}
 		    }
 		    pi->s++;
-		    pi->pcb->end_element(pi, ename);
+		    element_end(pi, ename);
 		    attr_stack_cleanup(&attrs);
 		    return 0;
 		case '\0':
@@ -619,10 +740,10 @@ read_element(PInfo pi) {
 			attr_stack_cleanup(&attrs);
 			if (0 == strcmp(name, ename)) {
 			    pi->s++;
-			    pi->pcb->end_element(pi, ename);
+			    element_end(pi, ename);
 			    return 0;
 			} else { // not the correct element yet
-			    pi->pcb->end_element(pi, ename);
+			    element_end(pi, ename);
 			    return name;
 			}
 		    } else if (err_has(&pi->err)) {
@@ -642,7 +763,7 @@ read_element(PInfo pi) {
 		    '>' == *(pi->s + elen + 2)) {
 		    /* close tag after text so treat as a value */
 		    pi->s += elen + 3;
-		    pi->pcb->end_element(pi, ename);
+		    element_end(pi, ename);
 		    attr_stack_cleanup(&attrs);
 		    return 0;
 		}
@@ -0,0 +1,41 @@
+/* probes.h
+ * Copyright (c) 2011, Peter Ohler
+ * All rights reserved.
+ */
+
+#ifndef __OX_PROBES_H__
+#define __OX_PROBES_H__
+
+/* Static USDT probes under the "ox" provider for tracing with bpftrace,
+ * perf, or SystemTap. extconf.rb sets HAS_SDT when sys/sdt.h is found unless
+ * configured with --disable-probes. A probe that is not attached is a single
+ * nop so arguments are kept to values already at hand.
+ *
+ *   parse-start(mode)			Ox.load and friends begin
+ *   parse-end(mode, bytes)		parse finished, bytes consumed
+ *   element-start(name)		element opened by Ox.load
+ *   element-end(name)			element closed by Ox.load
+ *   sax-start()			Ox.sax_parse begins
+ *   sax-end(line)			Ox.sax_parse finished
+ *   sax-callback(method)		a handler method is about to be called
+ *   sax-buf-read(bytes, err)		the SAX buffer was refilled
+ *   dump-start(mode)			an object dump begins
+ *   dump-end(bytes)			an object dump finished
+ *   cache-miss(key)			a name cache lookup missed
+ *
+ * Names and keys are NUL terminated C strings, the rest are integers. The
+ * mode is the mode character of the options, 'o', 'g', 'l', or 0.
+ */
+#if HAS_SDT
+#include <sys/sdt.h>
+
+#define OX_PROBE(name)				DTRACE_PROBE(ox, name)
+#define OX_PROBE1(name, a)			DTRACE_PROBE1(ox, name, a)
+#define OX_PROBE2(name, a, b)			DTRACE_PROBE2(ox, name, a, b)
+#else
+#define OX_PROBE(name)
+#define OX_PROBE1(name, a)
+#define OX_PROBE2(name, a, b)
+#endif
+
+#endif /* __OX_PROBES_H__ */
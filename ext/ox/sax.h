@@ -18,7 +18,9 @@ typedef struct _SaxOptions {
     int			symbolize;
     int			convert_special;
     int			smart;
+    int			reuse_strings;
     SkipMode		skip;
+    Utf8Mode		invalid_utf8;
     char		strip_ns[64];
     Hints		hints;
 } *SaxOptions;
@@ -28,11 +30,20 @@ typedef struct _SaxDrive {
     struct _NStack	stack;	/* element name stack */
     VALUE		handler;
     VALUE		value_obj;
+    VALUE		reuse_str;	/* refilled for each event if options.reuse_strings */
+    VALUE		ns_uris;	/* URIs of the declarations on the stack */
+    Caches		caches;
     struct _SaxOptions	options;
     int			err;
     int			blocked;
     bool		abort;
+    bool		raw_value;	/* value_obj is cdata or a comment */
     struct _Has		has;
+    int			pos;	/* position of the current event */
+    int			line;
+    int			col;
+    int			events;	/* since the name caches were last reclaimed */
+    void		(*parse)(struct _SaxDrive *dr);
 #if HAS_ENCODING_SUPPORT
     rb_encoding *encoding;
 #elif HAS_PRIVATE_ENCODING
@@ -46,6 +57,7 @@ extern void	ox_collapse_return(char *str);
 extern void	ox_sax_parse(VALUE handler, VALUE io, SaxOptions options);
 extern void	ox_sax_drive_cleanup(SaxDrive dr);
 extern void	ox_sax_drive_error(SaxDrive dr, const char *msg);
+extern void	ox_sax_drive_error_at(SaxDrive dr, const char *msg, int pos, int line, int col);
 extern int	ox_sax_collapse_special(SaxDrive dr, char *str, int pos, int line, int col);
 
 extern VALUE	ox_sax_value_class;
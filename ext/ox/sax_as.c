@@ -17,6 +17,7 @@
 #include "ruby.h"
 #include "ox.h"
 #include "sax.h"
+#include "dbl.h"
 
 static VALUE
 parse_double_time(const char *text) {
@@ -122,18 +123,20 @@ sax_value_as_s(VALUE self) {
     if ('\0' == *dr->buf.str) {
 	return Qnil;
     }
-    if (dr->options.convert_special) {
-	ox_sax_collapse_special(dr, dr->buf.str, dr->buf.pos, dr->buf.line, dr->buf.col);
-    }
-    switch (dr->options.skip) {
-    case CrSkip:
-	buf_collapse_return(dr->buf.str);
-	break;
-    case SpcSkip:
-	buf_collapse_white(dr->buf.str);
-	break;
-    default:
-	break;
+    if (!dr->raw_value) {
+	if (dr->options.convert_special) {
+	    ox_sax_collapse_special(dr, dr->buf.str, dr->buf.pos, dr->buf.line, dr->buf.col);
+	}
+	switch (dr->options.skip) {
+	case CrSkip:
+	    buf_collapse_return(dr->buf.str);
+	    break;
+	case SpcSkip:
+	    buf_collapse_white(dr->buf.str);
+	    break;
+	default:
+	    break;
+	}
     }
     rs = rb_str_new2(dr->buf.str);
 #if HAS_ENCODING_SUPPORT
@@ -173,7 +176,7 @@ sax_value_as_f(VALUE self) {
     if ('\0' == *dr->buf.str) {
 	return Qnil;
     }
-    return rb_float_new(strtod(dr->buf.str, 0));
+    return rb_float_new(ox_dbl_parse(dr->buf.str, 0));
 }
 
 /* call-seq: as_i()
@@ -251,6 +254,58 @@ sax_value_empty(VALUE self) {
     return ('\0' == *((SaxDrive)DATA_PTR(self))->buf.str) ? Qtrue : Qfalse;
 }
 
+static SaxDrive
+handler_drive(VALUE self) {
+    VALUE	drive = rb_attr_get(self, ox_sax_drive_id);
+
+    if (Qnil == drive) {
+	return NULL;
+    }
+    return (SaxDrive)DATA_PTR(drive);
+}
+
+/* call-seq: pos()
+ *
+ * Only available while parsing and only if made public in the handler.
+ *
+ * *return* the number of bytes from the start of the document to the start of
+ * the current event or nil if not parsing.
+ */
+static VALUE
+sax_pos(VALUE self) {
+    SaxDrive	dr = handler_drive(self);
+
+    return (NULL == dr) ? Qnil : LONG2NUM(dr->pos);
+}
+
+/* call-seq: line()
+ *
+ * Only available while parsing and only if made public in the handler.
+ *
+ * *return* the line number of the start of the current event or nil if not
+ * parsing.
+ */
+static VALUE
+sax_line(VALUE self) {
+    SaxDrive	dr = handler_drive(self);
+
+    return (NULL == dr) ? Qnil : LONG2NUM(dr->line);
+}
+
+/* call-seq: column()
+ *
+ * Only available while parsing and only if made public in the handler.
+ *
+ * *return* the column of the start of the current event or nil if not
+ * parsing.
+ */
+static VALUE
+sax_column(VALUE self) {
+    SaxDrive	dr = handler_drive(self);
+
+    return (NULL == dr) ? Qnil : LONG2NUM(dr->col);
+}
+
 /* Document-class: Ox::Sax::Value
  *
  * Values in the SAX callbacks. They can be converted to various different
@@ -273,4 +328,8 @@ ox_sax_define() {
     rb_define_method(ox_sax_value_class, "as_time", sax_value_as_time, 0);
     rb_define_method(ox_sax_value_class, "as_bool", sax_value_as_bool, 0);
     rb_define_method(ox_sax_value_class, "empty?", sax_value_empty, 0);
+
+    rb_define_private_method(sax_module, "pos", sax_pos, 0);
+    rb_define_private_method(sax_module, "line", sax_line, 0);
+    rb_define_private_method(sax_module, "column", sax_column, 0);
 }
@@ -8,15 +8,24 @@
 #include <stdio.h>
 #include <strings.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #if NEEDS_UIO
 #include <sys/uio.h>    
 #endif
 #include <unistd.h>
 #include <time.h>
+#if HAS_ZLIB
+#include <zlib.h>
+#endif
 
 #include "ruby.h"
+#if HAS_FIBER_SCHEDULER
+#include "ruby/fiber/scheduler.h"
+#endif
 #include "ox.h"
 #include "sax.h"
+#include "probes.h"
+#include "utf8.h"
 
 #define BUF_PAD	4
 
@@ -25,25 +34,64 @@ static VALUE		io_cb(VALUE rdr);
 static VALUE		partial_io_cb(VALUE rdr);
 static int		read_from_io(Buf buf);
 static int		read_from_fd(Buf buf);
+static int		read_from_fd_wait(Buf buf);
 static int		read_from_io_partial(Buf buf);
 static int		read_from_str(Buf buf);
+static int		read_utf8(Buf buf);
+static int		read_transcode(Buf buf);
+#if HAS_ZLIB
+static int		read_from_gz(Buf buf);
+static int		is_gzip_fd(int fd);
+#endif
 
 void
 ox_sax_buf_init(Buf buf, VALUE io) {
     volatile VALUE	io_class = rb_obj_class(io);
     VALUE		rfd;
 
+    buf->gz = 0;
     if (rb_cString == io_class) {
 	buf->read_func = read_from_str;
 	buf->in.str = StringValuePtr(io);
+	buf->in_len = RSTRING_LEN(io);
     } else if (ox_stringio_class == io_class && 0 == FIX2INT(rb_funcall2(io, ox_pos_id, 0, 0))) {
 	volatile VALUE	s = rb_funcall2(io, ox_string_id, 0, 0);
 
 	buf->read_func = read_from_str;
 	buf->in.str = StringValuePtr(s);
+	buf->in_len = RSTRING_LEN(s);
     } else if (rb_cFile == io_class && Qnil != (rfd = rb_funcall(io, ox_fileno_id, 0))) {
+	struct stat	st;
+
 	buf->read_func = read_from_fd;
 	buf->in.fd = FIX2INT(rfd);
+	// A FIFO or device may have to wait for data. That must not hold up
+	// other threads or, with a fiber scheduler, other fibers.
+	if (0 == fstat(buf->in.fd, &st) && !S_ISREG(st.st_mode)) {
+#if HAS_FIBER_SCHEDULER
+	    if (Qnil != rb_fiber_scheduler_current()) {
+		buf->read_func = read_from_io_partial;
+		buf->in.io = io;
+	    } else {
+		buf->read_func = read_from_fd_wait;
+	    }
+#else
+	    buf->read_func = read_from_fd_wait;
+#endif
+	}
+#if HAS_ZLIB
+	if (is_gzip_fd(buf->in.fd)) {
+	    int	fd = dup(buf->in.fd);
+
+	    if (0 > fd || 0 == (buf->gz = gzdopen(fd, "rb"))) {
+		if (0 <= fd) {
+		    close(fd);
+		}
+		rb_raise(rb_eIOError, "failed to open compressed input.\n");
+	    }
+	    buf->read_func = read_from_gz;
+	}
+#endif
     } else if (rb_respond_to(io, ox_readpartial_id)) {
 	buf->read_func = read_from_io_partial;
 	buf->in.io = io;
@@ -66,14 +114,64 @@ ox_sax_buf_init(Buf buf, VALUE io) {
     buf->pro_pos = 1;
     buf->pro_line = 1;
     buf->pro_col = 0;
+    buf->carry_len = 0;
+    buf->transcode = UnknownTranscode;
     buf->dr = 0;
 }
 
+/* Moves the buffer to a new allocation of size bytes. */
+static void
+buf_realloc(Buf buf, size_t size) {
+    char	*old = buf->head;
+
+    if (buf->head == buf->base) {
+	buf->head = ALLOC_N(char, size);
+	memcpy(buf->head, old, buf->end - old + BUF_PAD);
+    } else {
+	REALLOC_N(buf->head, char, size);
+    }
+    buf->end = buf->head + size - BUF_PAD;
+    buf->tail = buf->head + (buf->tail - old);
+    buf->read_end = buf->head + (buf->read_end - old);
+    if (0 != buf->pro) {
+	buf->pro = buf->head + (buf->pro - old);
+    }
+    if (0 != buf->str) {
+	buf->str = buf->head + (buf->str - old);
+    }
+}
+
 int
 ox_sax_buf_read(Buf buf) {
     int         err;
     size_t      shift = 0;
+#if HAS_SDT
+    long	filled;
+#endif
     
+    // A buffer grown for a long token goes back to the fixed base buffer once
+    // what still has to be kept fits comfortably.
+    if (buf->base != buf->head) {
+	char	*keep = (0 == buf->pro) ? buf->tail : buf->pro - 1;
+
+	if (buf->head <= keep && buf->read_end - keep < (long)sizeof(buf->base) / 2) {
+	    char	*old = buf->head;
+	    long	off = keep - buf->head;
+
+	    memcpy(buf->base, keep, buf->read_end - keep + 1);
+	    buf->head = buf->base;
+	    buf->end = buf->head + sizeof(buf->base) - BUF_PAD;
+	    buf->tail = buf->head + (buf->tail - old - off);
+	    buf->read_end = buf->head + (buf->read_end - old - off);
+	    if (0 != buf->pro) {
+		buf->pro = buf->head + (buf->pro - old - off);
+	    }
+	    if (0 != buf->str) {
+		buf->str = buf->head + (buf->str - old - off);
+	    }
+	    xfree(old);
+	}
+    }
     // if there is not much room to read into, shift or realloc a larger buffer.
     if (buf->head < buf->tail && 4096 > buf->end - buf->tail) {
         if (0 == buf->pro) {
@@ -82,24 +180,7 @@ ox_sax_buf_read(Buf buf) {
             shift = buf->pro - buf->head - 1; // leave one character so we cab backup one
         }
         if (0 >= shift) { /* no space left so allocate more */
-            char        *old = buf->head;
-            size_t      size = buf->end - buf->head + BUF_PAD;
-        
-            if (buf->head == buf->base) {
-                buf->head = ALLOC_N(char, size * 2);
-                memcpy(buf->head, old, size);
-            } else {
-		REALLOC_N(buf->head, char, size * 2);
-            }
-            buf->end = buf->head + size * 2 - BUF_PAD;
-            buf->tail = buf->head + (buf->tail - old);
-            buf->read_end = buf->head + (buf->read_end - old);
-            if (0 != buf->pro) {
-                buf->pro = buf->head + (buf->pro - old);
-            }
-            if (0 != buf->str) {
-                buf->str = buf->head + (buf->str - old);
-            }
+	    buf_realloc(buf, (buf->end - buf->head + BUF_PAD) * 2);
         } else {
             memmove(buf->head, buf->head + shift, buf->read_end - (buf->head + shift));
             buf->tail -= shift;
@@ -112,12 +193,267 @@ ox_sax_buf_read(Buf buf) {
             }
         }
     }
-    err = buf->read_func(buf);
+#if HAS_SDT
+    filled = buf->read_end - buf->head;
+#endif
+    if (NoTranscode != buf->transcode) {
+	err = read_transcode(buf);
+    } else if (NoUtf8 != buf->dr->options.invalid_utf8 && ox_utf8_expected(buf->dr->encoding)) {
+	err = read_utf8(buf);
+    } else {
+	err = buf->read_func(buf);
+    }
+    OX_PROBE2(sax__buf__read, (long)(buf->read_end - buf->head) - filled, err);
     *buf->read_end = '\0';
 
     return err;
 }
 
+/* Raises for invalid UTF-8 at s in the block just read or, if the handler
+ * has an error() method, reports it there and lets it be replaced. The
+ * position is figured as if everything up to s had been read.
+ */
+static void
+utf8_error(Buf buf, const char *s) {
+    const char	*t = buf->tail;
+    const char	*nl;
+    int		line = buf->line;
+    int		col = buf->col;
+
+    while (0 != (nl = (const char*)memchr(t, '\n', s - t))) {
+	line++;
+	col = 0;
+	t = nl + 1;
+    }
+    col += (int)(s - t) + 1;
+    if (!buf->dr->has.error) {
+	rb_raise(ox_parse_error_class, "invalid UTF-8 byte sequence at line %d, column %d\n", line, col);
+    }
+    ox_sax_drive_error_at(buf->dr, "Invalid Format: invalid UTF-8 byte sequence", buf->pos + (int)(s - buf->tail) + 1, line, col);
+}
+
+/* Replaces invalid UTF-8 in the block just read. Unless at the end of the
+ * input a sequence cut off by the end of the block is held back in carry to
+ * be put in front of the next block.
+ */
+static void
+scrub_utf8(Buf buf, int eof) {
+    char	*s = buf->tail;
+    size_t	len = buf->read_end - s;
+    size_t	valid = ox_utf8_valid_len(s, len);
+    char	*bad = s + valid;
+    size_t	rest = len - valid;
+    size_t	used;
+    char	*tmp;
+
+    if (0 == rest) {
+	return;
+    }
+    if (!eof && 0 == ox_utf8_seq(bad, buf->read_end)) {
+	memcpy(buf->carry, bad, rest);
+	buf->carry_len = (int)rest;
+	buf->read_end = bad;
+	return;
+    }
+    if (RaiseUtf8 == buf->dr->options.invalid_utf8) {
+	utf8_error(buf, bad);
+    }
+    if ((size_t)(buf->end - bad) < rest * UTF8_REPL_LEN) {
+	long	off = bad - buf->head;
+
+	buf_realloc(buf, buf->end - buf->head + BUF_PAD + rest * UTF8_REPL_LEN);
+	bad = buf->head + off;
+    }
+    tmp = ALLOC_N(char, rest);
+    memcpy(tmp, bad, rest);
+    buf->read_end = bad + ox_utf8_scrub(tmp, rest, bad, eof, &used);
+    buf->carry_len = (int)(rest - used);
+    memcpy(buf->carry, tmp + used, buf->carry_len);
+    xfree(tmp);
+}
+
+/* Reads with the :invalid_utf8 option set. Bytes held back from the last
+ * read go in first. If a read ends up with nothing to hand over but more may
+ * come, it reads again since an empty block looks like the end.
+ */
+static int
+read_utf8(Buf buf) {
+    int		err;
+    int		carried;
+
+    do {
+	carried = buf->carry_len;
+	memcpy(buf->tail, buf->carry, carried);
+	buf->carry_len = 0;
+	buf->tail += carried;
+	buf->read_end = buf->tail;
+	err = buf->read_func(buf);
+	buf->tail -= carried;
+	if (0 != err || buf->read_end == buf->tail + carried) {
+	    if (0 == carried) {
+		return err;
+	    }
+	    // At the end, what was held back is all that is left.
+	    buf->read_end = buf->tail + carried;
+	    scrub_utf8(buf, 1);
+	    return 0;
+	}
+	scrub_utf8(buf, 0);
+    } while (buf->read_end <= buf->tail);
+
+    return err;
+}
+
+static struct _Transcoding {
+    const char	*name;
+    Transcode	transcode;
+} transcodings[] = {
+    { "ISO-8859-1", Latin1Transcode },
+    { "ISO8859-1", Latin1Transcode },
+    { "ISO_8859-1", Latin1Transcode },
+    { "Latin1", Latin1Transcode },
+    { "Windows-1252", Win1252Transcode },
+    { "CP1252", Win1252Transcode },
+    { 0, NoTranscode },
+};
+
+/* Returns true if s is too short to tell the encoding from or is the start
+ * of an XML declaration that has not been read all the way yet.
+ */
+static int
+need_more(const char *s, size_t len) {
+    const char	*end = s + len;
+
+    if (len < 4) {
+	return 1;
+    }
+    if (0 == memcmp(s, "\xEF\xBB\xBF", 3)) {
+	s += 3;
+	len -= 3;
+    }
+    if (0 != strncmp(s, "<?xml", (len < 5) ? len : 5)) {
+	return 0;
+    }
+    for (; s + 1 < end; s++) {
+	if ('?' == *s && '>' == s[1]) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* Picks the conversion from a UTF-16 BOM, from the first characters of an
+ * XML declaration in UTF-16 without a BOM, or from the encoding in the XML
+ * declaration. A UTF-16 BOM becomes a UTF-8 BOM.
+ */
+static void
+detect_transcode(Buf buf, const char *s, size_t len) {
+    const uint8_t	*u = (const uint8_t*)s;
+    char		name[64];
+    struct _Transcoding	*t;
+
+    buf->transcode = NoTranscode;
+    if (2 <= len && 0xFF == u[0] && 0xFE == u[1]) {
+	buf->transcode = Utf16LETranscode;
+    } else if (2 <= len && 0xFE == u[0] && 0xFF == u[1]) {
+	buf->transcode = Utf16BETranscode;
+    } else if (4 <= len && '<' == u[0] && 0 == u[1] && '?' == u[2] && 0 == u[3]) {
+	buf->transcode = Utf16LETranscode;
+    } else if (4 <= len && 0 == u[0] && '<' == u[1] && 0 == u[2] && '?' == u[3]) {
+	buf->transcode = Utf16BETranscode;
+    } else if (0 != ox_declared_encoding(s, len, name, sizeof(name))) {
+	for (t = transcodings; 0 != t->name; t++) {
+	    if (0 == strcasecmp(t->name, name)) {
+		buf->transcode = t->transcode;
+		break;
+	    }
+	}
+#if HAS_ENCODING_SUPPORT
+	// The declaration is read again by the parser but the :invalid_utf8
+	// check on the reads before then depends on the encoding as well.
+	if (NoTranscode == buf->transcode) {
+	    buf->dr->encoding = rb_enc_find(name);
+	}
+#endif
+    }
+    if (NoTranscode != buf->transcode) {
+#if HAS_ENCODING_SUPPORT || HAS_PRIVATE_ENCODING
+	buf->dr->encoding = ox_utf8_encoding;
+#else
+	buf->dr->encoding = "UTF-8";
+#endif
+    }
+}
+
+/* Reads UTF-16, ISO-8859-1, or Windows-1252 and converts it to UTF-8 so the
+ * driver never sees anything else. The first read also decides if there is
+ * anything to convert. Raw bytes are read into the top third of the free
+ * space and converted down to the tail. A character is never more than 3
+ * UTF-8 bytes per input byte so the output never passes input that has not
+ * been converted yet. Bytes cut off by the end of a read are carried over.
+ */
+static int
+read_transcode(Buf buf) {
+    char	*start = buf->tail;
+    char	*raw = buf->end - (buf->end - start) / 3;
+    size_t	len;
+    size_t	used;
+    int		carried;
+    int		err;
+    int		eof;
+
+    do {
+	carried = buf->carry_len;
+	memcpy(raw, buf->carry, carried);
+	buf->carry_len = 0;
+	buf->tail = raw + carried;
+	buf->read_end = buf->tail;
+	err = buf->read_func(buf);
+	buf->tail = start;
+	len = buf->read_end - raw;
+	eof = (0 != err || (size_t)carried == len);
+	if (eof && 0 == carried) {
+	    buf->read_end = start;
+	    return err;
+	}
+	if (UnknownTranscode == buf->transcode) {
+	    while (!eof && need_more(raw, len) && raw + len < buf->end) {
+		buf->tail = raw + len;
+		err = buf->read_func(buf);
+		buf->tail = start;
+		eof = (0 != err || buf->read_end == raw + len);
+		len = buf->read_end - raw;
+	    }
+	    detect_transcode(buf, raw, len);
+	}
+	switch (buf->transcode) {
+	case Utf16LETranscode:
+	case Utf16BETranscode:
+	    buf->read_end = start + ox_utf16_to_utf8(raw, len, start, Utf16BETranscode == buf->transcode, eof, &used);
+	    buf->carry_len = (int)(len - used);
+	    memcpy(buf->carry, raw + used, buf->carry_len);
+	    break;
+	case Latin1Transcode:
+	case Win1252Transcode:
+	    buf->read_end = start + ox_latin1_to_utf8(raw, len, start, Win1252Transcode == buf->transcode);
+	    break;
+	default:
+	    // Nothing to convert after all, from here on reads go straight in.
+	    memmove(start, raw, len);
+	    buf->read_end = start + len;
+	    if (NoUtf8 != buf->dr->options.invalid_utf8 && ox_utf8_expected(buf->dr->encoding)) {
+		scrub_utf8(buf, eof);
+		if (!eof && buf->read_end <= buf->tail) {
+		    return read_utf8(buf);
+		}
+	    }
+	    return 0;
+	}
+    } while (!eof && buf->read_end <= buf->tail);
+
+    return 0;
+}
+
 static VALUE
 rescue_cb(VALUE rbuf, VALUE err) {
     VALUE	err_class = rb_obj_class(err);
@@ -142,9 +478,9 @@ partial_io_cb(VALUE rbuf) {
     args[0] = ULONG2NUM(buf->end - buf->tail);
     rstr = rb_funcall2(buf->in.io, ox_readpartial_id, 1, args);
     str = StringValuePtr(rstr);
-    cnt = strlen(str);
+    cnt = RSTRING_LEN(rstr);
     //printf("*** read partial %lu bytes, str: '%s'\n", cnt, str);
-    strcpy(buf->tail, str);
+    memcpy(buf->tail, str, cnt);
     buf->read_end = buf->tail + cnt;
 
     return Qtrue;
@@ -161,9 +497,9 @@ io_cb(VALUE rbuf) {
     args[0] = ULONG2NUM(buf->end - buf->tail);
     rstr = rb_funcall2(buf->in.io, ox_read_id, 1, args);
     str = StringValuePtr(rstr);
-    cnt = strlen(str);
+    cnt = RSTRING_LEN(rstr);
     //printf("*** read %lu bytes, str: '%s'\n", cnt, str);
-    strcpy(buf->tail, str);
+    memcpy(buf->tail, str, cnt);
     buf->read_end = buf->tail + cnt;
 
     return Qtrue;
@@ -194,34 +530,66 @@ read_from_fd(Buf buf) {
     return 0;
 }
 
-static char*
-ox_stpncpy(char *dest, const char *src, size_t n) {
-    size_t	cnt = strlen(src) + 1;
+/* Waits for the fd to be readable with the GVL released before reading. */
+static int
+read_from_fd_wait(Buf buf) {
+    rb_thread_wait_fd(buf->in.fd);
+    return read_from_fd(buf);
+}
 
-    if (n < cnt) {
-	cnt = n;
-    }
-    strncpy(dest, src, cnt);
+#if HAS_ZLIB
+/* Checks for the gzip magic bytes without moving the file offset. */
+static int
+is_gzip_fd(int fd) {
+    unsigned char	magic[2];
+    off_t		off = lseek(fd, 0, SEEK_CUR);
 
-    return dest + cnt - 1;
+    return (0 <= off &&
+	    2 == pread(fd, magic, sizeof(magic), off) &&
+	    0x1F == magic[0] && 0x8B == magic[1]);
 }
 
+static int
+read_from_gz(Buf buf) {
+    int		cnt = gzread((gzFile)buf->gz, buf->tail, (unsigned int)(buf->end - buf->tail));
 
+    if (cnt < 0) {
+        ox_sax_drive_error(buf->dr, "failed to decompress file");
+        return -1;
+    } else if (0 != cnt) {
+        buf->read_end = buf->tail + cnt;
+    }
+    return 0;
+}
+#endif
+
+void
+ox_sax_buf_close(Buf buf) {
+#if HAS_ZLIB
+    gzclose((gzFile)buf->gz);
+#endif
+    buf->gz = 0;
+}
+
+/* The remaining length is tracked so each read copies only what fits instead
+ * of scanning the rest of the string every time.
+ */
 static int
 read_from_str(Buf buf) {
-    size_t      max = buf->end - buf->tail - 1;
-    char	*s;
-    long	cnt;
+    size_t      cnt = buf->end - buf->tail - 1;
 
-    if ('\0' == *buf->in.str) {
+    if (0 == buf->in_len) {
 	/* done */
 	return -1;
     }
-    s = ox_stpncpy(buf->tail, buf->in.str, max);
-    *s = '\0';
-    cnt = s - buf->tail;
+    if (buf->in_len < cnt) {
+	cnt = buf->in_len;
+    }
+    memcpy(buf->tail, buf->in.str, cnt);
     buf->in.str += cnt;
+    buf->in_len -= cnt;
     buf->read_end = buf->tail + cnt;
+    *buf->read_end = '\0';
 
     return 0;
 }
@@ -6,6 +6,16 @@
 #ifndef __OX_SAX_BUF_H__
 #define __OX_SAX_BUF_H__
 
+/* How input is converted to UTF-8 as it is read. */
+typedef enum {
+    NoTranscode		= 0,
+    Utf16LETranscode	= 'l',
+    Utf16BETranscode	= 'b',
+    Latin1Transcode	= '1',
+    Win1252Transcode	= 'w',
+    UnknownTranscode	= '?',	/* not known until the first read */
+} Transcode;
+
 typedef struct _Buf {
     char	base[0x00001000];
     char	*head;
@@ -26,6 +36,11 @@ typedef struct _Buf {
         VALUE   	io;
 	const char	*str;
     } in;
+    size_t	in_len;		/* bytes left in in.str */
+    char	carry[4];	/* start of a sequence cut off by the last read */
+    int		carry_len;
+    char	transcode;	/* Transcode */
+    void	*gz;		/* gzFile if the input is compressed */
     struct _SaxDrive	*dr;
 } *Buf;
 
@@ -41,6 +56,7 @@ typedef struct _CheckPt {
 
 extern void	ox_sax_buf_init(Buf buf, VALUE io);
 extern int	ox_sax_buf_read(Buf buf);
+extern void	ox_sax_buf_close(Buf buf);
 
 static inline char
 buf_get(Buf buf) {
@@ -72,6 +88,82 @@ buf_backup(Buf buf) {
     }
 }
 
+/* Same as buf_get() and buf_backup() but without updating pos, line, and
+ * col. Used by the SAX driver when the handler never sees the position.
+ */
+static inline char
+buf_get_notrack(Buf buf) {
+    if (buf->read_end <= buf->tail) {
+        if (0 != ox_sax_buf_read(buf)) {
+            return '\0';
+        }
+    }
+    return *buf->tail++;
+}
+
+static inline void
+buf_backup_notrack(Buf buf) {
+    buf->tail--;
+}
+
+/* Moves the tail to end, updating pos, line, and col as if each character
+ * had been read with buf_get().
+ */
+static inline void
+buf_advance(Buf buf, char *end) {
+    char	*s = buf->tail;
+    char	*nl;
+
+    buf->pos += (int)(end - s);
+    while (0 != (nl = (char*)memchr(s, '\n', end - s))) {
+	buf->line++;
+	buf->col = 0;
+	s = nl + 1;
+    }
+    buf->col += (int)(end - s);
+    buf->tail = end;
+}
+
+/* Reads up to and including the next c, reading more input as needed. A
+ * block at a time is searched with memchr() instead of calling buf_get() for
+ * each character. Returns c or '\0' if the end of input is reached first.
+ */
+static inline char
+buf_skip_to(Buf buf, char c) {
+    char	*s;
+
+    while (1) {
+	if (buf->read_end <= buf->tail) {
+	    if (0 != ox_sax_buf_read(buf) || buf->read_end <= buf->tail) {
+		return '\0';
+	    }
+	}
+	if (0 != (s = (char*)memchr(buf->tail, c, buf->read_end - buf->tail))) {
+	    buf_advance(buf, s + 1);
+	    return c;
+	}
+	buf_advance(buf, buf->read_end);
+    }
+}
+
+static inline char
+buf_skip_to_notrack(Buf buf, char c) {
+    char	*s;
+
+    while (1) {
+	if (buf->read_end <= buf->tail) {
+	    if (0 != ox_sax_buf_read(buf) || buf->read_end <= buf->tail) {
+		return '\0';
+	    }
+	}
+	if (0 != (s = (char*)memchr(buf->tail, c, buf->read_end - buf->tail))) {
+	    buf->tail = s + 1;
+	    return c;
+	}
+	buf->tail = buf->read_end;
+    }
+}
+
 static inline void
 buf_protect(Buf buf) {
     buf->pro = buf->tail;
@@ -111,6 +203,25 @@ buf_next_non_white(Buf buf) {
     return '\0';
 }
 
+static inline char
+buf_next_non_white_notrack(Buf buf) {
+    char        c;
+
+    while ('\0' != (c = buf_get_notrack(buf))) {
+	switch(c) {
+	case ' ':
+	case '\t':
+	case '\f':
+	case '\n':
+	case '\r':
+	    break;
+	default:
+	    return c;
+	}
+    }
+    return '\0';
+}
+
 /* Starts by reading a character so it is safe to use with an empty or
  * compacted buffer.
  */
@@ -140,6 +251,9 @@ buf_cleanup(Buf buf) {
         xfree(buf->head);
 	buf->head = 0;
     }
+    if (0 != buf->gz) {
+	ox_sax_buf_close(buf);
+    }
 }
 
 static inline int
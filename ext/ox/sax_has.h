@@ -14,15 +14,20 @@ typedef struct _Has {
     int         attr_value;
     int         doctype;
     int         comment;
+    int         comment_value;
     int         cdata;
+    int         cdata_value;
     int         text;
     int         value;
     int         start_element;
     int         end_element;
+    int         start_element_ns;
+    int         end_element_ns;
     int         error;
     int		pos;
     int		line;
     int		column;
+    int		position;	/* pos(), line(), or column() made public */
 } *Has;
 
 inline static int
@@ -39,15 +44,22 @@ has_init(Has has, VALUE handler) {
     has->attrs_done = respond_to(handler, ox_attrs_done_id);
     has->doctype = respond_to(handler, ox_doctype_id);
     has->comment = respond_to(handler, ox_comment_id);
+    has->comment_value = respond_to(handler, ox_comment_value_id);
     has->cdata = respond_to(handler, ox_cdata_id);
+    has->cdata_value = respond_to(handler, ox_cdata_value_id);
     has->text = respond_to(handler, ox_text_id);
     has->value = respond_to(handler, ox_value_id);
     has->start_element = respond_to(handler, ox_start_element_id);
     has->end_element = respond_to(handler, ox_end_element_id);
+    has->start_element_ns = respond_to(handler, ox_start_element_ns_id);
+    has->end_element_ns = respond_to(handler, ox_end_element_ns_id);
     has->error = respond_to(handler, ox_error_id);
     has->pos = (Qtrue == rb_ivar_defined(handler, ox_at_pos_id));
     has->line = (Qtrue == rb_ivar_defined(handler, ox_at_line_id));
     has->column = (Qtrue == rb_ivar_defined(handler, ox_at_column_id));
+    has->position = (respond_to(handler, ox_pos_id) ||
+		     respond_to(handler, ox_line_id) ||
+		     respond_to(handler, ox_column_id));
 }
 
 #endif /* __OX_SAX_HAS_H__ */
@@ -0,0 +1,1261 @@
+/* sax_parse.h
+ * Copyright (c) 2011, Peter Ohler
+ * All rights reserved.
+ */
+
+/* There is no include guard on purpose. The file is included by sax.c once
+ * for each variant of the reader functions and SAX_TRACK_POS must be set to 1
+ * or 0 before each include. Function names are mapped to variant names so the
+ * code reads the same for both.
+ */
+
+#if SAX_TRACK_POS
+#define SAX_VARIANT(name)	name##_tracked
+#else
+#define SAX_VARIANT(name)	name##_untracked
+#define buf_get(buf)		buf_get_notrack(buf)
+#define buf_backup(buf)		buf_backup_notrack(buf)
+#define buf_next_non_white(buf)	buf_next_non_white_notrack(buf)
+#define buf_skip_to(buf, c)	buf_skip_to_notrack(buf, c)
+#endif
+
+#define skipBOM			SAX_VARIANT(skipBOM)
+#define parse			SAX_VARIANT(parse)
+#define read_content		SAX_VARIANT(read_content)
+#define read_instruction	SAX_VARIANT(read_instruction)
+#define read_delimited		SAX_VARIANT(read_delimited)
+#define read_doctype		SAX_VARIANT(read_doctype)
+#define read_cdata		SAX_VARIANT(read_cdata)
+#define read_comment		SAX_VARIANT(read_comment)
+#define read_element_start	SAX_VARIANT(read_element_start)
+#define read_element_end	SAX_VARIANT(read_element_end)
+#define read_text		SAX_VARIANT(read_text)
+#define read_jump_term		SAX_VARIANT(read_jump_term)
+#define read_jump		SAX_VARIANT(read_jump)
+#define read_attrs		SAX_VARIANT(read_attrs)
+#define read_ns_decls		SAX_VARIANT(read_ns_decls)
+#define read_name_token		SAX_VARIANT(read_name_token)
+#define read_quoted_value	SAX_VARIANT(read_quoted_value)
+
+// All read functions should return the next character after the 'thing' that was read and leave dr->cur one after that.
+static char		read_instruction(SaxDrive dr);
+static char		read_doctype(SaxDrive dr);
+static char		read_cdata(SaxDrive dr);
+static char		read_comment(SaxDrive dr);
+static char		read_element_start(SaxDrive dr);
+static char		read_element_end(SaxDrive dr);
+static char		read_text(SaxDrive dr);
+static char		read_jump(SaxDrive dr, const char *pat);
+static char		read_attrs(SaxDrive dr, char c, char termc, char term2, int is_xml, int eq_req, Hint h);
+static void		read_ns_decls(SaxDrive dr, char c, int depth);
+static char		read_name_token(SaxDrive dr);
+static char		read_quoted_value(SaxDrive dr);
+
+static char
+skipBOM(SaxDrive dr) {
+    char        c = buf_get(&dr->buf);
+
+    if (0xEF == (uint8_t)c) { /* only UTF8 is supported */
+	if (0xBB == (uint8_t)buf_get(&dr->buf) && 0xBF == (uint8_t)buf_get(&dr->buf)) {
+#if HAS_ENCODING_SUPPORT
+	    dr->encoding = ox_utf8_encoding;
+#elif HAS_PRIVATE_ENCODING
+	    dr->encoding = ox_utf8_encoding;
+#else
+	    dr->encoding = UTF8_STR;
+#endif
+	    c = buf_get(&dr->buf);
+	} else {
+	    ox_sax_drive_error(dr, BAD_BOM "invalid BOM or a binary file.");
+	    c = '\0';
+	}
+    }
+    return c;
+}
+
+static void
+parse(SaxDrive dr) {
+    char        c = skipBOM(dr);
+    int		state = START_STATE;
+    Nv		parent;
+
+    while ('\0' != c) {
+	sax_drive_reclaim(dr);
+	buf_protect(&dr->buf);
+	if ('<' == c) {
+	    c = buf_get(&dr->buf);
+	    switch (c) {
+	    case '?': /* instructions (xml or otherwise) */
+		c = read_instruction(dr);
+		break;
+	    case '!': /* comment or doctype */
+		buf_protect(&dr->buf);
+		c = buf_get(&dr->buf);
+		if ('\0' == c) {
+		    ox_sax_drive_error(dr, NO_TERM "DOCTYPE or comment not terminated");
+
+		    goto DONE;
+		} else if ('-' == c) {
+		    c = buf_get(&dr->buf); /* skip first - and get next character */
+		    if ('-' != c) {
+			ox_sax_drive_error(dr, INVALID_FORMAT "bad comment format, expected <!--");
+		    } else {
+			c = buf_get(&dr->buf); /* skip second - */
+		    }
+		    c = read_comment(dr);
+		} else {
+		    int	i;
+		    int	spaced = 0;
+		    int	pos = dr->buf.pos + 1;
+		    int	line = dr->buf.line;
+		    int	col = dr->buf.col + 1;
+
+		    if (is_white(c)) {
+			spaced = 1;
+			c = buf_next_non_white(&dr->buf);
+		    }
+		    dr->buf.str = dr->buf.tail - 1;
+		    for (i = 7; 0 < i; i--) {
+			c = buf_get(&dr->buf);
+		    }
+		    if (0 == strncmp("DOCTYPE", dr->buf.str, 7)) {
+			if (spaced) {
+			    ox_sax_drive_error_at(dr, WRONG_CHAR "<!DOCTYPE can not included spaces", pos, line, col);
+			}
+			if (START_STATE != state) {
+			    ox_sax_drive_error(dr, OUT_OF_ORDER "DOCTYPE can not come after an element");
+			}
+			c = read_doctype(dr);
+		    } else if (0 == strncasecmp("DOCTYPE", dr->buf.str, 7)) {
+			ox_sax_drive_error(dr, CASE_ERROR "expected DOCTYPE all in caps");
+			if (START_STATE != state) {
+			    ox_sax_drive_error(dr, OUT_OF_ORDER "DOCTYPE can not come after an element");
+			}
+			c = read_doctype(dr);
+		    } else if (0 == strncmp("[CDATA[", dr->buf.str, 7)) {
+			if (spaced) {
+			    ox_sax_drive_error_at(dr, WRONG_CHAR "<![CDATA[ can not included spaces", pos, line, col);
+			}
+			c = read_cdata(dr);
+		    } else if (0 == strncasecmp("[CDATA[", dr->buf.str, 7)) {
+			ox_sax_drive_error(dr, CASE_ERROR "expected CDATA all in caps");
+			c = read_cdata(dr);
+		    } else {
+			Nv	parent = stack_peek(&dr->stack);
+
+			if (0 != parent) {
+			    parent->childCnt++;
+			}
+			ox_sax_drive_error_at(dr, WRONG_CHAR "DOCTYPE, CDATA, or comment expected", pos, line, col);
+			c = read_name_token(dr);
+			if ('>' == c) {
+			    c = buf_get(&dr->buf);
+			}
+		    }
+		}
+		break;
+	    case '/': /* element end */
+		parent = stack_peek(&dr->stack);
+		if (0 != parent && 0 == parent->childCnt && dr->has.text && !dr->blocked) {
+		    VALUE	args[1];
+		    int		pos = dr->buf.pos;
+		    int		line = dr->buf.line;
+		    int		col = dr->buf.col - 1;
+
+		    args[0] = event_str(dr, "");
+		    set_position(dr, pos, line, col);
+		    OX_PROBE1(sax__callback, "text");
+		    rb_funcall2(dr->handler, ox_text_id, 1, args);
+		}
+		c = read_element_end(dr);
+		if (0 == stack_peek(&dr->stack)) {
+		    state = AFTER_STATE;
+		}
+		break;
+	    case '\0':
+		goto DONE;
+	    default:
+		buf_backup(&dr->buf);
+		if (AFTER_STATE == state) {
+		    ox_sax_drive_error(dr, OUT_OF_ORDER "multiple top level elements");
+		}
+		state = BODY_STATE;
+		c = read_element_start(dr);
+		if (0 == stack_peek(&dr->stack)) {
+		    state = AFTER_STATE;
+		}
+		break;
+	    }
+	} else {
+	    buf_reset(&dr->buf);
+	    c = read_text(dr);
+	}
+    }
+ DONE:
+    if (dr->abort) {
+	return;
+    }
+    if (dr->stack.head < dr->stack.tail) {
+	char	msg[256];
+	Nv	sp;
+
+	set_position(dr, dr->buf.pos, dr->buf.line, dr->buf.col);
+	for (sp = dr->stack.tail - 1; dr->stack.head <= sp; sp--) {
+	    snprintf(msg, sizeof(msg) - 1, "%selement '%s' not closed", EL_MISMATCH, sp->name);
+	    ox_sax_drive_error_at(dr, msg, dr->buf.pos, dr->buf.line, dr->buf.col);
+	    end_element_cb(dr, sp, dr->buf.pos, dr->buf.line, dr->buf.col);
+        }
+    }
+}
+
+static void
+read_content(SaxDrive dr, char *content, size_t len) {
+    char	c;
+    char	*end = content + len;
+
+    while ('\0' != (c = buf_get(&dr->buf))) {
+	if (end < content) {
+	    ox_sax_drive_error(dr, "processing instruction content too large");
+	    return;
+	}
+	if ('?' == c) {
+	    if ('\0' == (c = buf_get(&dr->buf))) {
+		ox_sax_drive_error(dr, NO_TERM "document not terminated");
+	    }
+	    if ('>' == c) {
+		*content = '\0';
+		return;
+	    } else {
+		*content++ = c;
+	    }
+	} else {
+	    *content++ = c;
+	}
+    }
+    *content = '\0';
+}
+
+/* Entered after the "<?" sequence. Ready to read the rest.
+ */
+static char
+read_instruction(SaxDrive dr) {
+    char	content[1024];
+    char        c;
+    char	*cend;
+    VALUE	target = Qnil;
+    int		is_xml;
+    int		pos = dr->buf.pos - 1;
+    int		line = dr->buf.line;
+    int		col = dr->buf.col - 1;
+
+    buf_protect(&dr->buf);
+    if ('\0' == (c = read_name_token(dr))) {
+        return c;
+    }
+    is_xml = (0 == strcmp("xml", dr->buf.str));
+    if (dr->has.instruct || dr->has.end_instruct) {
+	target = rb_str_new2(dr->buf.str);
+    }
+    if (dr->has.instruct) {
+        VALUE       args[1];
+
+	set_position(dr, pos, line, col);
+        args[0] = target;
+        OX_PROBE1(sax__callback, "instruct");
+        rb_funcall2(dr->handler, ox_instruct_id, 1, args);
+    }
+    buf_protect(&dr->buf);
+    pos = dr->buf.pos;
+    line = dr->buf.line;
+    col = dr->buf.col;
+    read_content(dr, content, sizeof(content) - 1);
+    cend = dr->buf.tail;
+    buf_reset(&dr->buf);
+    dr->err = 0;
+    c = read_attrs(dr, c, '?', '?', is_xml, 1, NULL);
+    if (dr->has.attrs_done) {
+	OX_PROBE1(sax__callback, "attrs_done");
+	rb_funcall(dr->handler, ox_attrs_done_id, 0);
+    }
+    if (dr->err) {
+	if (dr->has.text) {
+	    VALUE   args[1];
+
+	    if (dr->options.convert_special) {
+		ox_sax_collapse_special(dr, content, pos, line, col);
+	    }
+	    args[0] = event_str(dr, content);
+	    set_position(dr, pos, line, col);
+	    OX_PROBE1(sax__callback, "text");
+	    rb_funcall2(dr->handler, ox_text_id, 1, args);
+	}
+	dr->buf.tail = cend;
+	c = buf_get(&dr->buf);
+    } else {
+	pos = dr->buf.pos;
+	line = dr->buf.line;
+	col = dr->buf.col;
+	c = buf_next_non_white(&dr->buf);
+	if ('>' == c) {
+	    c = buf_get(&dr->buf);
+	} else {
+	    ox_sax_drive_error_at(dr, NO_TERM "instruction not terminated", pos, line, col);
+	    if ('>' == c) {
+		c = buf_get(&dr->buf);
+	    }
+	}
+    }
+    if (dr->has.end_instruct) {
+        VALUE       args[1];
+
+	set_position(dr, pos, line, col);
+        args[0] = target;
+        OX_PROBE1(sax__callback, "end_instruct");
+        rb_funcall2(dr->handler, ox_end_instruct_id, 1, args);
+    }
+    dr->buf.str = 0;
+
+    return c;
+}
+
+static char
+read_delimited(SaxDrive dr, char end) {
+    char	c;
+
+    if ('"' == end || '\'' == end) {
+	while (end != (c = buf_get(&dr->buf))) {
+	    if ('\0' == c) {
+		ox_sax_drive_error(dr, NO_TERM "doctype not terminated");
+		return c;
+	    }
+	}
+    } else {
+	while (1) {
+	    c = buf_get(&dr->buf);
+	    if (end == c) {
+		return c;
+	    }
+	    switch (c) {
+	    case '\0':
+		ox_sax_drive_error(dr, NO_TERM "doctype not terminated");
+		return c;
+	    case '"':
+		c = read_delimited(dr, c);
+		break;
+	    case '\'':
+		c = read_delimited(dr, c);
+		break;
+	    case '[':
+		c = read_delimited(dr, ']');
+		break;
+	    case '<':
+		c = read_delimited(dr, '>');
+		break;
+	    default:
+		break;
+	    }
+	}
+    }
+    return c;
+}
+
+/* Entered after the "<!DOCTYPE " sequence. Ready to read the rest.
+ */
+static char
+read_doctype(SaxDrive dr) {
+    int		pos = dr->buf.pos - 9;
+    int		line = dr->buf.line;
+    int		col = dr->buf.col - 9;
+    char	*s;
+    Nv		parent = stack_peek(&dr->stack);
+
+    buf_backup(&dr->buf); /* back up to the start in case the doctype is empty */
+    buf_protect(&dr->buf);
+    read_delimited(dr, '>');
+    if (dr->options.smart && 0 == dr->options.hints) {
+	for (s = dr->buf.str; is_white(*s); s++) { }
+	if (0 == strncasecmp("HTML", s, 4)) {
+	    dr->options.hints = ox_hints_html();
+	}
+    }
+    *(dr->buf.tail - 1) = '\0';
+    if (0 != parent) {
+	parent->childCnt++;
+    }
+    if (dr->has.doctype) {
+        VALUE       args[1];
+
+	set_position(dr, pos, line, col);
+        args[0] = rb_str_new2(dr->buf.str);
+        OX_PROBE1(sax__callback, "doctype");
+        rb_funcall2(dr->handler, ox_doctype_id, 1, args);
+    }
+    dr->buf.str = 0;
+
+    return buf_get(&dr->buf);
+}
+
+/* Entered after the "<![CDATA[" sequence. Ready to read the rest.
+ */
+static char
+read_cdata(SaxDrive dr) {
+    char        	c;
+    char        	zero = '\0';
+    int         	end = 0;
+    int			pos = dr->buf.pos - 9;
+    int			line = dr->buf.line;
+    int			col = dr->buf.col - 9;
+    struct _CheckPt	cp = CHECK_PT_INIT;
+    Nv			parent = stack_peek(&dr->stack);
+
+    // TBD check parent overlay
+    if (0 != parent) {
+	parent->childCnt++;
+    }
+    buf_backup(&dr->buf); /* back up to the start in case the cdata is empty */
+    buf_protect(&dr->buf);
+    while ('\0' != buf_skip_to(&dr->buf, '>')) {
+	if (dr->buf.str + 3 <= dr->buf.tail && ']' == *(dr->buf.tail - 2) && ']' == *(dr->buf.tail - 3)) {
+	    *(dr->buf.tail - 3) = '\0';
+	    c = buf_get(&dr->buf);
+	    goto CB;
+	}
+    }
+    // Not terminated so read again a character at a time to find where to
+    // pick up after reporting the error.
+    buf_reset(&dr->buf);
+    while (1) {
+        c = buf_get(&dr->buf);
+	switch (c) {
+	case ']':
+            end++;
+	    break;
+	case '>':
+            if (2 <= end) {
+                *(dr->buf.tail - 3) = '\0';
+		c = buf_get(&dr->buf);
+                goto CB;
+            }
+	    if (!buf_checkset(&cp)) {
+		buf_checkpoint(&dr->buf, &cp);
+	    }
+            end = 0;
+	    break;
+	case '<':
+	    if (!buf_checkset(&cp)) {
+		buf_checkpoint(&dr->buf, &cp);
+	    }
+	    end = 0;
+	    break;
+	case '\0':
+	    if (buf_checkset(&cp)) {
+		c = buf_checkback(&dr->buf, &cp);
+		ox_sax_drive_error(dr, NO_TERM "CDATA not terminated");
+		zero = c;
+		*(dr->buf.tail - 1) = '\0';
+		goto CB;
+	    }
+            ox_sax_drive_error(dr, NO_TERM "CDATA not terminated");
+            return '\0';
+	default:
+	    if (1 < end && !buf_checkset(&cp)) {
+		buf_checkpoint(&dr->buf, &cp);
+	    }
+	    end = 0;
+	    break;
+	}
+    }
+ CB:
+    if (!dr->blocked && (NULL == parent || NULL == parent->hint || OffOverlay != parent->hint->overlay)) {
+	if (dr->has.cdata_value) {
+	    VALUE       args[1];
+
+	    set_position(dr, pos, line, col);
+	    *args = dr->value_obj;
+	    dr->raw_value = true;
+	    OX_PROBE1(sax__callback, "cdata_value");
+	    rb_funcall2(dr->handler, ox_cdata_value_id, 1, args);
+	    dr->raw_value = false;
+	} else if (dr->has.cdata) {
+	    VALUE       args[1];
+
+	    args[0] = event_str(dr, dr->buf.str);
+	    set_position(dr, pos, line, col);
+	    OX_PROBE1(sax__callback, "cdata");
+	    rb_funcall2(dr->handler, ox_cdata_id, 1, args);
+	}
+    }
+    if ('\0' != zero) {
+	*(dr->buf.tail - 1) = zero;
+    }
+    dr->buf.str = 0;
+
+    return c;
+}
+
+/* Entered after the "<!--" sequence. Ready to read the rest.
+ */
+static char
+read_comment(SaxDrive dr) {
+    char        	c;
+    char        	zero = '\0';
+    int         	end = 0;
+    int			pos = dr->buf.pos - 4;
+    int			line = dr->buf.line;
+    int			col = dr->buf.col - 4;
+    struct _CheckPt	cp = CHECK_PT_INIT;
+
+    buf_backup(&dr->buf); /* back up to the start in case the cdata is empty */
+    buf_protect(&dr->buf);
+    while ('\0' != buf_skip_to(&dr->buf, '>')) {
+	if (dr->buf.str + 3 <= dr->buf.tail && '-' == *(dr->buf.tail - 2) && '-' == *(dr->buf.tail - 3)) {
+	    *(dr->buf.tail - 3) = '\0';
+	    c = buf_get(&dr->buf);
+	    goto CB;
+	}
+    }
+    // Not terminated so read again a character at a time to find where to
+    // pick up after reporting the error.
+    buf_reset(&dr->buf);
+    while (1) {
+        c = buf_get(&dr->buf);
+	switch (c) {
+	case '-':
+            end++;
+	    break;
+	case '>':
+            if (2 <= end) {
+                *(dr->buf.tail - 3) = '\0';
+		c = buf_get(&dr->buf);
+                goto CB;
+            }
+	    if (!buf_checkset(&cp)) {
+		buf_checkpoint(&dr->buf, &cp);
+	    }
+            end = 0;
+	    break;
+	case '<':
+	    if (!buf_checkset(&cp)) {
+		buf_checkpoint(&dr->buf, &cp);
+	    }
+	    end = 0;
+	    break;
+	case '\0':
+	    if (buf_checkset(&cp)) {
+		c = buf_checkback(&dr->buf, &cp);
+		ox_sax_drive_error(dr, NO_TERM "comment not terminated");
+		zero = c;
+		*(dr->buf.tail - 1) = '\0';
+		goto CB;
+	    }
+            ox_sax_drive_error(dr, NO_TERM "comment not terminated");
+            return '\0';
+	default:
+	    if (1 < end && !buf_checkset(&cp)) {
+		buf_checkpoint(&dr->buf, &cp);
+	    }
+	    end = 0;
+	    break;
+	}
+    }
+ CB:
+    // TBD check parent overlay
+    if ((dr->has.comment || dr->has.comment_value) && !dr->blocked) {
+        VALUE	args[1];
+	Nv	parent = stack_peek(&dr->stack);
+
+	if (NULL == parent || NULL == parent->hint || OffOverlay != parent->hint->overlay) {
+	    set_position(dr, pos, line, col);
+	    if (dr->has.comment_value) {
+		*args = dr->value_obj;
+		dr->raw_value = true;
+		OX_PROBE1(sax__callback, "comment_value");
+		rb_funcall2(dr->handler, ox_comment_value_id, 1, args);
+		dr->raw_value = false;
+	    } else {
+		args[0] = event_str(dr, dr->buf.str);
+		OX_PROBE1(sax__callback, "comment");
+		rb_funcall2(dr->handler, ox_comment_id, 1, args);
+	    }
+	}
+    }
+    if ('\0' != zero) {
+	*(dr->buf.tail - 1) = zero;
+    }
+    dr->buf.str = 0;
+
+    return c;
+}
+
+/* Entered after the '<' and the first character after that. Returns status
+ * code.
+ */
+static char
+read_element_start(SaxDrive dr) {
+    const char		*ename = 0;
+    volatile VALUE	name = Qnil;
+    char        	c;
+    int			closed;
+    int			pos = dr->buf.pos;
+    int			line = dr->buf.line;
+    int			col = dr->buf.col;
+    Hint		h = NULL;
+    int			stackless = 0;
+    int			depth;
+    Nv			parent = stack_peek(&dr->stack);
+
+    if ('\0' == (c = read_name_token(dr))) {
+        return '\0';
+    }
+    if ('\0' == *dr->buf.str) {
+	char	msg[256];
+
+	snprintf(msg, sizeof(msg) - 1, "%sempty element", INVALID_FORMAT);
+	ox_sax_drive_error_at(dr, msg, pos, line, col);
+
+	return '\0';
+    }
+    if (0 != parent) {
+	parent->childCnt++;
+    }
+    if (dr->options.smart && 0 == dr->options.hints && stack_empty(&dr->stack) && 0 == strcasecmp("html", dr->buf.str)) {
+	dr->options.hints = ox_hints_html();
+    }
+    if (NULL != dr->options.hints) {
+	hint_clear_empty(dr);
+	h = ox_hint_find(dr->options.hints, dr->buf.str);
+	if (NULL == h) {
+	    char	msg[256];
+
+	    snprintf(msg, sizeof(msg), "%s%s is not a valid element type for a %s document type.", INV_ELEMENT, dr->buf.str, dr->options.hints->name);
+	    ox_sax_drive_error(dr, msg);
+	} else {
+	    Nv	top_nv = stack_peek(&dr->stack);
+
+	    if (AbortOverlay == h->overlay) {
+		if (rb_respond_to(dr->handler, ox_abort_id)) {
+		    VALUE	args[1];
+
+		    args[0] = str2sym(dr, dr->buf.str, NULL);
+		    OX_PROBE1(sax__callback, "abort");
+		    rb_funcall2(dr->handler, ox_abort_id, 1, args);
+		}
+		dr->abort = true;
+		return '\0';
+	    }
+	    if (BlockOverlay == h->overlay) {
+		dr->blocked++;
+	    }
+	    if (h->empty) {
+		stackless = 1;
+	    }
+	    if (0 != top_nv) {
+		char	msg[256];
+	
+		if (!h->nest && 0 == strcasecmp(top_nv->name, h->name)) {
+		    snprintf(msg, sizeof(msg) - 1, "%s%s can not be nested in a %s document, closing previous.",
+			     INV_ELEMENT, dr->buf.str, dr->options.hints->name);
+		    ox_sax_drive_error(dr, msg);
+		    stack_pop(&dr->stack);
+		    end_element_cb(dr, top_nv, pos, line, col);
+		    top_nv = stack_peek(&dr->stack);
+		}
+		if (0 != h->parents) {
+		    const char	**p;
+		    int		ok = 0;
+
+		    for (p = h->parents; 0 != *p; p++) {
+			if (0 == strcasecmp(*p, top_nv->name)) {
+			    ok = 1;
+			    break;
+			}
+		    }
+		    if (!ok) {
+			snprintf(msg, sizeof(msg) - 1, "%s%s can not be a child of a %s in a %s document.",
+				 INV_ELEMENT, h->name, top_nv->name, dr->options.hints->name);
+			ox_sax_drive_error(dr, msg);
+		    }
+		}
+	    }
+	}
+    }
+    name = str2sym(dr, dr->buf.str, &ename);
+    depth = stack_depth(&dr->stack);
+    if (Qnil != dr->ns_uris) {
+	stack_ns_truncate(&dr->stack, depth);
+	if (is_white(c)) {
+	    read_ns_decls(dr, c, depth);
+	}
+    }
+    if (dr->has.start_element && 0 >= dr->blocked && (NULL == h || ActiveOverlay == h->overlay)) {
+        VALUE       args[1];
+
+	set_position(dr, pos, line, col);
+        args[0] = name;
+        OX_PROBE1(sax__callback, "start_element");
+        rb_funcall2(dr->handler, ox_start_element_id, 1, args);
+    }
+    if (dr->has.start_element_ns && 0 >= dr->blocked && (NULL == h || ActiveOverlay == h->overlay)) {
+	set_position(dr, pos, line, col);
+	ns_element_cb(dr, ox_start_element_ns_id, ename, depth);
+    }
+    if ('/' == c) {
+        closed = 1;
+    } else if ('>' == c) {
+        closed = 0;
+    } else {
+	buf_protect(&dr->buf);
+        c = read_attrs(dr, c, '/', '>', 0, 0, h);
+	if (is_white(c)) {
+	    c = buf_next_non_white(&dr->buf);
+	}
+	closed = ('/' == c);
+    }
+    if (dr->has.attrs_done && 0 >= dr->blocked && (NULL == h || ActiveOverlay == h->overlay)) {
+	OX_PROBE1(sax__callback, "attrs_done");
+	rb_funcall(dr->handler, ox_attrs_done_id, 0);
+    }
+    if (closed || stackless) {
+	struct _Nv	nv = { ename, name, 0, depth, h };
+
+	if (closed) {
+	    c = buf_next_non_white(&dr->buf);
+	    pos = dr->buf.pos;
+	    line = dr->buf.line;
+	    col = dr->buf.col;
+	}
+	end_element_cb(dr, &nv, pos, line, col);
+    } else if (0 != h && h->jump) {
+	stack_push(&dr->stack, ename, name, h);
+	if ('>' != c) {
+	    ox_sax_drive_error(dr, WRONG_CHAR "element not closed");
+	    return c;
+	}
+	read_jump(dr, h->name);
+	return '<';
+    } else {
+	stack_push(&dr->stack, ename, name, h);
+    }
+    if ('>' != c) {
+	ox_sax_drive_error(dr, WRONG_CHAR "element not closed");
+	return c;
+    }
+    dr->buf.str = 0;
+
+    return buf_get(&dr->buf);
+}
+
+static char
+read_element_end(SaxDrive dr) {
+    char        c;
+    int		pos = dr->buf.pos - 1;
+    int		line = dr->buf.line;
+    int		col = dr->buf.col - 1;
+    Nv		nv;
+    struct _Nv	opened;
+    
+    if ('\0' == (c = read_name_token(dr))) {
+        return '\0';
+    }
+    if (is_white(c)) {
+	c = buf_next_non_white(&dr->buf);
+    }
+    // c should be > and current is one past so read another char
+    c = buf_get(&dr->buf);
+    nv = stack_peek(&dr->stack);
+    if (0 != nv && 0 == strcmp(dr->buf.str, nv->name)) {
+	stack_pop(&dr->stack);
+    } else {
+	// Mismatched start and end
+	char	msg[256];
+	Nv	match = stack_rev_find(&dr->stack, dr->buf.str);
+
+	if (0 == match) {
+	    // Not found so open and close element.
+	    Hint	h = ox_hint_find(dr->options.hints, dr->buf.str);
+
+	    if (NULL != h && h->empty) {
+		// Just close normally
+		snprintf(msg, sizeof(msg) - 1, "%selement '%s' should not have a separate close element", EL_MISMATCH, dr->buf.str);
+		ox_sax_drive_error_at(dr, msg, pos, line, col);
+		return c;
+	    } else {
+		snprintf(msg, sizeof(msg) - 1, "%selement '%s' closed but not opened", EL_MISMATCH, dr->buf.str);
+		ox_sax_drive_error_at(dr, msg, pos, line, col);
+		opened.val = str2sym(dr, dr->buf.str, &opened.name);
+		opened.childCnt = 0;
+		opened.depth = stack_depth(&dr->stack);
+		opened.hint = h;
+		nv = &opened;
+		if (Qnil != dr->ns_uris) {
+		    stack_ns_truncate(&dr->stack, nv->depth);
+		}
+		if (0 >= dr->blocked && (NULL == h || ActiveOverlay == h->overlay)) {
+		    if (dr->has.start_element) {
+			VALUE       args[1];
+
+			set_position(dr, pos, line, col);
+			args[0] = nv->val;
+			OX_PROBE1(sax__callback, "start_element");
+			rb_funcall2(dr->handler, ox_start_element_id, 1, args);
+		    }
+		    if (dr->has.start_element_ns) {
+			set_position(dr, pos, line, col);
+			ns_element_cb(dr, ox_start_element_ns_id, nv->name, nv->depth);
+		    }
+		}
+		if (NULL != h && BlockOverlay == h->overlay && 0 < dr->blocked) {
+		    dr->blocked--;
+		}
+	    }
+	} else {
+	    // Found a match so close all up to the found element in stack.
+	    Nv	n2;
+
+	    if (0 != (n2 = hint_try_close(dr, dr->buf.str))) {
+		nv = n2;
+	    } else {
+		snprintf(msg, sizeof(msg) - 1, "%selement '%s' close does not match '%s' open", EL_MISMATCH, dr->buf.str, nv->name);
+		ox_sax_drive_error_at(dr, msg, pos, line, col);
+		for (nv = stack_pop(&dr->stack); match < nv; nv = stack_pop(&dr->stack)) {
+		    end_element_cb(dr, nv, pos, line, col);
+		}
+	    }
+	}
+    }
+    end_element_cb(dr, nv, pos, line, col);
+
+    return c;
+}
+
+static char
+read_text(SaxDrive dr) {
+    VALUE	args[1];
+    char        c;
+    int		pos = dr->buf.pos;
+    int		line = dr->buf.line;
+    int		col = dr->buf.col - 1;
+    Nv		parent = stack_peek(&dr->stack);
+    int		allWhite = 1;
+
+    buf_backup(&dr->buf);
+    buf_protect(&dr->buf);
+    while ('<' != (c = buf_get(&dr->buf))) {
+	switch(c) {
+	case ' ':
+	case '\t':
+	case '\f':
+	case '\n':
+	case '\r':
+	    break;
+	case '\0':
+	    if (allWhite) {
+		return c;
+	    }
+            ox_sax_drive_error(dr, NO_TERM "text not terminated");
+	    goto END_OF_BUF;
+	    break;
+	default:
+	    allWhite = 0;
+	    break;
+	}
+    }
+ END_OF_BUF:
+    if ('\0' != c) {
+	*(dr->buf.tail - 1) = '\0';
+    }
+    if (allWhite) {
+	int	isEnd = ('/' == buf_get(&dr->buf));
+
+	buf_backup(&dr->buf);
+	if (!isEnd || 0 == parent || 0 < parent->childCnt) {
+	    return c;
+	}
+    }
+    if (0 != parent) {
+	parent->childCnt++;
+    }
+    if (!dr->blocked && (NULL == parent || NULL == parent->hint || OffOverlay != parent->hint->overlay)) {
+	if (dr->has.value) {
+	    set_position(dr, pos, line, col);
+	    *args = dr->value_obj;
+	    OX_PROBE1(sax__callback, "value");
+	    rb_funcall2(dr->handler, ox_value_id, 1, args);
+	} else if (dr->has.text) {
+	    if (dr->options.convert_special) {
+		ox_sax_collapse_special(dr, dr->buf.str, pos, line, col);
+	    }
+	    switch (dr->options.skip) {
+	    case CrSkip:
+		buf_collapse_return(dr->buf.str);
+		break;
+	    case SpcSkip:
+		buf_collapse_white(dr->buf.str);
+		break;
+	    default:
+		break;
+	    }
+	    args[0] = event_str(dr, dr->buf.str);
+	    set_position(dr, pos, line, col);
+	    OX_PROBE1(sax__callback, "text");
+	    rb_funcall2(dr->handler, ox_text_id, 1, args);
+	}
+    }
+    dr->buf.str = 0;
+
+    return c;
+}
+
+static int
+read_jump_term(Buf buf, const char *pat) {
+    struct _CheckPt	cp;
+
+    buf_checkpoint(buf, &cp); // right after <
+    if ('/' != buf_next_non_white(buf)) {
+	return 0;
+    }
+    if (*pat != buf_next_non_white(buf)) {
+	return 0;
+    }
+    for (pat++; '\0' != *pat; pat++) {
+	if (*pat != buf_get(buf)) {
+	    return 0;
+	}
+    }
+    if ('>' != buf_next_non_white(buf)) {
+	return 0;
+    }
+    buf_checkback(buf, &cp);
+    return 1;
+}
+
+static char
+read_jump(SaxDrive dr, const char *pat) {
+    VALUE	args[1];
+    char        c;
+    int		pos = dr->buf.pos;
+    int		line = dr->buf.line;
+    int		col = dr->buf.col - 1;
+    Nv		parent = stack_peek(&dr->stack);
+
+    buf_protect(&dr->buf);
+    while (1) {
+	c = buf_skip_to(&dr->buf, '<');
+	switch(c) {
+	case '<':
+	    if (read_jump_term(&dr->buf, pat)) {
+		goto END_OF_BUF;
+		break;
+	    }
+	    break;
+	case '\0':
+            ox_sax_drive_error(dr, NO_TERM "not terminated");
+	    goto END_OF_BUF;
+	    break;
+	default:
+	    break;
+	}
+    }
+ END_OF_BUF:
+    if ('\0' != c) {
+	*(dr->buf.tail - 1) = '\0';
+    }
+    if (0 != parent) {
+	parent->childCnt++;
+    }
+    // TBD check parent overlay
+    if (dr->has.text && !dr->blocked) {
+        args[0] = event_str(dr, dr->buf.str);
+	set_position(dr, pos, line, col);
+        OX_PROBE1(sax__callback, "text");
+        rb_funcall2(dr->handler, ox_text_id, 1, args);
+    }
+    dr->buf.str = 0;
+    if ('\0' != c) {
+	*(dr->buf.tail - 1) = '<';
+    }
+    return c;
+}
+
+static char
+read_attrs(SaxDrive dr, char c, char termc, char term2, int is_xml, int eq_req, Hint h) {
+    VALUE       name = Qnil;
+    int         is_encoding = 0;
+    int		pos;
+    int		line;
+    int		col;
+    char	*attr_value;
+
+    // already protected by caller
+    dr->buf.str = dr->buf.tail;
+    if (is_white(c)) {
+        c = buf_next_non_white(&dr->buf);
+    }
+    while (termc != c && term2 != c) {
+	buf_backup(&dr->buf);
+        if ('\0' == c) {
+	    ox_sax_drive_error(dr, NO_TERM "attributes not terminated");
+	    return '\0';
+        }
+	pos = dr->buf.pos + 1;
+	line = dr->buf.line;
+	col = dr->buf.col + 1;
+        if ('\0' == (c = read_name_token(dr))) {
+	    ox_sax_drive_error(dr, NO_TERM "error reading token");
+	    return '\0';
+        }
+        if (is_xml && 0 == strcasecmp("encoding", dr->buf.str)) {
+            is_encoding = 1;
+        }
+        if (dr->has.attr || dr->has.attr_value) {
+            name = str2sym(dr, dr->buf.str, 0);
+        }
+        if (is_white(c)) {
+            c = buf_next_non_white(&dr->buf);
+        }
+        if ('=' != c) {
+	    if (eq_req) {
+		dr->err = 1;
+		return c;
+	    } else {
+		ox_sax_drive_error(dr, WRONG_CHAR "no attribute value");
+		attr_value = (char*)"";
+	    }
+        } else {
+	    pos = dr->buf.pos + 1;
+	    line = dr->buf.line;
+	    col = dr->buf.col + 1;
+	    c = read_quoted_value(dr);
+	    attr_value = dr->buf.str;
+	    // Transcoded input is UTF-8 whatever it was declared as.
+	    if (is_encoding && NoTranscode == dr->buf.transcode) {
+#if HAS_ENCODING_SUPPORT
+		dr->encoding = rb_enc_find(dr->buf.str);
+#elif HAS_PRIVATE_ENCODING
+		dr->encoding = rb_str_new2(dr->buf.str);
+#else
+		dr->encoding = dr->buf.str;
+#endif
+	    }
+	    is_encoding = 0;
+	}
+	if (0 >= dr->blocked && (NULL == h || ActiveOverlay == h->overlay)) {
+	    if (dr->has.attr_value) {
+		VALUE       args[2];
+
+		set_position(dr, pos, line, col);
+		args[0] = name;
+		args[1] = dr->value_obj;
+		OX_PROBE1(sax__callback, "attr_value");
+		rb_funcall2(dr->handler, ox_attr_value_id, 2, args);
+	    } else if (dr->has.attr) {
+		VALUE       args[2];
+
+		args[0] = name;
+		if (dr->options.convert_special) {
+		    ox_sax_collapse_special(dr, dr->buf.str, pos, line, col);
+		}
+		args[1] = rb_str_new2(attr_value);
+#if HAS_ENCODING_SUPPORT
+		if (0 != dr->encoding) {
+		    rb_enc_associate(args[1], dr->encoding);
+		}
+#elif HAS_PRIVATE_ENCODING
+		if (Qnil != dr->encoding) {
+		    rb_funcall(args[1], ox_force_encoding_id, 1, dr->encoding);
+		}
+#endif
+		set_position(dr, pos, line, col);
+		OX_PROBE1(sax__callback, "attr");
+		rb_funcall2(dr->handler, ox_attr_id, 2, args);
+	    }
+	}
+	if (is_white(c)) {
+	    c = buf_next_non_white(&dr->buf);
+	}
+    }
+    dr->buf.str = 0;
+
+    return c;
+}
+
+/* Looks ahead through the attributes of an element for xmlns declarations
+ * so the namespace of the element is known before its start callbacks. The
+ * buffer is left unchanged and reset to where it was. Anything malformed
+ * stops the scan and is reported when the attributes are read.
+ */
+static void
+read_ns_decls(SaxDrive dr, char c, int depth) {
+    long	name_off;
+    long	value_off;
+    int		name_len;
+    char	q;
+    char	*name;
+
+    buf_protect(&dr->buf);
+    while (1) {
+	if (is_white(c)) {
+	    c = buf_next_non_white(&dr->buf);
+	}
+	if ('\0' == c || '/' == c || '>' == c) {
+	    break;
+	}
+	name_off = dr->buf.tail - dr->buf.pro - 1;
+	while (!is_white(c) && '=' != c && '/' != c && '>' != c && '\0' != c) {
+	    c = buf_get(&dr->buf);
+	}
+	name_len = (int)(dr->buf.tail - dr->buf.pro - 1 - name_off);
+	if (is_white(c)) {
+	    c = buf_next_non_white(&dr->buf);
+	}
+	if ('=' != c) {
+	    break;
+	}
+	q = buf_next_non_white(&dr->buf);
+	if ('"' != q && '\'' != q) {
+	    break;
+	}
+	value_off = dr->buf.tail - dr->buf.pro;
+	while (q != (c = buf_get(&dr->buf)) && '\0' != c) {
+	}
+	if ('\0' == c) {
+	    break;
+	}
+	// The buffer does not move again until the next read so the name and
+	// value can be used in place after terminating the value.
+	name = dr->buf.pro + name_off;
+	if (5 <= name_len && 0 == strncmp("xmlns", name, 5) && (5 == name_len || ':' == name[5])) {
+	    *(dr->buf.tail - 1) = '\0';
+	    if (5 == name_len) {
+		ns_declare(dr, "", 0, dr->buf.pro + value_off, depth);
+	    } else {
+		ns_declare(dr, name + 6, name_len - 6, dr->buf.pro + value_off, depth);
+	    }
+	    *(dr->buf.tail - 1) = q;
+	}
+	c = buf_get(&dr->buf);
+    }
+    buf_reset(&dr->buf);
+}
+
+/* The character after the character after the word is returned. dr->buf.tail is one past that. dr->buf.str will point to the
+ * token which will be '\0' terminated.
+ */
+static char
+read_name_token(SaxDrive dr) {
+    char        c;
+
+    dr->buf.str = dr->buf.tail;
+    c = buf_get(&dr->buf);
+    if (is_white(c)) {
+        c = buf_next_non_white(&dr->buf);
+        dr->buf.str = dr->buf.tail - 1;
+    }
+    while (1) {
+	switch (c) {
+	case ' ':
+	case '\t':
+	case '\f':
+	case '?':
+	case '=':
+	case '/':
+	case '>':
+	case '<':
+	case '\n':
+	case '\r':
+            *(dr->buf.tail - 1) = '\0';
+	    return c;
+	case '\0':
+            /* documents never terminate after a name token */
+            ox_sax_drive_error(dr, NO_TERM "document not terminated");
+            return '\0';
+	case ':':
+	    if ('\0' == *dr->options.strip_ns) {
+		break;
+	    } else if ('*' == *dr->options.strip_ns && '\0' == dr->options.strip_ns[1]) {
+		dr->buf.str = dr->buf.tail;
+	    } else if (0 == strncmp(dr->options.strip_ns, dr->buf.str, dr->buf.tail - dr->buf.str - 1)) {
+		dr->buf.str = dr->buf.tail;
+	    }
+	    break;
+	default:
+	    break;
+	}
+        c = buf_get(&dr->buf);
+    }
+    return '\0';
+}
+
+/* The character after the quote or if there is no quote, the character after the word is returned. dr->buf.tail is one past
+ * that. dr->buf.str will point to the token which will be '\0' terminated.
+ */
+static char
+read_quoted_value(SaxDrive dr) {
+    char	c;
+
+    c = buf_get(&dr->buf);
+    if (is_white(c)) {
+        c = buf_next_non_white(&dr->buf);
+    }
+    if ('"' == c || '\'' == c) {
+	char	term = c;
+
+        dr->buf.str = dr->buf.tail;
+        while (term != (c = buf_get(&dr->buf))) {
+            if ('\0' == c) {
+                ox_sax_drive_error(dr, NO_TERM "quoted value not terminated");
+                return '\0';
+            }
+        }
+	// dr->buf.tail is one past quote char
+	*(dr->buf.tail - 1) = '\0'; /* terminate value */
+	c = buf_get(&dr->buf);
+	return c;
+    }
+    // not quoted, look for something that terminates the string
+    dr->buf.str = dr->buf.tail - 1;
+    ox_sax_drive_error(dr, WRONG_CHAR "attribute value not in quotes");
+    while ('\0' != (c = buf_get(&dr->buf))) {
+	switch (c) {
+	case ' ':
+	    //case '/':
+	case '>':
+	case '?': // for instructions
+	case '\t':
+	case '\n':
+	case '\r':
+	    *(dr->buf.tail - 1) = '\0'; /* terminate value */
+	    // dr->buf.tail is in the correct position, one after the word terminator
+	    return c;
+	default:
+	    break;
+	}
+    }
+    return '\0'; // should never get here
+}
+
+#undef skipBOM
+#undef parse
+#undef read_content
+#undef read_instruction
+#undef read_delimited
+#undef read_doctype
+#undef read_cdata
+#undef read_comment
+#undef read_element_start
+#undef read_element_end
+#undef read_text
+#undef read_jump_term
+#undef read_jump
+#undef read_attrs
+#undef read_ns_decls
+#undef read_name_token
+#undef read_quoted_value
+
+#if !SAX_TRACK_POS
+#undef buf_get
+#undef buf_backup
+#undef buf_next_non_white
+#undef buf_skip_to
+#endif
+#undef SAX_VARIANT
@@ -14,14 +14,25 @@ typedef struct _Nv {
     const char	*name;
     VALUE	val;
     int		childCnt;
+    int		depth;
     Hint	hint;
 } *Nv;
 
+/* An xmlns declaration. The URI is kept by the driver at the same index. */
+typedef struct _NsBind {
+    char	*prefix;	/* empty for the default namespace */
+    int		plen;
+    int		depth;	/* depth of the declaring element */
+} *NsBind;
+
 typedef struct _NStack {
     struct _Nv	base[STACK_INC];
     Nv		head;	/* current stack */
     Nv		end;	/* stack end */
     Nv		tail;	/* pointer to one past last element name on stack */
+    NsBind	ns;	/* namespace declarations in scope */
+    int		ns_cnt;
+    int		ns_size;
 } *NStack;
 
 inline static void
@@ -29,6 +40,14 @@ stack_init(NStack stack) {
     stack->head = stack->base;
     stack->end = stack->base + sizeof(stack->base) / sizeof(struct _Nv);
     stack->tail = stack->head;
+    stack->ns = 0;
+    stack->ns_cnt = 0;
+    stack->ns_size = 0;
+}
+
+inline static int
+stack_depth(NStack stack) {
+    return (int)(stack->tail - stack->head);
 }
 
 inline static int
@@ -36,11 +55,64 @@ stack_empty(NStack stack) {
     return (stack->head == stack->tail);
 }
 
+/* Drops the namespace declarations made by elements at depth or deeper. */
+inline static void
+stack_ns_truncate(NStack stack, int depth) {
+    while (0 < stack->ns_cnt && depth <= stack->ns[stack->ns_cnt - 1].depth) {
+	stack->ns_cnt--;
+	xfree(stack->ns[stack->ns_cnt].prefix);
+    }
+}
+
 inline static void
 stack_cleanup(NStack stack) {
     if (stack->base != stack->head) {
         xfree(stack->head);
     }
+    stack_ns_truncate(stack, 0);
+    if (0 != stack->ns) {
+	xfree(stack->ns);
+    }
+}
+
+/* Returns the index of the new declaration. */
+inline static int
+stack_ns_add(NStack stack, const char *prefix, int plen, int depth) {
+    NsBind	b;
+
+    if (stack->ns_size <= stack->ns_cnt) {
+	stack->ns_size += STACK_INC;
+	if (0 == stack->ns) {
+	    stack->ns = ALLOC_N(struct _NsBind, stack->ns_size);
+	} else {
+	    REALLOC_N(stack->ns, struct _NsBind, stack->ns_size);
+	}
+    }
+    b = stack->ns + stack->ns_cnt;
+    b->prefix = ALLOC_N(char, plen + 1);
+    memcpy(b->prefix, prefix, plen);
+    b->prefix[plen] = '\0';
+    b->plen = plen;
+    b->depth = depth;
+
+    return stack->ns_cnt++;
+}
+
+/* Returns the index of the innermost declaration of the prefix visible to an
+ * element at depth or -1 if there is none.
+ */
+inline static int
+stack_ns_find(NStack stack, const char *prefix, int plen, int depth) {
+    int		i;
+    NsBind	b;
+
+    for (i = stack->ns_cnt - 1; 0 <= i; i--) {
+	b = stack->ns + i;
+	if (b->depth <= depth && b->plen == plen && 0 == strncmp(b->prefix, prefix, plen)) {
+	    return i;
+	}
+    }
+    return -1;
 }
 
 inline static void
@@ -62,6 +134,7 @@ stack_push(NStack stack, const char *name, VALUE val, Hint hint) {
     stack->tail->val = val;
     stack->tail->hint = hint;
     stack->tail->childCnt = 0;
+    stack->tail->depth = (int)(stack->tail - stack->head);
     stack->tail++;
 }
 
@@ -0,0 +1,657 @@
+/* snapshot.c
+ * Copyright (c) 2011, Peter Ohler
+ * All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#if HAS_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#include "ruby.h"
+#include "ox.h"
+
+/* A snapshot is a generic tree, an Ox::Document or Ox::Element, written in a
+ * binary form that is loaded without tokenizing or unescaping any XML.
+ * Integers are unsigned LEB128 varints and strings are a varint length
+ * followed by the bytes. Values are strings with the length shifted up one
+ * bit and the low bit set if the String was ASCII-8BIT. The rest take the
+ * encoding named in the header, the first one seen that was not ASCII-8BIT.
+ *
+ *   header	"OXSNAP" version(byte) flags(byte) encoding-name
+ *   names	count, then kind('s' String or 'y' Symbol) and string for each
+ *   tape	the root node
+ *
+ * Element names and attribute keys are written once in the name table and
+ * referred to by index after that. A node is a type byte followed by:
+ *
+ *   'X' document	flags [attributes] [nodes]
+ *   'E' element	name-index flags [attributes] [nodes]
+ *   'I' instruct	value flags [attributes] [content]
+ *   'T' text		value
+ *   'C' comment, 'D' cdata, 'Y' doctype, 'R' raw	value
+ *
+ * where attributes are a count and then name-index, value pairs and nodes are
+ * a count and then that many nodes. The flags tell which of @attributes,
+ * @nodes, and @content were set so the tree is rebuilt as it was saved. The
+ * file is mapped when loaded and every read is checked against its end.
+ */
+#define SNAP_VERSION	1
+#define MAX_DEPTH	1000
+
+#define HAS_ATTRS	0x01
+#define HAS_NODES	0x02
+#define HAS_CONTENT	0x04
+
+static const char	snap_magic[6] = { 'O', 'X', 'S', 'N', 'A', 'P' };
+
+typedef struct _SaveInfo {
+    VALUE		tape;
+    VALUE		table;
+    VALUE		names;	/* key to index in the name table */
+    long		cnt;
+#if HAS_ENCODING_SUPPORT
+    rb_encoding		*enc;
+#endif
+} *SaveInfo;
+
+typedef struct _Name {
+    const char		*str;
+    long		len;
+    VALUE		sym;	/* Qundef for String keys */
+    int			binary;
+} *Name;
+
+typedef struct _LoadInfo {
+    const char		*path;
+    const char		*start;
+    const char		*cur;
+    const char		*end;
+    size_t		size;
+    Name		names;
+    uint64_t		cnt;
+#if HAS_ENCODING_SUPPORT
+    rb_encoding		*enc;
+#endif
+} *LoadInfo;
+
+static void	save_node(SaveInfo si, VALUE node, int depth);
+static VALUE	load_node(LoadInfo li, int depth);
+
+static void
+put_byte(VALUE out, int b) {
+    char	c = (char)b;
+
+    rb_str_buf_cat(out, &c, 1);
+}
+
+static void
+put_uint(VALUE out, uint64_t n) {
+    char	buf[10];
+    int		i = 0;
+
+    for (; 0x80 <= n; n >>= 7) {
+	buf[i++] = (char)(0x80 | (n & 0x7F));
+    }
+    buf[i++] = (char)n;
+    rb_str_buf_cat(out, buf, i);
+}
+
+static void
+put_str(VALUE out, const char *str, long len) {
+    put_uint(out, (uint64_t)len);
+    rb_str_buf_cat(out, str, len);
+}
+
+static void
+put_tagged(SaveInfo si, VALUE out, VALUE s) {
+    uint64_t	len = (uint64_t)RSTRING_LEN(s) << 1;
+
+#if HAS_ENCODING_SUPPORT
+    rb_encoding	*enc = rb_enc_get(s);
+
+    if (rb_ascii8bit_encoding() == enc) {
+	len |= 1;
+    } else if (0 == si->enc) {
+	si->enc = enc;
+    }
+#endif
+    put_uint(out, len);
+    rb_str_buf_cat(out, RSTRING_PTR(s), RSTRING_LEN(s));
+}
+
+static void
+put_value(SaveInfo si, VALUE s) {
+    if (T_STRING != rb_type(s)) {
+	s = rb_obj_as_string(s);
+    }
+    put_tagged(si, si->tape, s);
+}
+
+static void
+put_name(SaveInfo si, VALUE key) {
+    volatile VALUE	ix = rb_hash_lookup2(si->names, key, Qundef);
+
+    if (Qundef == ix) {
+	if (T_SYMBOL == rb_type(key)) {
+	    const char	*str = rb_id2name(SYM2ID(key));
+
+	    put_byte(si->table, 'y');
+	    put_str(si->table, str, (long)strlen(str));
+	} else {
+	    volatile VALUE	s = (T_STRING == rb_type(key)) ? key : rb_obj_as_string(key);
+
+	    put_byte(si->table, 's');
+	    put_tagged(si, si->table, s);
+	}
+	ix = LONG2NUM(si->cnt);
+	si->cnt++;
+	rb_hash_aset(si->names, key, ix);
+    }
+    put_uint(si->tape, (uint64_t)NUM2LONG(ix));
+}
+
+static int
+save_attr(VALUE key, VALUE value, VALUE arg) {
+    SaveInfo	si = (SaveInfo)arg;
+
+    put_name(si, key);
+    put_value(si, value);
+
+    return ST_CONTINUE;
+}
+
+static void
+save_attrs(SaveInfo si, VALUE attrs) {
+    Check_Type(attrs, T_HASH);
+    put_uint(si->tape, (uint64_t)RHASH_SIZE(attrs));
+    rb_hash_foreach(attrs, save_attr, (VALUE)si);
+}
+
+static void
+save_body(SaveInfo si, VALUE obj, int depth) {
+    volatile VALUE	attrs = rb_attr_get(obj, ox_attributes_id);
+    volatile VALUE	nodes = rb_attr_get(obj, ox_nodes_id);
+    int			flags = 0;
+
+    if (Qnil != attrs) {
+	flags |= HAS_ATTRS;
+    }
+    if (Qnil != nodes) {
+	Check_Type(nodes, T_ARRAY);
+	flags |= HAS_NODES;
+    }
+    put_byte(si->tape, flags);
+    if (HAS_ATTRS & flags) {
+	save_attrs(si, attrs);
+    }
+    if (HAS_NODES & flags) {
+	long	cnt = RARRAY_LEN(nodes);
+	long	i;
+
+	put_uint(si->tape, (uint64_t)cnt);
+	// rb_ary_entry() returns nil if a to_s call shrank the Array which
+	// then raises instead of reading past the end.
+	for (i = 0; i < cnt; i++) {
+	    save_node(si, rb_ary_entry(nodes, i), depth + 1);
+	}
+    }
+}
+
+static void
+save_node(SaveInfo si, VALUE node, int depth) {
+    VALUE	clas = rb_obj_class(node);
+
+    if (MAX_DEPTH < depth) {
+	rb_raise(rb_eSysStackError, "maximum depth exceeded");
+    }
+    if (ox_element_clas == clas) {
+	put_byte(si->tape, 'E');
+	put_name(si, rb_attr_get(node, ox_at_value_id));
+	save_body(si, node, depth);
+    } else if (rb_cString == clas) {
+	put_byte(si->tape, 'T');
+	put_value(si, node);
+    } else if (ox_comment_clas == clas) {
+	put_byte(si->tape, 'C');
+	put_value(si, rb_attr_get(node, ox_at_value_id));
+    } else if (ox_cdata_clas == clas) {
+	put_byte(si->tape, 'D');
+	put_value(si, rb_attr_get(node, ox_at_value_id));
+    } else if (ox_doctype_clas == clas) {
+	put_byte(si->tape, 'Y');
+	put_value(si, rb_attr_get(node, ox_at_value_id));
+    } else if (ox_raw_clas == clas) {
+	put_byte(si->tape, 'R');
+	put_value(si, rb_attr_get(node, ox_at_value_id));
+    } else if (ox_instruct_clas == clas) {
+	volatile VALUE	attrs = rb_attr_get(node, ox_attributes_id);
+	volatile VALUE	content = rb_attr_get(node, ox_at_content_id);
+	int		flags = 0;
+
+	put_byte(si->tape, 'I');
+	put_value(si, rb_attr_get(node, ox_at_value_id));
+	if (Qnil != attrs) {
+	    flags |= HAS_ATTRS;
+	}
+	if (Qnil != content) {
+	    flags |= HAS_CONTENT;
+	}
+	put_byte(si->tape, flags);
+	if (HAS_ATTRS & flags) {
+	    save_attrs(si, attrs);
+	}
+	if (HAS_CONTENT & flags) {
+	    put_value(si, content);
+	}
+    } else if (ox_document_clas == clas && 0 == depth) {
+	put_byte(si->tape, 'X');
+	save_body(si, node, depth);
+    } else {
+	rb_raise(rb_eTypeError, "Unexpected class, %s, while saving a snapshot.\n", rb_class2name(clas));
+    }
+}
+
+void
+ox_snapshot_save(VALUE obj, const char *path) {
+    struct _SaveInfo	si;
+    volatile VALUE	head = rb_str_buf_new(64);
+    const char		*enc_name = "";
+    FILE		*f;
+    int			ok;
+
+    si.tape = rb_str_buf_new(0x10000);
+    si.table = rb_str_buf_new(0x1000);
+    si.names = rb_hash_new();
+    si.cnt = 0;
+#if HAS_ENCODING_SUPPORT
+    si.enc = 0;
+#endif
+    save_node(&si, obj, 0);
+
+#if HAS_ENCODING_SUPPORT
+    if (0 != si.enc) {
+	enc_name = rb_enc_name(si.enc);
+    }
+#endif
+    rb_str_buf_cat(head, snap_magic, sizeof(snap_magic));
+    put_byte(head, SNAP_VERSION);
+    put_byte(head, 0);
+    put_str(head, enc_name, (long)strlen(enc_name));
+    put_uint(head, (uint64_t)si.cnt);
+
+    if (0 == (f = fopen(path, "wb"))) {
+	rb_raise(rb_eIOError, "%s\n", strerror(errno));
+    }
+    ok = ((size_t)RSTRING_LEN(head) == fwrite(RSTRING_PTR(head), 1, RSTRING_LEN(head), f) &&
+	  (size_t)RSTRING_LEN(si.table) == fwrite(RSTRING_PTR(si.table), 1, RSTRING_LEN(si.table), f) &&
+	  (size_t)RSTRING_LEN(si.tape) == fwrite(RSTRING_PTR(si.tape), 1, RSTRING_LEN(si.tape), f));
+    if (0 != fclose(f)) {
+	ok = 0;
+    }
+    if (!ok) {
+	rb_raise(rb_eIOError, "Failed to write snapshot %s.\n", path);
+    }
+    RB_GC_GUARD(si.tape);
+    RB_GC_GUARD(si.table);
+    RB_GC_GUARD(si.names);
+}
+
+static void
+load_error(LoadInfo li, const char *msg) {
+    rb_raise(ox_parse_error_class, "%s at offset %ld of snapshot %s.\n", msg, (long)(li->cur - li->start), li->path);
+}
+
+static int
+get_byte(LoadInfo li) {
+    if (li->end <= li->cur) {
+	load_error(li, "Unexpected end");
+    }
+    return *(const uint8_t*)li->cur++;
+}
+
+static uint64_t
+get_uint(LoadInfo li) {
+    uint64_t	n = 0;
+    int		shift = 0;
+
+    for (; li->cur < li->end && shift < 64; li->cur++, shift += 7) {
+	uint8_t	b = *(const uint8_t*)li->cur;
+
+	n |= (uint64_t)(b & 0x7F) << shift;
+	if (0 == (0x80 & b)) {
+	    li->cur++;
+	    return n;
+	}
+    }
+    load_error(li, "Invalid number");
+
+    return 0;
+}
+
+/* Counts are checked against the bytes left so a damaged file can not ask
+ * for a huge allocation. Every entry takes at least one byte.
+ */
+static long
+get_count(LoadInfo li) {
+    uint64_t	cnt = get_uint(li);
+
+    if ((uint64_t)(li->end - li->cur) < cnt) {
+	load_error(li, "Count too large");
+    }
+    return (long)cnt;
+}
+
+static const char*
+get_str(LoadInfo li, long *lenp) {
+    const char	*str;
+    long	len = get_count(li);
+
+    str = li->cur;
+    li->cur += len;
+    *lenp = len;
+
+    return str;
+}
+
+static VALUE
+new_str(LoadInfo li, const char *str, long len, int binary) {
+#if HAS_ENCODING_SUPPORT
+    if (0 != li->enc && !binary) {
+	return rb_enc_str_new(str, len, li->enc);
+    }
+#endif
+    return rb_str_new(str, len);
+}
+
+static const char*
+get_tagged(LoadInfo li, long *lenp, int *binaryp) {
+    const char	*str;
+    uint64_t	tag = get_uint(li);
+    long	len = (long)(tag >> 1);
+
+    if ((uint64_t)(li->end - li->cur) < (tag >> 1)) {
+	load_error(li, "String too long");
+    }
+    str = li->cur;
+    li->cur += len;
+    *lenp = len;
+    *binaryp = (int)(tag & 1);
+
+    return str;
+}
+
+static VALUE
+get_value(LoadInfo li) {
+    long	len;
+    int		binary;
+    const char	*str = get_tagged(li, &len, &binary);
+
+    return new_str(li, str, len, binary);
+}
+
+static VALUE
+get_name(LoadInfo li) {
+    uint64_t	ix = get_uint(li);
+    Name	n;
+
+    if (li->cnt <= ix) {
+	load_error(li, "Invalid name index");
+    }
+    n = li->names + ix;
+    if (Qundef != n->sym) {
+	return n->sym;
+    }
+    return new_str(li, n->str, n->len, n->binary);
+}
+
+static void
+load_attrs(LoadInfo li, VALUE obj) {
+    long		cnt = get_count(li);
+    volatile VALUE	ah = rb_hash_new();
+
+    rb_ivar_set(obj, ox_attributes_id, ah);
+    for (; 0 < cnt; cnt--) {
+	volatile VALUE	key = get_name(li);
+
+	rb_hash_aset(ah, key, get_value(li));
+    }
+}
+
+static void
+load_body(LoadInfo li, VALUE obj, int depth) {
+    int	flags = get_byte(li);
+
+    if (HAS_ATTRS & flags) {
+	load_attrs(li, obj);
+    }
+    if (HAS_NODES & flags) {
+	long		cnt = get_count(li);
+	volatile VALUE	nodes = rb_ary_new2(cnt);
+
+	rb_ivar_set(obj, ox_nodes_id, nodes);
+	for (; 0 < cnt; cnt--) {
+	    rb_ary_push(nodes, load_node(li, depth + 1));
+	}
+    }
+}
+
+static VALUE
+load_value_node(LoadInfo li, VALUE clas) {
+    volatile VALUE	node = rb_obj_alloc(clas);
+
+    rb_ivar_set(node, ox_at_value_id, get_value(li));
+
+    return node;
+}
+
+static VALUE
+load_node(LoadInfo li, int depth) {
+    volatile VALUE	node = Qnil;
+    int			flags;
+
+    if (MAX_DEPTH < depth) {
+	load_error(li, "Nodes nested too deeply");
+    }
+    switch (get_byte(li)) {
+    case 'E':
+	node = rb_obj_alloc(ox_element_clas);
+	rb_ivar_set(node, ox_at_value_id, get_name(li));
+	load_body(li, node, depth);
+	break;
+    case 'T':
+	node = get_value(li);
+	break;
+    case 'C':
+	node = load_value_node(li, ox_comment_clas);
+	break;
+    case 'D':
+	node = load_value_node(li, ox_cdata_clas);
+	break;
+    case 'Y':
+	node = load_value_node(li, ox_doctype_clas);
+	break;
+    case 'R':
+	node = load_value_node(li, ox_raw_clas);
+	break;
+    case 'I':
+	node = load_value_node(li, ox_instruct_clas);
+	flags = get_byte(li);
+	if (HAS_ATTRS & flags) {
+	    load_attrs(li, node);
+	}
+	if (HAS_CONTENT & flags) {
+	    rb_ivar_set(node, ox_at_content_id, get_value(li));
+	}
+	break;
+    case 'X':
+	if (0 != depth) {
+	    load_error(li, "Document not at the top");
+	}
+	node = rb_obj_alloc(ox_document_clas);
+	load_body(li, node, depth);
+	break;
+    default:
+	li->cur--;
+	load_error(li, "Unknown node type");
+	break;
+    }
+    return node;
+}
+
+/* Interned IDs are never collected so the Symbols need no marking. Bytes
+ * that are not valid in the encoding would make rb_intern3() raise an
+ * EncodingError so they are reported as a damaged snapshot instead.
+ */
+static VALUE
+get_sym(LoadInfo li, const char *str, long len) {
+#if HAS_ENCODING_SUPPORT
+    rb_encoding		*enc = (0 == li->enc) ? rb_usascii_encoding() : li->enc;
+    volatile VALUE	s = rb_enc_str_new(str, len, enc);
+
+    if (ENC_CODERANGE_BROKEN == rb_enc_str_coderange(s)) {
+	load_error(li, "Invalid symbol name");
+    }
+    return ID2SYM(rb_intern_str(s));
+#else
+    return ID2SYM(rb_intern2(str, len));
+#endif
+}
+
+static VALUE
+load_snapshot(VALUE arg) {
+    LoadInfo	li = (LoadInfo)arg;
+    const char	*str;
+    long	len;
+    uint64_t	i;
+    int		version;
+
+    if (li->size < sizeof(snap_magic) + 2 || 0 != memcmp(li->start, snap_magic, sizeof(snap_magic))) {
+	rb_raise(ox_parse_error_class, "%s is not an Ox snapshot.\n", li->path);
+    }
+    li->cur += sizeof(snap_magic);
+    if (SNAP_VERSION != (version = get_byte(li))) {
+	rb_raise(ox_parse_error_class, "Snapshot version %d of %s is not supported.\n", version, li->path);
+    }
+    get_byte(li); // flags, none yet
+    str = get_str(li, &len);
+#if HAS_ENCODING_SUPPORT
+    if (0 < len) {
+	char	name[64];
+
+	if ((long)sizeof(name) <= len) {
+	    load_error(li, "Encoding name too long");
+	}
+	memcpy(name, str, len);
+	name[len] = '\0';
+	li->enc = rb_enc_find(name);
+    }
+#endif
+    li->cnt = (uint64_t)get_count(li);
+    li->names = ALLOC_N(struct _Name, li->cnt);
+    for (i = 0; i < li->cnt; i++) {
+	Name	n = li->names + i;
+	switch (get_byte(li)) {
+	case 's':
+	    n->str = get_tagged(li, &n->len, &n->binary);
+	    n->sym = Qundef;
+	    break;
+	case 'y':
+	    n->str = get_str(li, &n->len);
+	    n->binary = 0;
+	    n->sym = get_sym(li, n->str, n->len);
+	    break;
+	default:
+	    li->cnt = i;
+	    load_error(li, "Unknown name kind");
+	    break;
+	}
+    }
+    return load_node(li, 0);
+}
+
+static VALUE
+load_cleanup(VALUE arg) {
+    LoadInfo	li = (LoadInfo)arg;
+
+    if (0 != li->names) {
+	xfree(li->names);
+    }
+#if HAS_MMAP
+    munmap((void*)li->start, li->size);
+#else
+    xfree((char*)li->start);
+#endif
+    return Qnil;
+}
+
+VALUE
+ox_snapshot_load(const char *path) {
+    struct _LoadInfo	li;
+    volatile VALUE	obj;
+
+    memset(&li, 0, sizeof(li));
+    li.path = path;
+#if HAS_MMAP
+    {
+	struct stat	st;
+	void		*map;
+	int		fd;
+
+	if (0 > (fd = open(path, O_RDONLY))) {
+	    rb_raise(rb_eIOError, "%s\n", strerror(errno));
+	}
+	if (0 != fstat(fd, &st)) {
+	    close(fd);
+	    rb_raise(rb_eIOError, "%s\n", strerror(errno));
+	}
+	if ((off_t)(sizeof(snap_magic) + 2) > st.st_size) {
+	    close(fd);
+	    rb_raise(ox_parse_error_class, "%s is not an Ox snapshot.\n", path);
+	}
+	li.size = (size_t)st.st_size;
+	map = mmap(0, li.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map) {
+	    rb_raise(rb_eIOError, "%s\n", strerror(errno));
+	}
+	li.start = (const char*)map;
+    }
+#else
+    {
+	FILE	*f;
+	char	*data;
+	long	len;
+
+	if (0 == (f = fopen(path, "rb"))) {
+	    rb_raise(rb_eIOError, "%s\n", strerror(errno));
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = ALLOC_N(char, len + 1);
+	if ((size_t)len != fread(data, 1, len, f)) {
+	    fclose(f);
+	    xfree(data);
+	    rb_raise(rb_eIOError, "Failed to read %ld bytes from %s.\n", len, path);
+	}
+	fclose(f);
+	li.size = (size_t)len;
+	li.start = data;
+    }
+#endif
+    li.cur = li.start;
+    li.end = li.start + li.size;
+    obj = rb_ensure(load_snapshot, (VALUE)&li, load_cleanup, (VALUE)&li);
+    if (li.cur != li.end) {
+	rb_raise(ox_parse_error_class, "Unexpected data after the root of snapshot %s.\n", path);
+    }
+    return obj;
+}
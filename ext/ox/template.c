@@ -0,0 +1,459 @@
+/* template.c
+ * Copyright (c) 2011, 2016 Peter Ohler
+ * All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ox.h"
+#include "buf.h"
+#include "dbl.h"
+
+#define MAX_DEPTH	64
+
+typedef enum {
+    TextOp	= 't',
+    ValueOp	= 'v',
+    RawOp	= 'r',
+    LoopOp	= 'l',
+    EndOp	= 'e',
+} OpType;
+
+typedef struct _Op {
+    OpType	type;
+    long	start;	/* TextOp offset into the static text */
+    long	len;	/* TextOp length */
+    long	index;	/* index in an Array scope or -1 if the name is not an integer */
+    long	end;	/* LoopOp index of the matching EndOp */
+    ID		id;	/* method called on a scope that is not a Hash or Array */
+    VALUE	sym;	/* Hash key tried first */
+    VALUE	str;	/* Hash key tried if there is no Symbol key */
+} *Op;
+
+typedef struct _Template {
+    char	*text;	/* static text runs back to back */
+    Op		ops;
+    long	cnt;
+    int		depth;	/* deepest nesting of repeat blocks */
+    long	size;	/* largest render so far, used to size the next buffer */
+#if HAS_ENCODING_SUPPORT
+    rb_encoding	*encoding;
+#endif
+} *Template;
+
+static VALUE	template_class = Qundef;
+
+inline static int
+is_white(char c) {
+    switch (c) {
+    case ' ':
+    case '\t':
+    case '\f':
+    case '\n':
+    case '\r':
+	return 1;
+    default:
+	return 0;
+    }
+}
+
+static void
+template_mark(void *ptr) {
+    Template	t = (Template)ptr;
+    Op		op;
+    Op		end;
+
+    if (0 == t) {
+	return;
+    }
+    for (op = t->ops, end = op + t->cnt; op < end; op++) {
+	if (TextOp != op->type) {
+	    rb_gc_mark(op->sym);
+	    rb_gc_mark(op->str);
+	}
+    }
+}
+
+static void
+template_free(void *ptr) {
+    Template	t = (Template)ptr;
+
+    if (0 == t) {
+	return;
+    }
+    xfree(t->text);
+    xfree(t->ops);
+    xfree(t);
+}
+
+static Op
+add_op(Template t, long *sizep, OpType type) {
+    Op	op;
+
+    if (*sizep <= t->cnt) {
+	*sizep *= 2;
+	REALLOC_N(t->ops, struct _Op, *sizep);
+    }
+    op = t->ops + t->cnt;
+    t->cnt++;
+    memset(op, 0, sizeof(struct _Op));
+    op->type = type;
+    op->index = -1;
+    op->sym = Qnil;
+    op->str = Qnil;
+
+    return op;
+}
+
+static void
+set_name(Op op, const char *name, long len) {
+    const char	*s;
+
+    op->str = rb_str_new(name, len);
+    rb_obj_freeze(op->str);
+    op->id = rb_intern2(name, len);
+    op->sym = ID2SYM(op->id);
+    for (s = name; s < name + len && '0' <= *s && *s <= '9'; s++) {
+    }
+    if (s == name + len) {
+	op->index = strtol(name, 0, 10);
+    }
+}
+
+/* Splits the template into static text and placeholders. Nothing in the
+ * static text needs escaping since it is already XML.
+ */
+static void
+compile(Template t, const char *src, long len) {
+    const char	*end = src + len;
+    const char	*s = src;
+    const char	*start;
+    char	*text = t->text;
+    long	size = 16;
+    long	stack[MAX_DEPTH];
+    int		depth = 0;
+    Op		op;
+
+    t->ops = ALLOC_N(struct _Op, size);
+    while (s < end) {
+	const char	*ph = s;
+	const char	*close;
+	const char	*name;
+	long		nlen;
+	OpType		type = ValueOp;
+
+	while (ph + 1 < end && !('{' == *ph && '{' == ph[1])) {
+	    ph++;
+	}
+	if (ph + 1 >= end) {
+	    ph = end;
+	}
+	if (s < ph) {
+	    op = add_op(t, &size, TextOp);
+	    op->start = text - t->text;
+	    op->len = ph - s;
+	    memcpy(text, s, op->len);
+	    text += op->len;
+	}
+	if (end <= ph) {
+	    break;
+	}
+	start = ph;
+	for (close = ph + 2; close + 1 < end && !('}' == *close && '}' == close[1]); close++) {
+	}
+	if (close + 1 >= end) {
+	    rb_raise(ox_parse_error_class, "Placeholder not terminated at offset %ld.\n", (long)(start - src));
+	}
+	name = ph + 2;
+	switch (*name) {
+	case '&': type = RawOp; name++; break;
+	case '#': type = LoopOp; name++; break;
+	case '/': type = EndOp; name++; break;
+	default: break;
+	}
+	for (; name < close && is_white(*name); name++) {
+	}
+	for (nlen = close - name; 0 < nlen && is_white(name[nlen - 1]); nlen--) {
+	}
+	if (0 == nlen) {
+	    rb_raise(ox_parse_error_class, "Empty placeholder at offset %ld.\n", (long)(start - src));
+	}
+	op = add_op(t, &size, type);
+	set_name(op, name, nlen);
+	if (LoopOp == type) {
+	    if (MAX_DEPTH <= depth) {
+		rb_raise(ox_parse_error_class, "Too many nested repeat blocks at offset %ld.\n", (long)(start - src));
+	    }
+	    stack[depth++] = t->cnt - 1;
+	    if (t->depth < depth) {
+		t->depth = depth;
+	    }
+	} else if (EndOp == type) {
+	    Op	open;
+
+	    if (0 == depth) {
+		rb_raise(ox_parse_error_class, "Unexpected end of block '%.*s' at offset %ld.\n", (int)nlen, name, (long)(start - src));
+	    }
+	    open = t->ops + stack[--depth];
+	    if (0 != rb_str_cmp(open->str, op->str)) {
+		rb_raise(ox_parse_error_class, "Block '%s' closed by '%.*s' at offset %ld.\n",
+			 StringValuePtr(open->str), (int)nlen, name, (long)(start - src));
+	    }
+	    open->end = t->cnt - 1;
+	}
+	s = close + 2;
+    }
+    if (0 < depth) {
+	rb_raise(ox_parse_error_class, "Block '%s' not closed.\n", StringValuePtr(t->ops[stack[depth - 1]].str));
+    }
+}
+
+static VALUE
+lookup(Op op, VALUE *scopes, int depth) {
+    VALUE	v;
+
+    if ('.' == *RSTRING_PTR(op->str) && 1 == RSTRING_LEN(op->str)) {
+	return scopes[depth];
+    }
+    for (; 0 <= depth; depth--) {
+	VALUE	scope = scopes[depth];
+
+	switch (rb_type(scope)) {
+	case T_HASH:
+	    if (Qundef != (v = rb_hash_lookup2(scope, op->sym, Qundef)) ||
+		Qundef != (v = rb_hash_lookup2(scope, op->str, Qundef))) {
+		return v;
+	    }
+	    break;
+	case T_ARRAY:
+	    if (0 <= op->index && op->index < RARRAY_LEN(scope)) {
+		return rb_ary_entry(scope, op->index);
+	    }
+	    break;
+	case T_NIL:
+	    break;
+	default:
+	    if (rb_respond_to(scope, op->id)) {
+		return rb_funcall(scope, op->id, 0);
+	    }
+	    break;
+	}
+    }
+    return Qnil;
+}
+
+static void
+append_value(Buf buf, VALUE v, bool escape) {
+    const char	*s;
+    long	len;
+    size_t	used;
+    char	num[DBL_BUF_SIZE];
+
+    switch (rb_type(v)) {
+    case T_NIL:
+	return;
+    case T_STRING:
+	s = RSTRING_PTR(v);
+	len = RSTRING_LEN(v);
+	break;
+    case T_SYMBOL:
+	v = rb_sym2str(v);
+	s = RSTRING_PTR(v);
+	len = RSTRING_LEN(v);
+	break;
+    case T_FIXNUM:
+	len = snprintf(num, sizeof(num), "%ld", FIX2LONG(v));
+	buf_append_string(buf, num, len);
+	return;
+    case T_FLOAT:
+	len = ox_dbl_fmt(RFLOAT_VALUE(v), num, 1);
+	buf_append_string(buf, num, len);
+	return;
+    case T_TRUE:
+	buf_append_string(buf, "true", 4);
+	return;
+    case T_FALSE:
+	buf_append_string(buf, "false", 5);
+	return;
+    default:
+	v = rb_obj_as_string(v);
+	s = RSTRING_PTR(v);
+	len = RSTRING_LEN(v);
+	break;
+    }
+    if (escape) {
+	buf_append_xml(buf, s, len, &used);
+    } else {
+	buf_append_string(buf, s, len);
+    }
+    RB_GC_GUARD(v);
+}
+
+static void
+render(Template t, Buf buf, long first, long last, VALUE *scopes, int depth) {
+    Op	op;
+    Op	end = t->ops + last;
+
+    for (op = t->ops + first; op < end; op++) {
+	switch (op->type) {
+	case TextOp:
+	    buf_append_string(buf, t->text + op->start, op->len);
+	    break;
+	case ValueOp:
+	    append_value(buf, lookup(op, scopes, depth), true);
+	    break;
+	case RawOp:
+	    append_value(buf, lookup(op, scopes, depth), false);
+	    break;
+	case LoopOp:
+	{
+	    volatile VALUE	v = lookup(op, scopes, depth);
+	    long		body = op - t->ops + 1;
+
+	    switch (rb_type(v)) {
+	    case T_NIL:
+	    case T_FALSE:
+		break;
+	    case T_ARRAY:
+	    {
+		long	i;
+
+		for (i = 0; i < RARRAY_LEN(v); i++) {
+		    scopes[depth + 1] = rb_ary_entry(v, i);
+		    render(t, buf, body, op->end, scopes, depth + 1);
+		}
+		break;
+	    }
+	    default:
+		scopes[depth + 1] = v;
+		render(t, buf, body, op->end, scopes, depth + 1);
+		break;
+	    }
+	    op = t->ops + op->end;
+	    break;
+	}
+	case EndOp:
+	default:
+	    break;
+	}
+    }
+}
+
+/* call-seq: compile(xml)
+ *
+ * Compiles an XML string with placeholders into a Template that can be
+ * rendered many times without building a document for each render. The
+ * static parts are copied as is.
+ *
+ * - +{{name}}+ is replaced by the value of +name+ with XML special characters escaped
+ * - +{{&name}}+ is replaced by the value of +name+ without escaping
+ * - +{{#name}}+ ... +{{/name}}+ is rendered once for each element if the value
+ *   is an Array, not at all if it is nil or false, and once otherwise
+ * - +{{.}}+ is the current element of a repeat block
+ *
+ * A +name+ is looked up as a Symbol and then a String key in a Hash, as an
+ * index in an Array, or as a method on any other object. If not found in a
+ * repeat block element the enclosing values are searched. Missing values
+ * render as empty strings.
+ *
+ * - +xml+ [String] template source
+ *
+ * *return* [Ox::Template]
+ */
+static VALUE
+template_compile(VALUE self, VALUE src) {
+    Template		t;
+    volatile VALUE	rt;
+
+    Check_Type(src, T_STRING);
+    t = ALLOC(struct _Template);
+    t->text = 0;
+    t->ops = 0;
+    t->cnt = 0;
+    t->depth = 0;
+    t->size = 0;
+#if HAS_ENCODING_SUPPORT
+    t->encoding = rb_enc_get(src);
+#endif
+    rt = Data_Wrap_Struct(template_class, template_mark, template_free, t);
+    t->text = ALLOC_N(char, RSTRING_LEN(src) + 1);
+    compile(t, RSTRING_PTR(src), RSTRING_LEN(src));
+
+    return rt;
+}
+
+typedef struct _RenderArgs {
+    Template	t;
+    Buf		buf;
+    VALUE	*scopes;
+} *RenderArgs;
+
+static VALUE
+render_body(VALUE a) {
+    RenderArgs		args = (RenderArgs)a;
+    Template		t = args->t;
+    volatile VALUE	rstr;
+    long		len;
+
+    render(t, args->buf, 0, t->cnt, args->scopes, 0);
+    len = buf_len(args->buf);
+    rstr = rb_str_new(args->buf->head, len);
+    if (t->size < len) {
+	t->size = len;
+    }
+#if HAS_ENCODING_SUPPORT
+    rb_enc_associate(rstr, t->encoding);
+#endif
+    return rstr;
+}
+
+/* A value or its to_s can raise so the buffer is released in an ensure once
+ * it has moved to the heap.
+ */
+static VALUE
+render_cleanup(VALUE buf) {
+    buf_cleanup((Buf)buf);
+
+    return Qnil;
+}
+
+/* call-seq: render(values)
+ *
+ * Renders the template by filling in the placeholders from +values+.
+ *
+ * - +values+ [Hash|Array|Object] values for the placeholders
+ *
+ * *return* [String]
+ */
+static VALUE
+template_render(VALUE self, VALUE values) {
+    Template		t = (Template)DATA_PTR(self);
+    struct _Buf		buf;
+    struct _RenderArgs	args;
+    VALUE		*scopes = ALLOCA_N(VALUE, t->depth + 1);
+
+    *scopes = values;
+    buf_init(&buf, 0, t->size + 1);
+    args.t = t;
+    args.buf = &buf;
+    args.scopes = scopes;
+
+    return rb_ensure(render_body, (VALUE)&args, render_cleanup, (VALUE)&buf);
+}
+
+/*
+ * Document-class: Ox::Template
+ *
+ * An XML template compiled once and rendered many times.
+ */
+void ox_init_template(VALUE ox) {
+#if 0
+    ox = rb_define_module("Ox");
+#endif
+    template_class = rb_define_class_under(ox, "Template", rb_cObject);
+    rb_undef_alloc_func(template_class);
+    rb_define_singleton_method(template_class, "compile", template_compile, 1);
+    rb_define_method(template_class, "render", template_render, 1);
+}
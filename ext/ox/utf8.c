@@ -0,0 +1,498 @@
+/* utf8.c
+ * Copyright (c) 2011, Peter Ohler
+ * All rights reserved.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "utf8.h"
+
+typedef unsigned char	uchar;
+
+/* On x86-64 validation is done 16 or 32 bytes at a time with SSSE3 or AVX2
+ * using the nibble lookup method of Keiser and Lemire. Each byte is checked
+ * against the one, two, and three bytes before it so a block only needs the
+ * block before it. Blocks of ASCII are skipped with a single test. When a
+ * block has an error, or at the end, the scalar loop takes over from the
+ * start of the sequence that was being checked and finds the exact position.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define UTF8_X86	1
+#include <immintrin.h>
+#else
+#define UTF8_X86	0
+#endif
+
+#if UTF8_X86
+#define TOO_SHORT	0x01	/* lead byte followed by a lead or ASCII */
+#define TOO_LONG	0x02	/* ASCII followed by a continuation */
+#define OVERLONG_3	0x04
+#define TOO_LARGE	0x08
+#define SURROGATE	0x10
+#define OVERLONG_2	0x20
+#define TOO_LARGE_1000	0x40
+#define OVERLONG_4	0x40
+#define TWO_CONTS	0x80	/* two continuations, an error unless in a 3 or 4 byte sequence */
+#define CARRY		(TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define BYTE_1_HIGH \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    (char)TWO_CONTS, (char)TWO_CONTS, (char)TWO_CONTS, (char)TWO_CONTS, \
+    TOO_SHORT | OVERLONG_2, \
+    TOO_SHORT, \
+    TOO_SHORT | OVERLONG_3 | SURROGATE, \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW \
+    (char)(CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4), \
+    (char)(CARRY | OVERLONG_2), \
+    (char)CARRY, \
+    (char)CARRY, \
+    (char)(CARRY | TOO_LARGE), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000), \
+    (char)(CARRY | TOO_LARGE | TOO_LARGE_1000)
+
+#define BYTE_2_HIGH \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    (char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4), \
+    (char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE), \
+    (char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE), \
+    (char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE), \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+static int	simd_level = -1;
+
+static int
+get_simd_level(void) {
+    if (0 > simd_level) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+	    simd_level = 2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+	    simd_level = 1;
+	} else {
+	    simd_level = 0;
+	}
+    }
+    return simd_level;
+}
+
+/* Returns the offset of the first block with an error or of the end of the
+ * last whole block.
+ */
+__attribute__((target("ssse3")))
+static size_t
+valid_ssse3(const uchar *str, size_t len) {
+    const __m128i	b1_high = _mm_setr_epi8(BYTE_1_HIGH);
+    const __m128i	b1_low = _mm_setr_epi8(BYTE_1_LOW);
+    const __m128i	b2_high = _mm_setr_epi8(BYTE_2_HIGH);
+    const __m128i	nib = _mm_set1_epi8(0x0F);
+    const __m128i	zero = _mm_setzero_si128();
+    // A lead byte in the last 3 that needs more than is left.
+    const __m128i	max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+					    (char)0xEF, (char)0xDF, (char)0xBF);
+    __m128i		prev = zero;
+    __m128i		incomplete = zero;
+    __m128i		err;
+    size_t		i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	__m128i	in = _mm_loadu_si128((const __m128i*)(str + i));
+
+	if (0 == _mm_movemask_epi8(in)) {
+	    err = incomplete;
+	    incomplete = zero;
+	} else {
+	    __m128i	prev1 = _mm_alignr_epi8(in, prev, 15);
+	    __m128i	prev2 = _mm_alignr_epi8(in, prev, 14);
+	    __m128i	prev3 = _mm_alignr_epi8(in, prev, 13);
+	    __m128i	sc;
+	    __m128i	must23;
+
+	    sc = _mm_and_si128(_mm_shuffle_epi8(b1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nib)),
+			       _mm_shuffle_epi8(b1_low, _mm_and_si128(prev1, nib)));
+	    sc = _mm_and_si128(sc, _mm_shuffle_epi8(b2_high, _mm_and_si128(_mm_srli_epi16(in, 4), nib)));
+	    must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0x60)), _mm_subs_epu8(prev3, _mm_set1_epi8(0x70)));
+	    err = _mm_xor_si128(_mm_and_si128(must23, _mm_set1_epi8((char)0x80)), sc);
+	    incomplete = _mm_subs_epu8(in, max);
+	}
+	if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(err, zero))) {
+	    break;
+	}
+	prev = in;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+valid_avx2(const uchar *str, size_t len) {
+    const __m256i	b1_high = _mm256_broadcastsi128_si256(_mm_setr_epi8(BYTE_1_HIGH));
+    const __m256i	b1_low = _mm256_broadcastsi128_si256(_mm_setr_epi8(BYTE_1_LOW));
+    const __m256i	b2_high = _mm256_broadcastsi128_si256(_mm_setr_epi8(BYTE_2_HIGH));
+    const __m256i	nib = _mm256_set1_epi8(0x0F);
+    const __m256i	zero = _mm256_setzero_si256();
+    const __m256i	max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+					       -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+					       (char)0xEF, (char)0xDF, (char)0xBF);
+    __m256i		prev = zero;
+    __m256i		incomplete = zero;
+    __m256i		err;
+    size_t		i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	__m256i	in = _mm256_loadu_si256((const __m256i*)(str + i));
+
+	if (0 == _mm256_movemask_epi8(in)) {
+	    err = incomplete;
+	    incomplete = zero;
+	} else {
+	    // The high lane of prev followed by the low lane of in.
+	    __m256i	shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+	    __m256i	prev1 = _mm256_alignr_epi8(in, shifted, 15);
+	    __m256i	prev2 = _mm256_alignr_epi8(in, shifted, 14);
+	    __m256i	prev3 = _mm256_alignr_epi8(in, shifted, 13);
+	    __m256i	sc;
+	    __m256i	must23;
+
+	    sc = _mm256_and_si256(_mm256_shuffle_epi8(b1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nib)),
+				  _mm256_shuffle_epi8(b1_low, _mm256_and_si256(prev1, nib)));
+	    sc = _mm256_and_si256(sc, _mm256_shuffle_epi8(b2_high, _mm256_and_si256(_mm256_srli_epi16(in, 4), nib)));
+	    must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(0x60)),
+				     _mm256_subs_epu8(prev3, _mm256_set1_epi8(0x70)));
+	    err = _mm256_xor_si256(_mm256_and_si256(must23, _mm256_set1_epi8((char)0x80)), sc);
+	    incomplete = _mm256_subs_epu8(in, max);
+	}
+	if (!_mm256_testz_si256(err, err)) {
+	    break;
+	}
+	prev = in;
+    }
+    return i;
+}
+#endif
+
+int
+ox_utf8_seq(const char *str, const char *end) {
+    const uchar	*s = (const uchar*)str;
+    uchar	c = *s;
+    uchar	lo = 0x80;
+    uchar	hi = 0xBF;
+    int		n;
+    int		i;
+
+    if (0x80 > c) {
+	return 1;
+    }
+    if (0xC2 > c) {
+	return -1;
+    }
+    if (0xE0 > c) {
+	n = 2;
+    } else if (0xF0 > c) {
+	n = 3;
+	if (0xE0 == c) {
+	    lo = 0xA0; // overlong
+	} else if (0xED == c) {
+	    hi = 0x9F; // surrogates
+	}
+    } else if (0xF5 > c) {
+	n = 4;
+	if (0xF0 == c) {
+	    lo = 0x90; // overlong
+	} else if (0xF4 == c) {
+	    hi = 0x8F; // past U+10FFFF
+	}
+    } else {
+	return -1;
+    }
+    for (i = 1; i < n; i++) {
+	if ((const uchar*)end <= s + i) {
+	    return 0;
+	}
+	if (s[i] < lo || hi < s[i]) {
+	    return -i;
+	}
+	lo = 0x80;
+	hi = 0xBF;
+    }
+    return n;
+}
+
+size_t
+ox_utf8_valid_len(const char *str, size_t len) {
+    const char	*s = str;
+    const char	*end = str + len;
+    int		n;
+
+#if UTF8_X86
+    if (32 <= len) {
+	size_t	done = 0;
+	int	i;
+
+	switch (get_simd_level()) {
+	case 2:	done = valid_avx2((const uchar*)str, len);	break;
+	case 1:	done = valid_ssse3((const uchar*)str, len);	break;
+	default:						break;
+	}
+	// Back up to the lead byte of a sequence that crosses the block edge.
+	for (i = 1; i <= 3 && (size_t)i <= done; i++) {
+	    uchar	c = (uchar)str[done - i];
+
+	    if (0xC0 <= c) {
+		done -= i;
+		break;
+	    }
+	    if (0x80 > c) {
+		break;
+	    }
+	}
+	s += done;
+    }
+#endif
+    while (s < end) {
+	if (0 == (0x80 & *s)) {
+	    // Check a word at a time while it is all ASCII.
+	    while (s + 8 <= end) {
+		uint64_t	w;
+
+		memcpy(&w, s, sizeof(w));
+		if (0 != (w & 0x8080808080808080ULL)) {
+		    break;
+		}
+		s += 8;
+	    }
+	    for (; s < end && 0 == (0x80 & *s); s++) {
+	    }
+	    continue;
+	}
+	if (0 >= (n = ox_utf8_seq(s, end))) {
+	    break;
+	}
+	s += n;
+    }
+    return s - str;
+}
+
+size_t
+ox_utf8_scrub(const char *src, size_t len, char *dst, int final, size_t *usedp) {
+    const char	*s = src;
+    const char	*end = src + len;
+    char	*d = dst;
+    size_t	valid;
+    int		n;
+
+    while (s < end) {
+	valid = ox_utf8_valid_len(s, end - s);
+	memcpy(d, s, valid);
+	d += valid;
+	s += valid;
+	if (end <= s) {
+	    break;
+	}
+	if (0 == (n = ox_utf8_seq(s, end))) {
+	    if (!final) {
+		break;
+	    }
+	    n = (int)(end - s);
+	} else {
+	    n = -n;
+	}
+	memcpy(d, UTF8_REPL, UTF8_REPL_LEN);
+	d += UTF8_REPL_LEN;
+	s += n;
+    }
+    *usedp = s - src;
+
+    return d - dst;
+}
+
+/* Windows-1252 characters 0x80 through 0x9F. The five that are not assigned
+ * are left as the C1 controls they are in ISO-8859-1.
+ */
+static const uint16_t	win1252[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+};
+
+inline static char*
+put_utf8(char *d, uint32_t u) {
+    if (0x80 > u) {
+	*d++ = (char)u;
+    } else if (0x800 > u) {
+	*d++ = (char)(0xC0 | (u >> 6));
+	*d++ = (char)(0x80 | (0x3F & u));
+    } else if (0x10000 > u) {
+	*d++ = (char)(0xE0 | (u >> 12));
+	*d++ = (char)(0x80 | (0x3F & (u >> 6)));
+	*d++ = (char)(0x80 | (0x3F & u));
+    } else {
+	*d++ = (char)(0xF0 | (u >> 18));
+	*d++ = (char)(0x80 | (0x3F & (u >> 12)));
+	*d++ = (char)(0x80 | (0x3F & (u >> 6)));
+	*d++ = (char)(0x80 | (0x3F & u));
+    }
+    return d;
+}
+
+// Runs of ASCII are converted 8 characters at a time with SSE2, which every
+// x86-64 CPU has, so there is no need to check for it.
+
+size_t
+ox_utf16_to_utf8(const char *src, size_t len, char *dst, int big_endian, int final, size_t *usedp) {
+    const uchar	*s = (const uchar*)src;
+    const uchar	*end = s + len;
+    char	*d = dst;
+    int		hi = big_endian ? 0 : 1;
+    int		lo = big_endian ? 1 : 0;
+    uint32_t	u;
+    uint32_t	u2;
+
+    while (s + 2 <= end) {
+#if UTF8_X86
+	while (s + 16 <= end) {
+	    __m128i	in = _mm_loadu_si128((const __m128i*)s);
+
+	    if (big_endian) {
+		in = _mm_or_si128(_mm_slli_epi16(in, 8), _mm_srli_epi16(in, 8));
+	    }
+	    if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(in, _mm_set1_epi16((short)0xFF80)),
+							    _mm_setzero_si128()))) {
+		break;
+	    }
+	    _mm_storel_epi64((__m128i*)d, _mm_packus_epi16(in, in));
+	    s += 16;
+	    d += 8;
+	}
+	if (end < s + 2) {
+	    break;
+	}
+#endif
+	u = ((uint32_t)s[hi] << 8) | s[lo];
+	if (0xD800 <= u && u <= 0xDBFF) {
+	    if (end < s + 4) {
+		if (!final) {
+		    break;
+		}
+		u = 0xFFFD;
+		s += 2;
+	    } else {
+		u2 = ((uint32_t)s[2 + hi] << 8) | s[2 + lo];
+		if (0xDC00 <= u2 && u2 <= 0xDFFF) {
+		    u = 0x10000 + ((u - 0xD800) << 10) + (u2 - 0xDC00);
+		    s += 4;
+		} else {
+		    u = 0xFFFD;
+		    s += 2;
+		}
+	    }
+	} else {
+	    if (0xDC00 <= u && u <= 0xDFFF) {
+		u = 0xFFFD;
+	    }
+	    s += 2;
+	}
+	d = put_utf8(d, u);
+    }
+    if (final && s < end) {
+	// An odd byte at the very end.
+	memcpy(d, UTF8_REPL, UTF8_REPL_LEN);
+	d += UTF8_REPL_LEN;
+	s = end;
+    }
+    *usedp = (const char*)s - src;
+
+    return d - dst;
+}
+
+size_t
+ox_latin1_to_utf8(const char *src, size_t len, char *dst, int cp1252) {
+    const uchar	*s = (const uchar*)src;
+    const uchar	*end = s + len;
+    char	*d = dst;
+
+    while (s < end) {
+#if UTF8_X86
+	while (s + 16 <= end) {
+	    __m128i	in = _mm_loadu_si128((const __m128i*)s);
+
+	    if (0 != _mm_movemask_epi8(in)) {
+		break;
+	    }
+	    _mm_storeu_si128((__m128i*)d, in);
+	    s += 16;
+	    d += 16;
+	}
+	if (end <= s) {
+	    break;
+	}
+#endif
+	if (0x80 > *s) {
+	    *d++ = (char)*s;
+	} else if (cp1252 && 0xA0 > *s) {
+	    d = put_utf8(d, win1252[*s - 0x80]);
+	} else {
+	    *d++ = (char)(0xC0 | (*s >> 6));
+	    *d++ = (char)(0x80 | (0x3F & *s));
+	}
+	s++;
+    }
+    return d - dst;
+}
+
+static inline int
+is_space(char c) {
+    return ' ' == c || '\t' == c || '\n' == c || '\r' == c;
+}
+
+const char*
+ox_declared_encoding(const char *s, size_t len, char *name, size_t size) {
+    const char	*end = s + len;
+    const char	*v;
+    char	q;
+
+    if (3 <= len && 0 == memcmp(s, "\xEF\xBB\xBF", 3)) {
+	s += 3;
+	len -= 3;
+    }
+    if (len < 5 || 0 != strncmp(s, "<?xml", 5)) {
+	return 0;
+    }
+    for (v = s + 5; v + 1 < end && !('?' == *v && '>' == v[1]); v++) {
+    }
+    end = v;
+    for (s += 5; s + 8 < end && 0 != strncmp(s, "encoding", 8); s++) {
+    }
+    for (s += 8; s < end && is_space(*s); s++) {
+    }
+    if (end <= s || '=' != *s) {
+	return 0;
+    }
+    for (s++; s < end && is_space(*s); s++) {
+    }
+    if (end <= s || ('"' != *s && '\'' != *s)) {
+	return 0;
+    }
+    q = *s++;
+    for (v = s; v < end && q != *v; v++) {
+    }
+    if (end <= v || size <= (size_t)(v - s)) {
+	return 0;
+    }
+    memcpy(name, s, v - s);
+    name[v - s] = '\0';
+
+    return name;
+}
@@ -0,0 +1,52 @@
+/* utf8.h
+ * Copyright (c) 2011, Peter Ohler
+ * All rights reserved.
+ */
+
+#ifndef __OX_UTF8_H__
+#define __OX_UTF8_H__
+
+#include <stddef.h>
+
+/* The replacement character, U+FFFD, written for each invalid sequence. */
+#define UTF8_REPL	"\xEF\xBF\xBD"
+#define UTF8_REPL_LEN	3
+
+/* Returns the length of the longest prefix of str that is valid UTF-8. A
+ * sequence cut off by the end of str is not part of the prefix.
+ */
+extern size_t	ox_utf8_valid_len(const char *str, size_t len);
+
+/* Checks the sequence starting at s. Returns its length if valid, the
+ * negative length of the invalid part if not, or 0 if end cuts it short.
+ */
+extern int	ox_utf8_seq(const char *s, const char *end);
+
+/* Copies src to dst replacing each invalid sequence with U+FFFD. Unless final
+ * is set a sequence cut off by the end of src is not copied. The number of
+ * src bytes used is returned in usedp and the number of dst bytes written is
+ * returned. dst must have room for 3 times len.
+ */
+extern size_t	ox_utf8_scrub(const char *src, size_t len, char *dst, int final, size_t *usedp);
+
+/* Converts UTF-16 to UTF-8, replacing unpaired surrogates with U+FFFD.
+ * Unless final is set a unit or surrogate pair cut off by the end of src is
+ * not converted. The number of src bytes used is returned in usedp and the
+ * number of dst bytes written is returned. dst may be the same memory as src
+ * as long as it starts at least len / 2 bytes before it.
+ */
+extern size_t	ox_utf16_to_utf8(const char *src, size_t len, char *dst, int big_endian, int final, size_t *usedp);
+
+/* Converts ISO-8859-1, or Windows-1252 if cp1252 is set, to UTF-8 and
+ * returns the number of bytes written. dst may be the same memory as src as
+ * long as it starts at least 2 * len bytes before it.
+ */
+extern size_t	ox_latin1_to_utf8(const char *src, size_t len, char *dst, int cp1252);
+
+/* Copies the encoding named in an XML declaration at the start of s, after
+ * any UTF-8 BOM, to name and returns it or returns 0 if there is none or it
+ * does not fit in size bytes.
+ */
+extern const char*	ox_declared_encoding(const char *s, size_t len, char *name, size_t size);
+
+#endif /* __OX_UTF8_H__ */
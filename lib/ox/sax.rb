@@ -32,7 +32,10 @@ module Ox
   # value() methods are called for the same element in the XML document the the
   # text() method is ignored if the value() method is defined or public. The
   # same is true for attr() and attr_value(). When all attribtues have been read
-  # the attr_done() callback will be invoked.
+  # the attr_done() callback will be invoked. In the same way cdata_value()
+  # and comment_value() take precedence over cdata() and comment(). The value
+  # passed to them is raw, the :convert_special and :skip options are never
+  # applied to it.
   #
   #    def instruct(target); end
   #    def end_instruct(target); end
@@ -41,11 +44,15 @@ module Ox
   #    def attrs_done(); end
   #    def doctype(str); end
   #    def comment(str); end
+  #    def comment_value(value); end
   #    def cdata(str); end
+  #    def cdata_value(value); end
   #    def text(str); end
   #    def value(value); end
   #    def start_element(name); end
   #    def end_element(name); end
+  #    def start_element_ns(uri, name); end
+  #    def end_element_ns(uri, name); end
   #    def abort(name); end
   #
   # Initializing _line_ attribute in the initializer will cause that variable to
@@ -53,6 +60,20 @@ module Ox
   # for the _column_ attribute but it will be updated with the column in the XML
   # file that is the start of the element or node just read. @pos if defined
   # will hold the number of bytes from the start of the document.
+  #
+  # The start_element_ns() and end_element_ns() callbacks are given the
+  # namespace URI of the element and the name without a prefix. Prefixes are
+  # resolved against the xmlns declarations in scope, including those on the
+  # element itself, and the URI is nil when the element is not in a namespace.
+  # Like names, URIs are Symbols unless the :symbolize option is false. The
+  # :strip_namespace option is ignored when either is public.
+  #
+  # Setting instance variables on every callback is not free. A cheaper
+  # alternative is to make the pos(), line(), and column() methods public in
+  # the handler. They then return the position of the current event only when
+  # called.
+  #
+  #    public :pos, :line, :column
   class Sax
     # Create a new instance of the Sax handler class.
     def initialize()
@@ -101,6 +122,12 @@ module Ox
 
     def end_element(name)
     end
+
+    def start_element_ns(uri, name)
+    end
+
+    def end_element_ns(uri, name)
+    end
     
     def error(message, line, column)
     end
@@ -30,20 +30,15 @@ ox_cache_test() {
     Cache       c;
     const char  **d;
     VALUE       v;
-    VALUE       *slot = 0;;
 
-    ox_cache_new(&c);
+    ox_cache_new(&c, 1);
     for (d = data; 0 != *d; d++) {
 	/*printf("*** cache_get on %s\n", *d);*/
-        v = ox_cache_get(c, *d, &slot, 0);
+        v = ox_cache_get(c, *d, 0);
         if (Qundef == v) {
-            if (0 == slot) {
-                /*printf("*** failed to get a slot for %s\n", *d); */
-            } else {
-                /*printf("*** added '%s' to cache\n", *d); */
-                v = ID2SYM(rb_intern(*d));
-                *slot = v;
-            }
+            /*printf("*** added '%s' to cache\n", *d); */
+            v = ID2SYM(rb_intern(*d));
+            ox_cache_set(c, *d, v, 0);
         } else {
             VALUE       rs = rb_funcall2(v, rb_intern("to_s"), 0, 0);
 
@@ -52,4 +47,5 @@ ox_cache_test() {
         /*ox_cache_print(c);*/
     }
     ox_cache_print(c);
+    ox_cache_free(c);
 }
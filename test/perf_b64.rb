@@ -0,0 +1,48 @@
+#!/usr/bin/env ruby
+
+$: << '.'
+$: << '..'
+$: << '../lib'
+$: << '../ext'
+
+if __FILE__ == $0
+  if (i = ARGV.index('-I'))
+    x = ARGV.slice!(i, 2)
+    $: << x[1]
+  end
+end
+
+require 'optparse'
+require 'ox'
+
+$verbose = 0
+$iter = 20
+$size = 4 # MBytes
+$cnt = 4
+
+opts = OptionParser.new
+opts.on("-v", "increase verbosity")                            { $verbose += 1 }
+opts.on("-i", "--iterations [Int]", Integer, "iterations")     { |it| $iter = it }
+opts.on("-s", "--size [Int]", Integer, "blob size in MBytes")  { |s| $size = s }
+opts.on("-c", "--count [Int]", Integer, "blobs per document")  { |c| $cnt = c }
+opts.on("-h", "--help", "Show this display")                   { puts opts; Process.exit!(0) }
+opts.parse(ARGV)
+
+# Binary Strings are dumped and loaded as base64.
+rnd = Random.new(1)
+obj = Array.new($cnt) { rnd.bytes($size * 1024 * 1024) }
+mb = $cnt * $size * $iter
+
+xml = nil
+start = Time.now
+$iter.times { xml = Ox.dump(obj, :mode => :object, :indent => -1) }
+dt = Time.now - start
+puts "dump %d MBytes of binary in %0.3f seconds, %0.1f MBytes/sec" % [mb, dt, mb / dt]
+
+loaded = nil
+start = Time.now
+$iter.times { loaded = Ox.load(xml, :mode => :object) }
+dt = Time.now - start
+puts "load %d MBytes of binary in %0.3f seconds, %0.1f MBytes/sec" % [mb, dt, mb / dt]
+
+raise "loaded blobs do not match" unless obj == loaded
@@ -0,0 +1,59 @@
+#!/usr/bin/env ruby
+
+$: << '.'
+$: << '..'
+$: << '../lib'
+$: << '../ext'
+
+if __FILE__ == $0
+  if (i = ARGV.index('-I'))
+    x = ARGV.slice!(i, 2)
+    $: << x[1]
+  end
+end
+
+require 'optparse'
+require 'stringio'
+require 'ox'
+
+$verbose = 0
+$iter = 10
+$size = 1_000_000
+
+opts = OptionParser.new
+opts.on("-v", "increase verbosity")                            { $verbose += 1 }
+opts.on("-i", "--iterations [Int]", Integer, "iterations")     { |it| $iter = it }
+opts.on("-s", "--size [Int]", Integer, "Floats per Array")     { |s| $size = s }
+opts.on("-h", "--help", "Show this display")                   { puts opts; Process.exit!(0) }
+opts.parse(ARGV)
+
+class Handler < Ox::Sax
+  attr_reader :sum
+  def initialize; @sum = 0.0; end
+  def value(v); @sum += v.as_f; end
+end
+
+# Floats are dumped with all the digits needed to read back the same value.
+rnd = Random.new(1)
+obj = Array.new($size) { rnd.rand * 10 ** rnd.rand(-8..8) }
+cnt = $size * $iter
+
+xml = nil
+start = Time.now
+$iter.times { xml = Ox.dump(obj, :mode => :object, :indent => -1) }
+dt = Time.now - start
+puts "dump %d Floats in %0.3f seconds, %0.1f million/sec" % [cnt, dt, cnt / dt / 1_000_000]
+
+loaded = nil
+start = Time.now
+$iter.times { loaded = Ox.load(xml, :mode => :object) }
+dt = Time.now - start
+puts "load %d Floats in %0.3f seconds, %0.1f million/sec" % [cnt, dt, cnt / dt / 1_000_000]
+
+start = Time.now
+$iter.times { Ox.sax_parse(Handler.new, StringIO.new(xml)) }
+dt = Time.now - start
+puts "sax as_f %d Floats in %0.3f seconds, %0.1f million/sec" % [cnt, dt, cnt / dt / 1_000_000]
+
+bad = obj.zip(loaded).count { |a, b| !a.eql?(b) }
+puts "#{bad} of #{$size} Floats did not round trip" if 0 < bad
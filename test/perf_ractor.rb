@@ -0,0 +1,86 @@
+#!/usr/bin/env ruby
+
+$: << '.'
+$: << '..'
+$: << '../lib'
+$: << '../ext'
+
+if __FILE__ == $0
+  if (i = ARGV.index('-I'))
+    x = ARGV.slice!(i, 2)
+    $: << x[1]
+  end
+end
+
+require 'optparse'
+require 'etc'
+require 'ox'
+
+$verbose = 0
+$iter = 200
+$max = Etc.nprocessors
+$size = 100 # KBytes
+$mode = :sax
+
+opts = OptionParser.new
+opts.on("-v", "increase verbosity")                            { $verbose += 1 }
+opts.on("-i", "--iterations [Int]", Integer, "iterations per Ractor") { |it| $iter = it }
+opts.on("-r", "--ractors [Int]", Integer, "maximum number of Ractors") { |r| $max = r }
+opts.on("-s", "--size [Int]", Integer, "document size in KBytes") { |s| $size = s }
+opts.on("-g", "generic parse instead of SAX")                  { $mode = :generic }
+opts.on("-o", "object load instead of SAX")                    { $mode = :object }
+opts.on("-h", "--help", "Show this display")                   { puts opts; Process.exit!(0) }
+opts.parse(ARGV)
+
+class CountSax < ::Ox::Sax
+  attr_reader :count
+
+  def initialize()
+    @count = 0
+  end
+
+  def start_element(name)
+    @count += 1
+  end
+end
+
+if :object == $mode
+  row = [1, 2.5, :sym, 'string', true, nil, { 'key' => 'value' }]
+  xml = Ox.dump([row] * ($size * 1024 / Ox.dump(row).size))
+else
+  row = %{  <row id="%d" name="name %d">text %d<cell>value</cell></row>\n}
+  xml = "<table>\n"
+  i = 0
+  while xml.size < $size * 1024
+    xml << row % [i, i, i]
+    i += 1
+  end
+  xml << "</table>\n"
+end
+xml = Ractor.make_shareable(xml.freeze)
+
+def parse(xml, mode, iter)
+  iter.times do
+    case mode
+    when :sax
+      Ox.sax_parse(CountSax.new, xml)
+    when :generic
+      Ox.load(xml, :mode => :generic)
+    when :object
+      Ox.load(xml, :mode => :object)
+    end
+  end
+end
+
+puts "#{$mode} parse of a #{xml.size / 1024} KByte document #{$iter} times in each Ractor on #{Etc.nprocessors} processors"
+base = nil
+cnt = 1
+while cnt <= $max
+  start = Time.now
+  rs = cnt.times.map { Ractor.new(xml, $mode, $iter) { |x, m, it| parse(x, m, it); it } }
+  total = rs.map(&:take).sum
+  dt = Time.now - start
+  base ||= total / dt
+  puts "%2d Ractors: %8.1f parses/sec  %5.2fx" % [cnt, total / dt, total / dt / base]
+  cnt *= 2
+end
@@ -0,0 +1,65 @@
+#!/usr/bin/env ruby
+
+$: << '.'
+$: << '..'
+$: << '../lib'
+$: << '../ext'
+
+if __FILE__ == $0
+  if (i = ARGV.index('-I'))
+    x = ARGV.slice!(i, 2)
+    $: << x[1]
+  end
+end
+
+require 'optparse'
+require 'ox'
+
+$verbose = 0
+$iter = 10
+$size = 20_000
+
+opts = OptionParser.new
+opts.on("-v", "increase verbosity")                            { $verbose += 1 }
+opts.on("-i", "--iterations [Int]", Integer, "iterations")     { |it| $iter = it }
+opts.on("-s", "--size [Int]", Integer, "items in the catalog") { |s| $size = s }
+opts.on("-h", "--help", "Show this display")                   { puts opts; Process.exit!(0) }
+opts.parse(ARGV)
+
+# A catalog with a few attributes and some text on each item.
+doc = Ox::Document.new(:version => '1.0')
+catalog = Ox::Element.new('catalog')
+doc << catalog
+$size.times do |i|
+  item = Ox::Element.new('item')
+  item[:id] = i.to_s
+  item[:sku] = "sku-#{i * 7}"
+  item[:price] = (i * 0.25).to_s
+  name = Ox::Element.new('name')
+  name << "Item number #{i} & friends"
+  item << name
+  desc = Ox::Element.new('description')
+  desc << "A fine item, number #{i}, that is <not> to be missed."
+  item << desc
+  catalog << item
+end
+
+xml_path = 'perf_snapshot.xml'
+snap_path = 'perf_snapshot.snap'
+Ox.to_file(xml_path, doc, :indent => 2)
+Ox.save_snapshot(Ox.load_file(xml_path, :mode => :generic, :symbolize_keys => true), snap_path)
+puts "XML is #{File.size(xml_path)} bytes, snapshot is #{File.size(snap_path)} bytes" if 0 < $verbose
+
+start = Time.now
+$iter.times { Ox.load_file(xml_path, :mode => :generic, :symbolize_keys => true) }
+xml_dt = Time.now - start
+puts "load_file %d times in %0.3f seconds, %0.1f loads/sec" % [$iter, xml_dt, $iter / xml_dt]
+
+start = Time.now
+$iter.times { Ox.load_snapshot(snap_path) }
+snap_dt = Time.now - start
+puts "load_snapshot %d times in %0.3f seconds, %0.1f loads/sec" % [$iter, snap_dt, $iter / snap_dt]
+puts "load_snapshot is %0.1f times faster" % [xml_dt / snap_dt]
+
+File.delete(xml_path)
+File.delete(snap_path)
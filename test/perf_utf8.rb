@@ -0,0 +1,60 @@
+#!/usr/bin/env ruby
+
+$: << '.'
+$: << '..'
+$: << '../lib'
+$: << '../ext'
+
+if __FILE__ == $0
+  if (i = ARGV.index('-I'))
+    x = ARGV.slice!(i, 2)
+    $: << x[1]
+  end
+end
+
+require 'optparse'
+require 'stringio'
+require 'ox'
+
+$iter = 20
+$size = 20_000
+
+opts = OptionParser.new
+opts.on("-i", "--iterations [Int]", Integer, "iterations")     { |it| $iter = it }
+opts.on("-s", "--size [Int]", Integer, "items in the document") { |s| $size = s }
+opts.on("-h", "--help", "Show this display")                   { puts opts; Process.exit!(0) }
+opts.parse(ARGV)
+
+class QuietSax < Ox::Sax
+  def text(value); end
+end
+
+# Mostly ASCII with some accented and wider characters like most real text.
+doc = Ox::Document.new(:version => '1.0')
+top = Ox::Element.new('top')
+doc << top
+$size.times do |i|
+  e = Ox::Element.new('entry')
+  e[:id] = i.to_s
+  e << "Café number #{i} costs €#{i % 100}, a long enough line of text \u{1F600}"
+  top << e
+end
+xml = Ox.dump(doc)
+puts "#{xml.bytesize} bytes of XML"
+
+[nil, :replace].each do |mode|
+  start = Time.now
+  $iter.times { Ox.load(xml, :mode => :generic, :invalid_utf8 => mode) }
+  dt = Time.now - start
+  puts "load with :invalid_utf8 => %-8s %d times in %0.3f seconds, %0.1f MB/sec" % [mode.inspect, $iter, dt, xml.bytesize * $iter / dt / 1_000_000]
+
+  start = Time.now
+  $iter.times { Ox.sax_parse(QuietSax.new, StringIO.new(xml), :invalid_utf8 => mode) }
+  dt = Time.now - start
+  puts "sax_parse with :invalid_utf8 => %-8s %d times in %0.3f seconds, %0.1f MB/sec" % [mode.inspect, $iter, dt, xml.bytesize * $iter / dt / 1_000_000]
+
+  start = Time.now
+  $iter.times { Ox.dump(doc, :invalid_utf8 => mode) }
+  dt = Time.now - start
+  puts "dump with :invalid_utf8 => %-8s %d times in %0.3f seconds, %0.1f MB/sec" % [mode.inspect, $iter, dt, xml.bytesize * $iter / dt / 1_000_000]
+end
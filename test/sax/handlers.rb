@@ -58,6 +58,12 @@ class AllSax < StartSax
   end
 end
 
+# Same as AllSax but with no error callback so the parser can skip position
+# tracking.
+class NoErrorSax < AllSax
+  private :error
+end
+
 class LineColSax < StartSax
   def initialize()
     @pos = nil    # this initializes the @pos variable which will then be set by the parser
@@ -111,6 +117,23 @@ class LineColSax < StartSax
   end
 end
 
+# Uses the pos(), line(), and column() readers instead of instance variables.
+class PosSax < StartSax
+  public :pos, :line, :column
+
+  def start_element(name)
+    @calls << [:start_element, name, pos, line, column]
+  end
+
+  def end_element(name)
+    @calls << [:end_element, name, pos, line, column]
+  end
+
+  def attr(name, value)
+    @calls << [:attr, name, value, pos, line, column]
+  end
+end
+
 class TypeSax < ::Ox::Sax
   attr_accessor :item
   # method to call on the Ox::Sax::Value Object
@@ -130,6 +153,75 @@ class TypeSax < ::Ox::Sax
   end
 end
 
+# Values of cdata and comments read lazily.
+class RawValueSax < ::Ox::Sax
+  attr_accessor :calls
+
+  def initialize()
+    @calls = []
+  end
+
+  def cdata_value(value)
+    @calls << [:cdata, value.as_s]
+  end
+
+  def comment_value(value)
+    @calls << [:comment, value.as_s]
+  end
+end
+
+# Keeps the String passed to each callback along with a copy of the content
+# at the time of the callback.
+class ReuseSax < ::Ox::Sax
+  attr_accessor :calls
+  attr_accessor :strings
+
+  def initialize()
+    @calls = []
+    @strings = []
+  end
+
+  def text(value)
+    @strings << value
+    @calls << [:text, value.dup]
+  end
+
+  def cdata(value)
+    @strings << value
+    @calls << [:cdata, value.dup]
+  end
+
+  def comment(value)
+    @strings << value
+    @calls << [:comment, value.dup]
+  end
+end
+
+# Elements reported with resolved namespaces.
+class NsSax < ::Ox::Sax
+  attr_accessor :calls
+
+  def initialize()
+    @calls = []
+  end
+
+  def start_element_ns(uri, name)
+    @calls << [:start_element_ns, uri, name]
+  end
+
+  def end_element_ns(uri, name)
+    @calls << [:end_element_ns, uri, name]
+  end
+
+  def attr(name, str)
+    @calls << [:attr, name, str]
+  end
+
+  def error(message, line, column)
+    @calls << [:error, message, line, column]
+  end
+end
+
 class ErrorSax < ::Ox::Sax
   attr_reader :errors
 
@@ -12,6 +12,7 @@ $: << File.join(File.dirname(__FILE__), "../../ext")
 $: << File.join(File.dirname(__FILE__), ".")
 
 require 'stringio'
+require 'tmpdir'
 require 'bigdecimal'
 
 use_minitest = RUBY_VERSION.start_with?('2.1.') && RUBY_ENGINE != 'rbx'
@@ -97,6 +98,67 @@ class SaxBaseTest < test_case
                   [:end_element, :top, 68, 6, 1]], handler.calls)
   end
 
+  def test_sax_file_gzip
+    Ox::default_options = $ox_sax_options
+    handler = AllSax.new()
+    input = File.open(File.join(File.dirname(__FILE__), 'trilevel.xml.gz'))
+    Ox.sax_parse(handler, input)
+    input.close
+    assert_equal([[:instruct, "xml"],
+                  [:attr, :version, "1.0"],
+                  [:end_instruct, "xml"],
+                  [:start_element, :top],
+                  [:start_element, :child],
+                  [:start_element, :grandchild],
+                  [:end_element, :grandchild],
+                  [:end_element, :child],
+                  [:end_element, :top]], handler.calls)
+  end
+
+  def test_sax_file_fifo
+    return unless File.respond_to?(:mkfifo)
+    Ox::default_options = $ox_sax_options
+    handler = AllSax.new()
+    path = File.join(Dir.tmpdir, "ox_sax_fifo_#{$$}")
+    File.mkfifo(path)
+    begin
+      ticks = 0
+      ticker = Thread.new { 20.times { sleep(0.01); ticks += 1 } }
+      writer = Thread.new {
+        File.open(path, 'w') { |f| f.write('<top><a/>'); f.flush; sleep(0.2); f.write('<b/></top>') }
+      }
+      File.open(path) { |f| Ox.sax_parse(handler, f) }
+      writer.join
+      ticker.join
+      # The ticker only finishes if the parse released the GVL while waiting.
+      assert_equal(20, ticks)
+    ensure
+      File.delete(path)
+    end
+    assert_equal([[:start_element, :top],
+                  [:start_element, :a],
+                  [:end_element, :a],
+                  [:start_element, :b],
+                  [:end_element, :b],
+                  [:end_element, :top]], handler.calls)
+  end
+
+  def test_sax_file_position_readers
+    Ox::default_options = $ox_sax_options
+    handler = PosSax.new()
+    input = File.open(File.join(File.dirname(__FILE__), 'trilevel.xml'))
+    Ox.sax_parse(handler, input)
+    input.close
+    assert_equal([[:attr, :version, "1.0", 15, 1, 15],
+                  [:start_element, :top, 23, 2, 1],
+                  [:start_element, :child, 31, 3, 3],
+                  [:start_element, :grandchild, 43, 4, 5],
+                  [:end_element, :grandchild, 55, 4, 17],
+                  [:end_element, :child, 59, 5, 3],
+                  [:end_element, :top, 68, 6, 1]], handler.calls)
+    assert_nil(handler.line)
+  end
+
   def test_sax_io_file
     Ox::default_options = $ox_sax_options
     handler = AllSax.new()
@@ -650,6 +712,41 @@ encoding = "UTF-8" ?>},
                    [:end_element, :top]])
   end
 
+  def test_sax_cdata_comment_big
+    Ox::default_options = $ox_sax_options
+    cdata = "some ]] > <text> -- -> ]>\n" * 1000
+    comment = "more - > ]]> <text> ->\n" * 1000
+    xml = %{<top>\n<![CDATA[#{cdata}]]><!--#{comment}-->\n<a/></top>}
+    parse_compare(xml,
+                  [[:start_element, :top],
+                   [:cdata, cdata],
+                   [:comment, comment],
+                   [:start_element, :a],
+                   [:end_element, :a],
+                   [:end_element, :top]])
+    handler = PosSax.new()
+    Ox.sax_parse(handler, StringIO.new(xml))
+    off = xml.index('<a/>')
+    assert_equal([:start_element, :a, off + 1, xml[0, off].count("\n") + 1, off - xml.rindex("\n", off)], handler.calls[1])
+  end
+
+  def test_sax_text_big_repeated
+    Ox::default_options = $ox_sax_options
+    expected = [[:start_element, :top]]
+    xml = '<top>'
+    [9000, 20, 70000, 5, 300000, 1].each do |len|
+      text = 'x' * len
+      xml << %{<a b="#{text}">#{text}</a>}
+      expected << [:start_element, :a]
+      expected << [:attr, :b, text]
+      expected << [:text, text]
+      expected << [:end_element, :a]
+    end
+    xml << '</top>'
+    expected << [:end_element, :top]
+    parse_compare(xml, expected)
+  end
+
   def test_sax_cdata_empty
     Ox::default_options = $ox_sax_options
     parse_compare(%{<?xml version="1.0"?>
@@ -734,6 +831,31 @@ encoding = "UTF-8" ?>},
                    [:end_element, :table]])
   end
 
+  def test_sax_no_position
+    Ox::default_options = $ox_sax_options
+    xml = %{<?xml version="1.0"?>
+<!DOCTYPE top>
+<top a="1">
+  <!-- comment - -->
+  <child><![CDATA[x]y]]></child>
+  <empty/>
+</top>
+}
+    parse_compare(xml, [[:instruct, "xml"],
+                        [:attr, :version, "1.0"],
+                        [:end_instruct, "xml"],
+                        [:doctype, " top"],
+                        [:start_element, :top],
+                        [:attr, :a, "1"],
+                        [:comment, " comment - "],
+                        [:start_element, :child],
+                        [:cdata, "x]y"],
+                        [:end_element, :child],
+                        [:start_element, :empty],
+                        [:end_element, :empty],
+                        [:end_element, :top]], NoErrorSax)
+  end
+
   def test_sax_encoding
     Ox::default_options = $ox_sax_options
     parse_compare(%{<?xml version="1.0" encoding="UTF-8"?>
@@ -848,6 +970,170 @@ encoding = "UTF-8" ?>},
     assert_equal('cheese', handler.item)
   end
 
+  def test_sax_name_strings
+    Ox::default_options = $ox_sax_options
+    handler = StartSax.new()
+    Ox.sax_parse(handler, StringIO.new(%{<?xml version="1.0" encoding="UTF-8"?><top><a/><a/></top>}), :symbolize => false)
+    names = handler.calls.select { |c| :start_element == c[0] }.map { |c| c[1] }
+    assert_equal(['top', 'a', 'a'], names)
+    names.each { |n| assert(n.frozen?) }
+    assert_equal(Encoding::UTF_8, names[1].encoding)
+    assert_same(names[1], names[2])
+  end
+
+  def test_sax_many_names
+    Ox::default_options = $ox_sax_options
+    # enough distinct names to make the name caches grow more than once
+    names = (0...2000).map { |i| "name#{i}" }
+    xml = '<top>' + names.map { |n| "<#{n}/>" }.join + '</top>'
+    [true, false].each do |symbolize|
+      handler = StartSax.new()
+      Ox.sax_parse(handler, xml, :symbolize => symbolize)
+      found = handler.calls.select { |c| :start_element == c[0] }.map { |c| c[1].to_s }
+      assert_equal(['top'] + names, found)
+    end
+  end
+
+  def test_sax_cache_limit_nested
+    Ox::default_options = $ox_sax_options
+    # a handler that can not be set up must not leave the caches in use
+    frozen = Class.new(::Ox::Sax) { def pos; end }.new.freeze
+    assert_raises(FrozenError) { Ox.sax_parse(frozen, '<top/>') }
+    # names of open elements must survive evictions during the parse
+    Ox::default_options = { :cache_limit => 8 }
+    names = (0...600).map { |i| "deep#{i}" }
+    xml = names.map { |n| "<#{n}>" }.join + names.reverse.map { |n| "</#{n}>" }.join
+    [true, false].each do |symbolize|
+      handler = AllSax.new()
+      Ox.sax_parse(handler, xml, :symbolize => symbolize)
+      assert_equal(names.map { |n| [:start_element, n] } + names.reverse.map { |n| [:end_element, n] },
+                   handler.calls.reject { |c| :text == c[0] }.map { |c| [c[0], c[1].to_s] })
+    end
+  ensure
+    Ox::default_options = { :cache_limit => nil }
+  end
+
+  def test_sax_namespaces
+    Ox::default_options = $ox_sax_options
+    parse_compare(%{<top xmlns="urn:a" xmlns:b = 'urn:b'>
+  <b:x id="1"><y xmlns=""/></b:x>
+  <y/>
+  <c:z/>
+  <xml:w/>
+</top>},
+                  [[:start_element_ns, 'urn:a', 'top'],
+                   [:attr, 'xmlns', 'urn:a'],
+                   [:attr, 'xmlns:b', 'urn:b'],
+                   [:start_element_ns, 'urn:b', 'x'],
+                   [:attr, 'id', '1'],
+                   [:start_element_ns, nil, 'y'],
+                   [:attr, 'xmlns', ''],
+                   [:end_element_ns, nil, 'y'],
+                   [:end_element_ns, 'urn:b', 'x'],
+                   [:start_element_ns, 'urn:a', 'y'],
+                   [:end_element_ns, 'urn:a', 'y'],
+                   [:error, "Invalid Element: namespace prefix of 'c:z' not declared", 4, 3],
+                   [:start_element_ns, nil, 'z'],
+                   [:end_element_ns, nil, 'z'],
+                   [:start_element_ns, 'http://www.w3.org/XML/1998/namespace', 'w'],
+                   [:end_element_ns, 'http://www.w3.org/XML/1998/namespace', 'w'],
+                   [:end_element_ns, 'urn:a', 'top']], NsSax, :symbolize => false)
+  end
+
+  def test_sax_namespaces_symbolize
+    Ox::default_options = $ox_sax_options
+    parse_compare(%{<a:top xmlns:a="urn:a"/>},
+                  [[:start_element_ns, :'urn:a', :top],
+                   [:attr, :'xmlns:a', 'urn:a'],
+                   [:end_element_ns, :'urn:a', :top]], NsSax)
+  end
+
+  def test_sax_cdata_comment_value
+    Ox::default_options = $ox_sax_options
+    parse_compare(%{<top><!-- a &amp; b --><![CDATA[x &lt; y]]></top>},
+                  [[:comment, " a &amp; b "],
+                   [:cdata, "x &lt; y"]], RawValueSax)
+  end
+
+  def test_sax_reuse_strings
+    Ox::default_options = $ox_sax_options
+    handler = ReuseSax.new()
+    Ox.sax_parse(handler, StringIO.new(%{<top>one<!--two--><![CDATA[three]]><a>four</a></top>}), :reuse_strings => true)
+    assert_equal([[:text, "one"],
+                  [:comment, "two"],
+                  [:cdata, "three"],
+                  [:text, "four"]], handler.calls)
+    assert_equal(1, handler.strings.map { |s| s.object_id }.uniq.size)
+  end
+
+  def test_sax_invalid_utf8
+    Ox::default_options = $ox_sax_options
+    xml = %{<top a="\xC3">x\xFFy\xF0\x9F\x98z</top>}.b
+    handler = AllSax.new()
+    Ox.sax_parse(handler, StringIO.new(xml), :invalid_utf8 => :replace)
+    assert_equal([[:start_element, :top],
+                  [:attr, :a, "\uFFFD"],
+                  [:text, "x\uFFFDy\uFFFDz"],
+                  [:end_element, :top]], handler.calls.map { |c| c.map { |v| v.is_a?(String) ? v.force_encoding('UTF-8') : v } })
+
+    handler = AllSax.new()
+    Ox.sax_parse(handler, StringIO.new(xml), :invalid_utf8 => :raise)
+    assert_equal([:error, "Invalid Format: invalid UTF-8 byte sequence", 1, 9], handler.calls[0])
+    assert_raises(Ox::ParseError) { Ox.sax_parse(NoErrorSax.new(), StringIO.new(xml), :invalid_utf8 => :raise) }
+
+    # a document declared in another encoding is left alone
+    sjis = %{<?xml version="1.0" encoding="Shift_JIS"?><top>\x93\xFA\x96\x7B</top>}.b
+    [:replace, :raise].each do |mode|
+      handler = AllSax.new()
+      Ox.sax_parse(handler, StringIO.new(sjis), :invalid_utf8 => mode)
+      assert_equal([:text, "\x93\xFA\x96\x7B".force_encoding('Shift_JIS')], handler.calls[-2])
+    end
+  end
+
+  def test_sax_invalid_utf8_split
+    Ox::default_options = $ox_sax_options
+    text = "h\u00E9llo \u20AC \u{1F600}"
+    input, w = IO.pipe
+    writer = Thread.new {
+      "<top>#{text}\xE2\x82</top>".b.each_char { |c| w.write(c); w.flush; sleep(0.001) }
+      w.close
+    }
+    handler = AllSax.new()
+    Ox.sax_parse(handler, input, :invalid_utf8 => :replace)
+    writer.join
+    assert_equal([:text, text + "\uFFFD"], handler.calls[1].map { |v| v.is_a?(String) ? v.force_encoding('UTF-8') : v })
+  end
+
+  def test_sax_utf16
+    Ox::default_options = $ox_sax_options
+    xml = %{<?xml version="1.0"?>\n<top a="\u00E9">h\u00E9llo \u20AC \u{1F600}</top>}
+    ["\uFEFF" + xml, xml].each do |src|
+      ['UTF-16LE', 'UTF-16BE'].each do |enc|
+        handler = AllSax.new()
+        Ox.sax_parse(handler, StringIO.new(src.encode(enc).b))
+        assert_equal([[:instruct, 'xml'],
+                      [:attr, :version, '1.0'],
+                      [:end_instruct, 'xml'],
+                      [:start_element, :top],
+                      [:attr, :a, "\u00E9"],
+                      [:text, "h\u00E9llo \u20AC \u{1F600}"],
+                      [:end_element, :top]], handler.calls, enc)
+        assert_equal('UTF-8', handler.calls[5][1].encoding.to_s)
+      end
+    end
+  end
+
+  def test_sax_latin1
+    Ox::default_options = $ox_sax_options
+    [['ISO-8859-1', "caf\xE9", "caf\u00E9"],
+     ['windows-1252', "\x93caf\xE9\x94 \x80", "\u201Ccaf\u00E9\u201D \u20AC"]].each do |enc, raw, text|
+      handler = AllSax.new()
+      Ox.sax_parse(handler, StringIO.new(%{<?xml version="1.0" encoding="#{enc}"?><top>#{raw}</top>}.b))
+      assert_equal([:text, text], handler.calls[-2])
+      assert_equal('UTF-8', handler.calls[-2][1].encoding.to_s)
+    end
+  end
+
   def test_sax_skip_none
     Ox::default_options = $ox_sax_options
     Ox::default_options = { :skip => :skip_none }
@@ -879,6 +1165,10 @@ encoding = "UTF-8" ?>},
     handler = TypeSax.new(:as_f)
     Ox.sax_parse(handler, StringIO.new(%{<top>7</top>}))
     assert_equal(7.0, handler.item)
+    ['0.30000000000000004', '-1.5e-7', '2.2250738585072011e-308', '123456789012345678901', '.5', 'inf'].each do |s|
+      Ox.sax_parse(handler, StringIO.new(%{<top>#{s}</top>}))
+      assert(s.to_f.eql?(handler.item) || (s == 'inf' && handler.item.infinite?), "#{s} read as #{handler.item}")
+    end
   end
 
   def test_sax_value_sym
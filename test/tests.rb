@@ -16,6 +16,7 @@ require 'minitest/autorun'
 require 'optparse'
 require 'date'
 require 'bigdecimal'
+require 'zlib'
 require 'ox'
 
 $ruby = RUBY_DESCRIPTION.split(' ')[0]
@@ -46,6 +47,9 @@ $ox_object_options = {
   :invalid_replace=>'',
   :strip_namespace=>false,
   :overlay=>nil,
+  :cache_limit=>nil,
+  :freeze=>false,
+  :invalid_utf8=>nil,
 }
 
 $ox_generic_options = {
@@ -66,6 +70,9 @@ $ox_generic_options = {
   :invalid_replace=>'',
   :strip_namespace=>false,
   :overlay=>nil,
+  :cache_limit=>nil,
+  :freeze=>false,
+  :invalid_utf8=>nil,
 }
 
 class Func < ::Minitest::Test
@@ -100,6 +107,9 @@ class Func < ::Minitest::Test
       :invalid_replace=>'*',
       :strip_namespace=>'spaced',
       :overlay=>nil,
+      :cache_limit=>nil,
+      :freeze=>true,
+      :invalid_utf8=>:replace,
     }
     o3 = { :xsd_date=>false }
     Ox.default_options = o2
@@ -140,6 +150,21 @@ class Func < ::Minitest::Test
     dump_and_load(1.000000000005, false)
   end
 
+  def test_float_round_trip
+    Ox::default_options = $ox_object_options
+    rnd = Random.new(5)
+    floats = [0.1 + 0.2, 1.0e23, 5.0e-324, 2.2250738585072014e-308, Float::MAX, -0.0, 123456789012345680.0]
+    floats += Array.new(2000) { [rnd.bytes(8)].pack('a8').unpack1('D') }.reject(&:nan?)
+    loaded = Ox.load(Ox.dump(floats, :mode => :object), :mode => :object)
+    floats.zip(loaded).each { |f, g| assert(f.eql?(g), "#{f} loaded as #{g}") }
+    assert_equal(%|<f>0.30000000000000004</f>\n|, Ox.dump(0.1 + 0.2, :mode => :object))
+    assert_equal(%|<f>1e+23</f>\n|, Ox.dump(1.0e23, :mode => :object))
+
+    b = Ox::Builder.new(:indent => -1)
+    floats.each { |f| b.text(f) }
+    assert_equal(floats.map(&:to_s).join, b.to_s)
+  end
+
   def test_string
     Ox::default_options = $ox_object_options
     dump_and_load('a string', false)
@@ -652,6 +677,64 @@ class Func < ::Minitest::Test
     end
   end
 
+  def test_object_plan_order
+    Ox::default_options = $ox_object_options
+    many = Bag.new(Hash[(1..70).map { |i| ["@v#{i}".to_sym, i] }])
+    dump_and_load([Bag.new(:@a => 1, :@b => 2, :@c => 3),
+                   Bag.new(:@a => 4, :@b => 5, :@c => 6),
+                   Bag.new(:@c => 7, :@a => 8),
+                   Bag.new(:@a => 9, :@b => 10, :@c => 11, :@d => 12),
+                   Bag.new(:@x => 13),
+                   many, many.dup], false)
+  end
+
+  def test_cache_limit
+    Ox::default_options = $ox_object_options
+    Ox.clear_caches
+    Ox.default_options = { :cache_limit => 64 }
+    xml = Ox.dump(Hash[(1..500).map { |i| ["k#{i}".to_sym, i] }], :mode => :object)
+    3.times { Ox.load(xml, :mode => :object) }
+    stats = Ox.cache_stats[:symbols]
+    assert_equal(64, stats[:limit])
+    assert(stats[:size] <= 64, "size #{stats[:size]} over the limit")
+    assert(0 < stats[:evictions])
+    assert_equal(64, Ox.default_options[:cache_limit])
+
+    Ox.clear_caches
+    assert_equal(0, Ox.cache_stats[:symbols][:size])
+    assert_equal(Hash[(1..500).map { |i| ["k#{i}".to_sym, i] }], Ox.load(xml, :mode => :object))
+  ensure
+    Ox.default_options = { :cache_limit => nil }
+    assert_nil(Ox.cache_stats[:symbols][:limit])
+  end
+
+  def test_gc_compact
+    return unless GC.respond_to?(:verify_compaction_references)
+    Ox::default_options = $ox_object_options
+    obj = Bag.new(:@a => :sym_compact, :@b => [1, 'two', :three])
+    xml = Ox.dump(obj, :mode => :object)
+    Ox.load(xml, :mode => :object)
+    doc = Ox.load('<top attr="1"><child/></top>', :mode => :generic, :symbolize_keys => true)
+    begin
+      GC.verify_compaction_references(expand_heap: true, toward: :empty)
+    rescue NotImplementedError
+      return
+    end
+    assert_equal(obj, Ox.load(xml, :mode => :object))
+    assert_equal(Ox.dump(doc), Ox.dump(Ox.load('<top attr="1"><child/></top>', :mode => :generic, :symbolize_keys => true)))
+  end
+
+  def test_binary_string
+    Ox::default_options = $ox_object_options
+    rnd = Random.new(3)
+    [0, 1, 2, 3, 47, 48, 49, 100, 1000, 100_000].each do |n|
+      s = rnd.bytes(n)
+      xml = Ox.dump([s, "x\0y"], :mode => :object, :indent => -1)
+      assert_equal([s, "x\0y"], Ox.load(xml, :mode => :object))
+    end
+    assert_equal(%|<a><b>eABi</b></a>\n|, Ox.dump(["x\0b"], :mode => :object, :indent => -1))
+  end
+
   def test_complex
     Ox::default_options = $ox_object_options
     dump_and_load(Bag.new(:@o => Bag.new(:@a => [2]), :@a => [1, {:b => 3, :a => [5], :c => Bag.new(:@x => 7)}]), false)
@@ -1178,6 +1261,116 @@ comment --/>
 |, xml)
   end
 
+  def test_load_file_gzip
+    filename = File.join(File.dirname(__FILE__), 'create_file_test.xml.gz')
+    Zlib::GzipWriter.open(filename) { |gz| gz.write(%{<top><child a="x">#{'text ' * 10000}</child></top>}) }
+    doc = Ox.load_file(filename, :mode => :generic)
+    File.delete(filename)
+    assert_equal('top', doc.value)
+    assert_equal('x', doc.nodes[0][:a])
+    assert_equal(10000, doc.nodes[0].nodes[0].scan('text').size)
+  end
+
+  def test_snapshot
+    xml = %{<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE top>
+<top a="1" b="é">
+  <!-- comment -->
+  <empty/>
+  <child c="&lt;x&gt;"><![CDATA[<raw>]]>text &amp; more</child>
+  <?pi some content?>
+</top>
+}
+    filename = File.join(File.dirname(__FILE__), 'create_file_test.xml.snap')
+    [true, false].each do |sym_keys|
+      doc = Ox.load(xml, :mode => :generic, :symbolize_keys => sym_keys)
+      Ox.save_snapshot(doc, filename)
+      loaded = Ox.load_snapshot(filename)
+      assert_equal(Ox.dump(doc), Ox.dump(loaded))
+      assert_equal(doc.root.attributes, loaded.root.attributes)
+      assert_equal(doc.root.nodes.map(&:class), loaded.root.nodes.map(&:class))
+      assert_equal(doc.root.b.encoding, loaded.root.b.encoding)
+      assert(!loaded.root.nodes[1].instance_variable_defined?(:@nodes))
+    end
+    File.binwrite(filename, File.binread(filename)[0..-3])
+    assert_raise(Ox::ParseError) { Ox.load_snapshot(filename) }
+    Ox.save_snapshot(Ox.load('<top zq="1">x</top>', :mode => :generic, :symbolize_keys => true), filename)
+    File.binwrite(filename, File.binread(filename).sub('zq', "\xFFq".b))
+    assert_raise(Ox::ParseError) { Ox.load_snapshot(filename) }
+    File.delete(filename)
+    assert_raise(TypeError) { Ox.save_snapshot([1, 2], filename) }
+  end
+
+  def test_freeze
+    xml = %{<?xml version="1.0"?>
+<top a="1"><b x="y">text</b><b x="y">text</b><c/><!-- c --><?pi content?></top>
+<!-- after -->
+}
+    doc = Ox.load(xml, :mode => :generic, :freeze => true)
+    assert(doc.frozen?)
+    assert(doc.root.nodes.frozen?)
+    assert(doc.root.attributes.frozen?)
+    assert(doc.nodes[-1].frozen?)
+    assert(doc.root.nodes[0].nodes[0].equal?(doc.root.nodes[1].nodes[0]))
+    assert_equal(Ox.dump(Ox.load(xml, :mode => :generic)), Ox.dump(doc))
+    assert(!Ox.load(xml, :mode => :generic).root.frozen?)
+
+    obj = Bag.new(:@a => [1, 'two', { 'k' => :v }], :@b => 'str')
+    loaded = Ox.load(Ox.dump(obj), :mode => :object, :freeze => true)
+    assert_equal(obj, loaded)
+    assert(loaded.frozen?)
+    a = loaded.instance_variable_get(:@a)
+    assert(a.frozen?)
+    assert(a[2].frozen?)
+    assert(loaded.instance_variable_get(:@b).frozen?)
+
+    if defined?(Ractor)
+      assert(Ractor.shareable?(doc))
+      assert(Ractor.shareable?(loaded))
+    end
+  end
+
+  def test_invalid_utf8
+    xml = %{<top a="b\xFFc">x\xFFy\xE2\x82z \xC3\xA9<b>#{'long text ' * 8}\xED\xA0\x80</b></top>}.b
+    doc = Ox.load(xml, :mode => :generic, :invalid_utf8 => :replace)
+    assert_equal("b\uFFFDc", doc.attributes[:a].force_encoding('UTF-8'))
+    assert_equal("x\uFFFDy\uFFFDz \u00E9", doc.nodes[0].force_encoding('UTF-8'))
+    assert_equal('long text ' * 8 + "\uFFFD\uFFFD\uFFFD", doc.nodes[1].nodes[0].force_encoding('UTF-8'))
+    err = assert_raises(Ox::ParseError) { Ox.load(xml, :mode => :generic, :invalid_utf8 => :raise) }
+    assert_match(/invalid UTF-8 .* column 10/, err.message)
+    assert_equal("x\xFFy".b, Ox.load(xml, :mode => :generic).nodes[0][0, 3].b)
+
+    e = Ox::Element.new('e')
+    e << "q\xFFr".force_encoding('UTF-8')
+    assert_equal(%{<e>q\uFFFDr</e>\n}, Ox.dump(e, :indent => -1, :invalid_utf8 => :replace).force_encoding('UTF-8'))
+    assert_raises(EncodingError) { Ox.dump(e, :invalid_utf8 => :raise) }
+
+    # text in another encoding is left alone
+    sjis = %{<?xml version="1.0" encoding="Shift_JIS"?><top>\x93\xFA\x96\x7B</top>}.b
+    [:replace, :raise].each do |mode|
+      doc = Ox.load(sjis, :mode => :generic, :invalid_utf8 => mode)
+      assert_equal("\x93\xFA\x96\x7B".b, doc.nodes[0].nodes[0].b)
+      assert_equal('Shift_JIS', doc.nodes[0].nodes[0].encoding.to_s)
+    end
+    e = Ox::Element.new('e')
+    e << "caf\xE9".force_encoding('ISO-8859-1')
+    assert_equal(%{<e>caf\xE9</e>\n}.b, Ox.dump(e, :indent => -1, :invalid_utf8 => :raise).b)
+    assert_equal(%{<e>caf\xE9</e>\n}.b, Ox.dump(e, :indent => -1, :invalid_utf8 => :replace).b)
+  end
+
+  def test_ractor_parse
+    return unless defined?(Ractor)
+    xml = Ractor.make_shareable(%{<top><child a="x">text</child><other/></top>}.freeze)
+    obj = Ractor.make_shareable(Ox.dump([1, :sym, 'str', { :a => 2.5 }]).freeze)
+    rs = 3.times.map {
+      Ractor.new(xml, obj) { |x, o|
+        doc = Ox.load(x, :mode => :generic, :symbolize_keys => true)
+        [doc.nodes.map(&:value), doc.nodes[0][:a], Ox.load(o, :mode => :object)]
+      }
+    }
+    rs.each { |r| assert_equal([['child', 'other'], 'x', [1, :sym, 'str', { :a => 2.5 }]], r.take) }
+  end
+
   def test_builder_file
     filename = File.join(File.dirname(__FILE__), 'create_file_test.xml')
     b = Ox::Builder.file(filename, :indent => 2)
@@ -1256,6 +1449,86 @@ comment --/>
 |, xml)
   end
 
+  def test_template
+    t = Ox::Template.compile(%|<order id="{{id}}" note="{{ note }}">{{#items}}<item sku="{{sku}}">{{name}}/{{customer}}</item>{{/items}}{{#tags}}<tag>{{.}}</tag>{{/tags}}{{&raw}}</order>|)
+    xml = t.render(:id => 7, :note => %|"a" & <b>|, :customer => 'Bob', :raw => '<x/>',
+                   :items => [{ :sku => 's1', :name => 'one <1>' }, { 'sku' => 's2', 'name' => :two }],
+                   :tags => ['a', 2])
+    assert_equal(%|<order id="7" note="&quot;a&quot; &amp; &lt;b&gt;"><item sku="s1">one &lt;1&gt;/Bob</item><item sku="s2">two/Bob</item><tag>a</tag><tag>2</tag><x/></order>|, xml)
+    assert_equal(%|<order id="" note=""></order>|, t.render({}))
+    assert_equal('1-x;2-y;', Ox::Template.compile('{{#rows}}{{0}}-{{1}};{{/rows}}').render(:rows => [[1, :x], [2, 'y']]))
+  end
+
+  def test_template_errors
+    ['{{#a}}', '{{/a}}', '{{#a}}{{/b}}', '<a>{{x</a>', '{{ }}'].each { |src|
+      assert_raises(Ox::ParseError) { Ox::Template.compile(src) }
+    }
+    assert_raises(TypeError) { Ox::Template.compile(:sym) }
+    assert_equal([], Ox::Template.private_instance_methods(false))
+    # a raise in the middle of a render larger than the stack buffer
+    t = Ox::Template.compile('{{#rows}}<r>{{.}}</r>{{/rows}}')
+    rows = ['x' * 1000] * 30 + ["bad\x01"]
+    assert_raises(SyntaxError) { t.render(:rows => rows) }
+    assert_equal('<r>ok</r>', t.render(:rows => ['ok']))
+  end
+
+  def test_builder_file_gzip
+    filename = File.join(File.dirname(__FILE__), 'create_file_test.xml.gz')
+    Ox::Builder.file(filename, :indent => 0, :size => 16, :gzip => 9) { |b|
+      b.element('top') {
+        1000.times { |i| b.element('child', :i => i.to_s) { b.text('text') } }
+      }
+    }
+    xml = Zlib::GzipReader.open(filename) { |gz| gz.read }
+    File.delete(filename)
+    assert_equal(%|<top>| + (0...1000).map { |i| %|<child i="#{i}">text</child>| }.join + %|</top>\n|, xml)
+    File.write(filename, 'keep')
+    assert_raises(Ox::ArgError) { Ox::Builder.file(filename, :gzip => 10) }
+    assert_equal('keep', File.read(filename))
+    File.delete(filename)
+  end
+
+  def test_to_file_gzip
+    filename = File.join(File.dirname(__FILE__), 'create_file_test.xml.gz')
+    Ox.to_file(filename, [1, 'two', :three], :mode => :object, :indent => -1, :gzip => true)
+    xml = Zlib::GzipReader.open(filename) { |gz| gz.read }
+    File.delete(filename)
+    assert_equal(Ox.dump([1, 'two', :three], :mode => :object, :indent => -1), xml)
+    assert_raises(Ox::ArgError) { Ox.to_file(filename, 1, :gzip => 10) }
+  end
+
+  def test_dump_hash
+    h = { 'person' => { '@id' => 7, 'name' => 'A & B', 'tag' => ['x', 'y'], 'empty' => nil, 'note' => { '#text' => 'hi', '@lang' => 'en' } } }
+    assert_equal(%|<person id="7">
+  <name>A &amp; B</name>
+  <tag>x</tag>
+  <tag>y</tag>
+  <empty/>
+  <note lang="en">hi</note>
+</person>
+|, Ox.dump_hash(h, :indent => 2))
+    assert_equal(%|<top><a>1</a><b c="2">3</b></top>\n|,
+                 Ox.dump_hash({ :a => 1, :b => { :_c => 2, :text => 3 } }, :root => :top, :attr_prefix => '_', :text_key => 'text', :indent => -1))
+    assert_equal(%|<row n="1"/><row n="2"/>\n|, Ox.dump_hash([{ '@n' => 1 }, { '@n' => 2 }], :root => 'row', :indent => -1))
+    bad = Object.new
+    def bad.to_s; raise ArgumentError, 'no text'; end
+    assert_raises(ArgumentError) { Ox.dump_hash({ 'a' => { 'b' => bad } }) }
+    assert_raises(Ox::ArgError) { Ox.dump_hash({ 'a&b' => 1 }, :root => 'r') }
+    assert_raises(Ox::ArgError) { Ox.dump_hash({ 'x y' => 2 }, :root => 'r') }
+    assert_raises(Ox::ArgError) { Ox.dump_hash({ 'r' => { %|@k"><i| => 'v' } }) }
+    assert_raises(Ox::ArgError) { Ox.dump_hash({ 'a' => 1 }, :root => '1r') }
+    assert_raises(Ox::ArgError) { Ox.dump_hash({ '@x' => 1, 'a' => 1 }) }
+    assert_equal(%|<a>1</a><b>2</b>\n|, Ox.dump_hash({ 'a' => 1, 'b' => 2 }, :indent => -1))
+  end
+
+  def test_dump_hash_io
+    require 'stringio'
+    h = { 'rows' => { 'row' => (1..5000).map { |i| { '@i' => i, 'v' => "value #{i}" } } } }
+    io = StringIO.new
+    Ox.dump_hash_io(io, h, :indent => 1)
+    assert_equal(Ox.dump_hash(h, :indent => 1), io.string)
+  end
+
   def test_builder_block_file
     filename = File.join(File.dirname(__FILE__), 'create_file_test.xml')
     Ox::Builder.file(filename, :indent => 2) { |b|
@@ -1321,6 +1594,32 @@ comment --/>
     assert_equal(%|<?xml version="1.0" encoding="UTF-8"?><one a="ack" b="back">hello</one>|, xml)
   end
 
+  def test_builder_each_chunk
+    chunks = []
+    xml = Ox::Builder.new(:indent => 2) { |b|
+      b.each_chunk(16) { |s| chunks << s }
+      b.instruct(:xml, :version => '1.0', :encoding => 'UTF-8')
+      b.element('one', :a => "ack") {
+        10.times { |i| b.element('two') { b.text("text #{i}") } }
+      }
+    }
+    assert_equal('', xml)
+    assert(1 < chunks.size)
+    expect = %|<?xml version="1.0" encoding="UTF-8"?>\n<one a="ack">\n| + (0...10).map { |i| "  <two>text #{i}</two>\n" }.join + "</one>\n"
+    assert_equal(expect, chunks.join)
+  end
+
+  def test_builder_flush_chunk
+    b = Ox::Builder.new(:indent => -1)
+    b.element('one')
+    assert_equal('<one', b.flush_chunk)
+    b.text('hello')
+    assert_equal('>hello', b.flush_chunk)
+    assert_equal('', b.flush_chunk)
+    b.close()
+    assert_equal('</one>', b.flush_chunk)
+  end
+
   def dump_and_load(obj, trace=false, circular=false)
     xml = Ox.dump(obj, :indent => $indent, :circular => circular)
     puts xml if trace